@@ -0,0 +1,451 @@
+/*! @file blkq.c
+    @brief Block request queue between storage users and storage drivers.
+    @copyright Copyright (c) 2024-2025 University of Illinois
+
+*/
+
+#ifdef BLKQ_TRACE
+#define TRACE
+#endif
+
+#ifdef BLKQ_DEBUG
+#define DEBUG
+#endif
+
+#include "blkq.h"
+
+#include "conf.h"
+#include "console.h"
+#include "device.h"
+#include "devimpl.h"
+#include "error.h"
+#include "heap.h"
+#include "intr.h"
+#include "memory.h"
+#include "misc.h"
+#include "string.h"
+#include "thread.h"
+#include "uio.h"
+
+// COMPILE-TIME PARAMETERS
+//
+
+// Largest command (in bytes) that adjacent requests are merged into. The merge
+// buffer is one physical page, so it can be at most PAGE_SIZE.
+
+#ifndef BLKQ_MAX_MERGE
+#define BLKQ_MAX_MERGE PAGE_SIZE
+#endif
+
+#if BLKQ_MAX_MERGE > PAGE_SIZE
+#error "BLKQ_MAX_MERGE larger than PAGE_SIZE"
+#endif
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+struct blkq_req {
+    struct blkq_req *next;   // next request in sector order
+    unsigned long long pos;  // byte offset on the backing device
+    void *buf;               // caller's buffer
+    unsigned long len;       // number of bytes to transfer
+    int write;               // 1 for store, 0 for fetch
+    int async;               // queued while plugged; freed on completion
+    int done;                // set once the driver has completed the request
+    long result;             // bytes transferred or negative error code
+};
+
+struct blkq {
+    struct storage base;          // storage device presented to queue users
+    struct storage_intf intf;     // interface of base, blksz copied from sto
+    struct storage *sto;          // backing storage device (the driver)
+    struct blkq_req *pending;     // pending requests, sorted by pos
+    unsigned long long head;      // position just past the last dispatched request
+    int plugged;                  // plug depth, requests are held while non-zero
+    int busy;                     // set while some thread is dispatching
+    long error;                   // first error from a queued store
+    char *bounce;                 // merge buffer (one page, BLKQ_MAX_MERGE bytes used)
+    struct condition done;        // signalled whenever requests complete
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int blkq_open(struct storage *sto);
+static void blkq_close(struct storage *sto);
+static long blkq_fetch(struct storage *sto, unsigned long long pos, void *buf,
+                       unsigned long bytecnt);
+static long blkq_store(struct storage *sto, unsigned long long pos, const void *buf,
+                       unsigned long bytecnt);
+static int blkq_flush(struct storage *sto);
+static int blkq_cntl(struct storage *sto, int op, void *arg);
+static void *blkq_direct(struct storage *sto);
+
+static long blkq_submit(struct blkq *q, struct blkq_req *req);
+static void blkq_enqueue(struct blkq *q, struct blkq_req *req);
+static struct blkq_req *blkq_pick_run(struct blkq *q, unsigned long *lenptr);
+static void blkq_run(struct blkq *q);
+static long blkq_dispatch(struct blkq *q, struct blkq_req *run, unsigned long total);
+
+// INTERNAL GLOBAL CONSTANTS
+//
+
+static const struct storage_intf blkq_intf = {
+    .open = &blkq_open,
+    .close = &blkq_close,
+    .fetch = &blkq_fetch,
+    .store = &blkq_store,
+    .flush = &blkq_flush,
+    .cntl = &blkq_cntl,
+    .direct = &blkq_direct
+};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * @brief Creates a request queue on top of an opened storage device.
+ * @param sto Backing storage device, already opened.
+ * @param qptr Pointer to the queue pointer to fill in.
+ * @return 0 on success, negative error code if error
+ */
+int create_blkq(struct storage *sto, struct blkq **qptr) {
+    struct blkq *q;
+
+    if (sto == NULL || qptr == NULL) return -EINVAL;
+    if (storage_blksz(sto) == 0 || BLKQ_MAX_MERGE % storage_blksz(sto) != 0) return -EINVAL;
+
+    q = kcalloc(1, sizeof(*q));
+    if (q == NULL) return -ENOMEM;
+
+    q->bounce = alloc_phys_page();  // too large for the heap
+    if (q->bounce == NULL) {
+        kfree(q);
+        return -ENOMEM;
+    }
+
+    q->intf = blkq_intf;
+    q->intf.blksz = storage_blksz(sto);  // queue accepts what the driver accepts
+    q->sto = sto;
+    storage_init(&q->base, &q->intf, storage_capacity(sto));
+    condition_init(&q->done, "blkq_done");
+
+    *qptr = q;
+    return 0;
+}
+
+/**
+ * @brief Returns the storage device through which requests enter the queue.
+ * @param q Pointer to the request queue.
+ * @return Storage device backed by the queue
+ */
+struct storage *blkq_storage(struct blkq *q) { return &q->base; }
+
+/**
+ * @brief Plugs the queue: stores are held (and merged) until the matching unplug.
+ * @param q Pointer to the request queue.
+ */
+void blkq_plug(struct blkq *q) {
+    long pie = disable_interrupts();
+    q->plugged += 1;
+    restore_interrupts(pie);
+}
+
+/**
+ * @brief Unplugs the queue. When the last plug is removed, every held request is
+ * dispatched in elevator order and the call waits until all of them complete.
+ * @param q Pointer to the request queue.
+ * @return 0 on success, first error reported by a held store otherwise
+ */
+int blkq_unplug(struct blkq *q) {
+    long pie;
+    long err;
+
+    pie = disable_interrupts();
+
+    if (q->plugged > 0) q->plugged -= 1;
+
+    if (q->plugged != 0) {
+        restore_interrupts(pie);
+        return 0;
+    }
+
+    blkq_run(q);
+
+    while (q->pending != NULL || q->busy)  // another thread is still dispatching
+        condition_wait(&q->done);
+
+    err = q->error;
+    q->error = 0;
+    restore_interrupts(pie);
+
+    return err;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static int blkq_open(struct storage *sto) {
+    return 0;  // backing device is opened by whoever created the queue
+}
+
+static void blkq_close(struct storage *sto) {
+    struct blkq *q = (struct blkq *)sto;
+
+    q->plugged = 1;
+    blkq_unplug(q);
+    storage_close(q->sto);
+}
+
+static long blkq_fetch(struct storage *sto, unsigned long long pos, void *buf,
+                       unsigned long bytecnt) {
+    struct blkq *q = (struct blkq *)sto;
+    struct blkq_req req = { .pos = pos, .buf = buf, .len = bytecnt, .write = 0 };
+
+    if (bytecnt == 0) return 0;
+    return blkq_submit(q, &req);
+}
+
+static long blkq_store(struct storage *sto, unsigned long long pos, const void *buf,
+                       unsigned long bytecnt) {
+    struct blkq *q = (struct blkq *)sto;
+    struct blkq_req sreq = { .pos = pos, .buf = (void *)buf, .len = bytecnt, .write = 1 };
+    struct blkq_req *req = &sreq;
+
+    if (bytecnt == 0) return 0;
+
+    // While plugged, a store is held on the queue and completed by the unplug,
+    // so it must outlive this call.
+
+    if (q->plugged) {
+        req = kmalloc(sizeof(*req));
+        if (req == NULL) return -ENOMEM;
+        *req = sreq;
+        req->async = 1;
+    }
+
+    return blkq_submit(q, req);
+}
+
+static int blkq_flush(struct storage *sto) {
+    struct blkq *q = (struct blkq *)sto;
+    int result;
+
+    // A barrier covers every store issued before it, including held ones.
+
+    blkq_plug(q);
+    result = blkq_unplug(q);
+
+    if (result < 0) return result;
+
+    return storage_flush(q->sto);
+}
+
+static int blkq_cntl(struct storage *sto, int op, void *arg) {
+    struct blkq *q = (struct blkq *)sto;
+    int result;
+
+    switch (op) {
+    case FCNTL_PLUG:
+        blkq_plug(q);
+        return 0;
+    case FCNTL_UNPLUG:
+        return blkq_unplug(q);
+    case FCNTL_DISCARD:
+    case FCNTL_WRITE_ZEROES:
+        // Held stores to the range must reach the device before it is cleared.
+        blkq_plug(q);
+        result = blkq_unplug(q);
+        if (result < 0) return result;
+        return storage_cntl(q->sto, op, arg);
+    default:
+        return storage_cntl(q->sto, op, arg);
+    }
+}
+
+// A memory-backed device has nothing to queue for; a cache on top of the queue
+// uses its memory in place and never submits requests.
+
+static void *blkq_direct(struct storage *sto) {
+    struct blkq *q = (struct blkq *)sto;
+
+    return storage_direct(q->sto);
+}
+
+/**
+ * @brief Adds a request to the queue and, unless it is a held store, runs the
+ * queue and waits for the request to complete.
+ * @param q Pointer to the request queue.
+ * @param req Request to submit.
+ * @return Bytes transferred, or negative error code if error
+ */
+long blkq_submit(struct blkq *q, struct blkq_req *req) {
+    long pie;
+    long result;
+
+    trace("%s(pos=%llu,len=%lu,write=%d)", __func__, req->pos, req->len, req->write);
+
+    pie = disable_interrupts();
+    blkq_enqueue(q, req);
+
+    if (req->async) {
+        restore_interrupts(pie);
+        return req->len;  // completed (or failed) by blkq_unplug
+    }
+
+    blkq_run(q);
+
+    // If another thread was already dispatching, it picks up our request (most
+    // likely merged with its neighbours) before it goes idle.
+
+    while (!req->done) condition_wait(&q->done);
+
+    result = req->result;
+    restore_interrupts(pie);
+    return result;
+}
+
+/**
+ * @brief Inserts a request into the pending list, keeping it sorted by position.
+ * Requests for the same position keep their submission order. Must be called
+ * with interrupts disabled.
+ * @param q Pointer to the request queue.
+ * @param req Request to insert.
+ */
+void blkq_enqueue(struct blkq *q, struct blkq_req *req) {
+    struct blkq_req **link = &q->pending;
+
+    while (*link != NULL && (*link)->pos <= req->pos) link = &(*link)->next;
+
+    req->next = *link;
+    *link = req;
+}
+
+/**
+ * @brief Removes the next run of requests from the pending list. The run starts
+ * at the first request at or past the head position (wrapping around to the
+ * lowest position, C-LOOK) and extends over requests of the same direction that
+ * continue exactly where the previous one ended, up to BLKQ_MAX_MERGE bytes.
+ * Must be called with interrupts disabled.
+ * @param q Pointer to the request queue.
+ * @param lenptr Filled in with the total length of the run.
+ * @return First request of the run (linked through next), NULL if queue is empty
+ */
+struct blkq_req *blkq_pick_run(struct blkq *q, unsigned long *lenptr) {
+    struct blkq_req **link = &q->pending;
+    struct blkq_req *first, *last;
+    unsigned long total;
+
+    if (q->pending == NULL) return NULL;
+
+    while (*link != NULL && (*link)->pos < q->head) link = &(*link)->next;
+
+    if (*link == NULL) link = &q->pending;  // wrap around to lowest position
+
+    first = last = *link;
+    total = first->len;
+
+    while (last->next != NULL && last->next->write == first->write &&
+           last->next->pos == last->pos + last->len &&
+           total + last->next->len <= BLKQ_MAX_MERGE) {
+        last = last->next;
+        total += last->len;
+    }
+
+    *link = last->next;  // unlink [first, last]
+    last->next = NULL;
+
+    q->head = first->pos + total;
+    *lenptr = total;
+    return first;
+}
+
+/**
+ * @brief Dispatches pending requests until the queue is empty. Returns at once if
+ * another thread is already dispatching. Must be called with interrupts disabled;
+ * they are re-enabled while the driver is working.
+ * @param q Pointer to the request queue.
+ */
+void blkq_run(struct blkq *q) {
+    struct blkq_req *run, *req, *next;
+    unsigned long total, off;
+    long result;
+
+    if (q->busy) return;
+
+    q->busy = 1;
+
+    while ((run = blkq_pick_run(q, &total)) != NULL) {
+        enable_interrupts();
+        result = blkq_dispatch(q, run, total);
+        disable_interrupts();
+
+        // Hand each request its share of the transfer.
+
+        for (off = 0, req = run; req != NULL; req = next) {
+            next = req->next;
+
+            if (result < 0)
+                req->result = result;
+            else if (result <= off)
+                req->result = 0;
+            else
+                req->result = MIN(req->len, result - off);
+
+            off += req->len;
+
+            if (req->async) {
+                if (req->result != req->len && q->error == 0)
+                    q->error = (req->result < 0) ? req->result : -EIO;
+                kfree(req);
+            } else
+                req->done = 1;
+        }
+
+        condition_broadcast(&q->done);
+    }
+
+    q->busy = 0;
+    condition_broadcast(&q->done);
+}
+
+/**
+ * @brief Issues one run of merged requests to the backing device. A run whose
+ * buffers are adjacent in memory goes to the driver as is; otherwise it goes
+ * through the bounce buffer.
+ * @param q Pointer to the request queue.
+ * @param run First request of the run.
+ * @param total Total length of the run in bytes.
+ * @return Bytes transferred, or negative error code if error
+ */
+long blkq_dispatch(struct blkq *q, struct blkq_req *run, unsigned long total) {
+    struct blkq_req *req;
+    unsigned long off;
+    long result;
+
+    for (req = run; req->next != NULL; req = req->next)
+        if (req->next->buf != (char *)req->buf + req->len) break;
+
+    if (req->next == NULL) {  // single request or contiguous buffers
+        if (run->write)
+            return storage_store(q->sto, run->pos, run->buf, total);
+        else
+            return storage_fetch(q->sto, run->pos, run->buf, total);
+    }
+
+    debug("%s: merged run at %llu, %lu bytes", __func__, run->pos, total);
+
+    if (run->write) {
+        for (off = 0, req = run; req != NULL; off += req->len, req = req->next)
+            memcpy(q->bounce + off, req->buf, req->len);
+        return storage_store(q->sto, run->pos, q->bounce, total);
+    }
+
+    result = storage_fetch(q->sto, run->pos, q->bounce, total);
+
+    for (off = 0, req = run; req != NULL && 0 < result && off < result;
+         off += req->len, req = req->next)
+        memcpy(req->buf, q->bounce + off, MIN(req->len, result - off));
+
+    return result;
+}
@@ -0,0 +1,28 @@
+/*! @file blkq.h
+    @brief Block request queue between storage users and storage drivers.
+    @copyright Copyright (c) 2024-2025 University of Illinois
+
+*/
+
+#ifndef _BLKQ_H_
+#define _BLKQ_H_
+
+struct storage;  // external
+struct blkq;     // opaque decl.
+
+// A block request queue sits on top of an opened storage device and is itself
+// a storage device (see blkq_storage). Requests that arrive while the device
+// is busy, or while the queue is plugged, are held in sector order and merged
+// with their neighbours before being handed to the driver as one command.
+//
+// The queue is plugged and unplugged either directly or through
+// storage_cntl(FCNTL_PLUG) and storage_cntl(FCNTL_UNPLUG) on the queue's
+// storage device. While plugged, stores are queued and return immediately; the
+// caller must keep the buffer unchanged until the queue is unplugged.
+
+extern int create_blkq(struct storage* sto, struct blkq** qptr);
+extern struct storage* blkq_storage(struct blkq* q);
+extern void blkq_plug(struct blkq* q);
+extern int blkq_unplug(struct blkq* q);
+
+#endif  // _BLKQ_H_
@@ -24,6 +24,7 @@
 #include "misc.h"
 #include "string.h"
 #include "thread.h"
+#include "uio.h"
 #include <stdbool.h>
 
 
@@ -31,6 +32,7 @@
 //
 
 static int cache_evict_entry(struct cache *cache);
+static void cache_drop_range(struct cache *cache, unsigned long long pos, unsigned long long len);
 
 
 struct cache_entry{
@@ -55,6 +57,7 @@ struct cache{
 
     unsigned int timer;// simple time counter for LRU tracking
     int last_used; // index of the most recently returned cache block
+    char *direct; // backing memory of a memory-backed device (storage_direct), blocks are used in place
     struct lock mtx;
     struct condition any_cv;  
 };
@@ -81,6 +84,8 @@ int create_cache(struct storage* disk, struct cache** cptr) {
     cache->last_used = -1; // no previous block marked as used yet
     lock_init(&cache->mtx); //cache initialization
 
+    cache->direct = storage_direct(disk); // ramdisk: no copies at all
+
     condition_init(&cache->any_cv, "cache_any_wait");
     cache->entries = kcalloc(64, sizeof(*cache->entries));
     if (!cache->entries) { kfree(cache); return -ENOMEM; }
@@ -134,6 +139,12 @@ int cache_get_block(struct cache* cache, unsigned long long pos, void** pptr) {
     if (!cache || !cache->stor || !pptr) return -EINVAL; // quick arg validation: need cache, storage, and output ptr
     if (pos % CACHE_BLKSZ != 0) return -EINVAL; // enforce block alignment for pos
 
+    if (cache->direct) { // memory-backed device, hand out the block itself
+        if (pos + CACHE_BLKSZ > storage_capacity(cache->stor)) return -EINVAL;
+        *pptr = cache->direct + pos;
+        return 0;
+    }
+
     lock_acquire(&cache->mtx);
 
     unsigned long long position = pos/CACHE_BLKSZ; // convert byte offset to block index
@@ -233,6 +244,7 @@ void cache_release_block(struct cache* cache, void* pblk, int dirty) {
     // FIXME
 
     if (!cache || !pblk) return; // invalid inputs, nothing to do
+    if (cache->direct) return; // writes already went to the device memory
 
     lock_acquire(&cache->mtx);
 
@@ -259,7 +271,7 @@ void cache_release_block(struct cache* cache, void* pblk, int dirty) {
 }
 
 /**
- * @brief Flushes the cache to the backing device
+ * @brief Flushes the cache to the backing device and issues a device flush (write barrier)
  * @param cache Pointer to the cache to flush
  * @return 0 on success, error code if error
  */
@@ -267,27 +279,185 @@ int cache_flush(struct cache* cache) {
     // writes all dirty blocks in the cache back to the storage device
 
     if(!cache || !cache->stor) return -EINVAL; // check for invalid cache or missing backing store
+    if(cache->direct) return 0; // nothing is ever dirty in a memory-backed cache
 
     lock_acquire(&cache->mtx);
 
+    // hold the stores on the device queue so they go out sorted and merged;
+    // devices without a request queue just return -ENOTSUP here
+    int plugged = (storage_cntl(cache->stor, FCNTL_PLUG, NULL) == 0);
 
     for(int i=0; i<64; i++){ // iterate through all cache entries
         if(cache->entries[i].valid && cache->entries[i].dirty){ // only flush valid dirty blocks
             unsigned long long evict_pos = (unsigned long long)cache->entries[i].block_n * CACHE_BLKSZ; // compute byte offset
             long ret = storage_store(cache->stor, evict_pos, cache->entries[i].data, CACHE_BLKSZ); // write block back to disk
             if (ret < 0){
+                if (plugged) storage_cntl(cache->stor, FCNTL_UNPLUG, NULL);
                 lock_release(&cache->mtx);
                 return ret; // write failure
             }
             if ((unsigned long)ret != CACHE_BLKSZ){
+                if (plugged) storage_cntl(cache->stor, FCNTL_UNPLUG, NULL);
                 lock_release(&cache->mtx);
                 return -EIO; // incomplete write
             }
             cache->entries[i].dirty = false; // mark entry as clean after flush
         }
     }
+
+    if (plugged) {
+        long ret = storage_cntl(cache->stor, FCNTL_UNPLUG, NULL); // dispatch and wait for the held stores
+        if (ret < 0){
+            lock_release(&cache->mtx);
+            return ret;
+        }
+    }
+
+    // one barrier for the whole batch so the writes above are durable when we return;
+    // devices without a volatile write cache have nothing to flush
+    int ret = storage_flush(cache->stor);
+    if (ret < 0 && ret != -ENOTSUP){
+        lock_release(&cache->mtx);
+        return ret;
+    }
+
     lock_release(&cache->mtx);
-    return 0; // success — all dirty blocks flushed
+    return 0; // success — all dirty blocks flushed and durable
+}
+
+/**
+ * @brief Sets a range of the backing device to zeros. Cached copies of the range are dropped and
+ * the device clears it with FCNTL_WRITE_ZEROES; devices without it get zero blocks written
+ * through the cache instead.
+ * @param cache Pointer to the cache
+ * @param pos Position of the range, aligned to CACHE_BLKSZ
+ * @param len Length of the range in bytes, a multiple of CACHE_BLKSZ
+ * @return 0 on success, negative error code if error
+ */
+int cache_zero_range(struct cache* cache, unsigned long long pos, unsigned long long len){
+    if(!cache || !cache->stor) return -EINVAL; // check for invalid cache or missing backing store
+    if(pos % CACHE_BLKSZ != 0 || len % CACHE_BLKSZ != 0) return -EINVAL; // whole blocks only
+
+    struct storage_range range = { .pos = pos, .len = len };
+
+    if(cache->direct){ // clearing memory is as cheap as it gets
+        if(pos + len > storage_capacity(cache->stor)) return -EINVAL;
+        memset(cache->direct + pos, 0, len);
+        return 0;
+    }
+
+    lock_acquire(&cache->mtx);
+    cache_drop_range(cache, pos, len); // stale copies would shadow (or overwrite) the zeros
+    int ret = storage_cntl(cache->stor, FCNTL_WRITE_ZEROES, &range); // let the device do it
+    lock_release(&cache->mtx);
+
+    if(ret != -ENOTSUP) return ret;
+
+    for(unsigned long long off = 0; off < len; off += CACHE_BLKSZ){ // fallback: zero blocks in the cache
+        void* blk = NULL;
+        ret = cache_get_block(cache, pos + off, &blk);
+        if(ret < 0) return ret;
+        memset(blk, 0, CACHE_BLKSZ);
+        cache_release_block(cache, blk, 1); // written back on eviction or flush
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Tells the backing device that a range no longer holds data (FCNTL_DISCARD). Cached copies
+ * of the range are dropped without being written back.
+ * @param cache Pointer to the cache
+ * @param pos Position of the range, aligned to CACHE_BLKSZ
+ * @param len Length of the range in bytes, a multiple of CACHE_BLKSZ
+ * @return 0 on success (also when the device cannot discard), negative error code if error
+ */
+int cache_discard_range(struct cache* cache, unsigned long long pos, unsigned long long len){
+    if(!cache || !cache->stor) return -EINVAL; // check for invalid cache or missing backing store
+    if(pos % CACHE_BLKSZ != 0 || len % CACHE_BLKSZ != 0) return -EINVAL; // whole blocks only
+
+    struct storage_range range = { .pos = pos, .len = len };
+
+    if(cache->direct) return 0; // memory has nothing to reclaim
+
+    lock_acquire(&cache->mtx);
+    cache_drop_range(cache, pos, len); // freed data is not worth writing back
+    int ret = storage_cntl(cache->stor, FCNTL_DISCARD, &range);
+    lock_release(&cache->mtx);
+
+    if(ret == -ENOTSUP) return 0; // discard is only a hint
+    return ret;
+}
+
+/**
+ * @brief Reads a run of consecutive blocks with a single device request, without bringing them
+ * into the cache. Blocks the cache already holds (possibly dirty) are copied from the cache, so
+ * the result is the same as reading each block through cache_get_block().
+ * @param cache Pointer to the cache
+ * @param pos Position of the run, aligned to CACHE_BLKSZ
+ * @param buf Buffer to fill
+ * @param len Length of the run in bytes, a multiple of CACHE_BLKSZ
+ * @return 0 on success, negative error code if error
+ */
+int cache_read_range(struct cache* cache, unsigned long long pos, void* buf, unsigned long len){
+    if(!cache || !cache->stor || !buf) return -EINVAL; // check for invalid cache or missing backing store
+    if(pos % CACHE_BLKSZ != 0 || len % CACHE_BLKSZ != 0) return -EINVAL; // whole blocks only
+
+    if(cache->direct){ // the device memory is the cache
+        if(pos + len > storage_capacity(cache->stor)) return -EINVAL;
+        memcpy(buf, cache->direct + pos, len);
+        return 0;
+    }
+
+    lock_acquire(&cache->mtx); // no block of the run can be loaded or evicted under us
+
+    long ret = storage_fetch(cache->stor, pos, buf, len); // one request for the whole run
+    if(ret < 0){
+        lock_release(&cache->mtx);
+        return ret;
+    }
+    if((unsigned long)ret != len){
+        lock_release(&cache->mtx);
+        return -EIO; // short read => I/O error
+    }
+
+    unsigned long long first = pos / CACHE_BLKSZ; // first block of the run
+    unsigned long long end = (pos + len) / CACHE_BLKSZ; // block just past the run
+
+    for(int i = 0; i < 64; i++){ // cached copies are newer than the device when dirty
+        if(cache->entries[i].valid && cache->entries[i].block_n >= first && cache->entries[i].block_n < end)
+            memcpy((char*)buf + (cache->entries[i].block_n - first) * CACHE_BLKSZ, cache->entries[i].data, CACHE_BLKSZ);
+    }
+
+    lock_release(&cache->mtx);
+    return 0;
+}
+
+static void cache_drop_range(struct cache* cache, unsigned long long pos, unsigned long long len){
+    unsigned long long first = pos / CACHE_BLKSZ; // first block of the range
+    unsigned long long end = (pos + len) / CACHE_BLKSZ; // block just past the range
+
+    for(int i = 0; i < 64; i++){
+        if(!cache->entries[i].valid || cache->entries[i].block_n < first || cache->entries[i].block_n >= end)
+            continue;
+
+        while (cache->entries[i].in_use && cache->entries[i].owner_tid != running_thread()) { // wait out other users
+            cache->entries[i].waiters += 1;
+            lock_release(&cache->mtx);
+            condition_wait(&cache->any_cv);
+            lock_acquire(&cache->mtx);
+            cache->entries[i].waiters -= 1;
+        }
+
+        if(!cache->entries[i].valid || cache->entries[i].block_n < first || cache->entries[i].block_n >= end)
+            continue; // evicted or reused while we slept
+
+        if(cache->last_used == i) cache->last_used = -1; // drop our own pin
+        cache->entries[i].valid = false; // contents are no longer what the device holds
+        cache->entries[i].dirty = false; // and must not be written back
+        cache->entries[i].in_use = false;
+        cache->entries[i].owner_tid = -1;
+    }
 }
 
 int cache_evict_entry(struct cache* cache){
@@ -16,5 +16,10 @@ extern int create_cache(struct storage* sto, struct cache** cptr);
 extern int cache_get_block(struct cache* cache, unsigned long long pos, void** pptr);
 extern void cache_release_block(struct cache* cache, void* pblk, int dirty);
 extern int cache_flush(struct cache* cache);
+extern int cache_zero_range(struct cache* cache, unsigned long long pos, unsigned long long len);
+extern int cache_discard_range(struct cache* cache, unsigned long long pos,
+                               unsigned long long len);
+extern int cache_read_range(struct cache* cache, unsigned long long pos, void* buf,
+                            unsigned long len);
 
 #endif  // _CACHE_H_
@@ -62,6 +62,36 @@
 #define UMEM_END ((void*)UMEM_END_VMA)
 #define UMEM_SIZE (UMEM_END - UMEM_START)
 
+// User memory layout above the program image: the sbrk heap grows up from
+// UHEAP_START_VMA to UMMAP_START_VMA, memory mappings (FCNTL_MMAP) are placed
+// above it, the stack grows down from UMEM_END_VMA by at most USTACK_MAX, and
+// USTACK_GUARD bytes below the stack are never mapped.
+
+#ifndef UHEAP_START_VMA
+#define UHEAP_START_VMA 0x0E0000000UL
+#endif
+
+#ifndef UMMAP_START_VMA
+#define UMMAP_START_VMA 0x0F0000000UL
+#endif
+
+#ifndef USTACK_MAX
+#define USTACK_MAX (8UL << 20)
+#endif
+
+#ifndef USTACK_GUARD
+#define USTACK_GUARD (64UL << 10)
+#endif
+
+#define USTACK_LOW_VMA (UMEM_END_VMA - USTACK_MAX)
+#define UMMAP_END_VMA (USTACK_LOW_VMA - USTACK_GUARD)
+#define UHEAP_END_VMA UMMAP_START_VMA
+
+#if UMMAP_END_VMA <= UMMAP_START_VMA || UHEAP_END_VMA <= UHEAP_START_VMA || \
+    UHEAP_START_VMA <= UMEM_START_VMA
+#error "user heap, mappings and stack do not fit between UMEM_START_VMA and UMEM_END_VMA"
+#endif
+
 // Number of external interrupt sources
 
 #ifndef NIRQ
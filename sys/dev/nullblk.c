@@ -0,0 +1,443 @@
+/*! @file nullblk.c
+    @brief Null storage device that completes every request at once
+    @copyright Copyright (c) 2024-2025 University of Illinois
+
+*/
+
+#ifdef NULLBLK_DEBUG
+#define DEBUG
+#endif
+
+#ifdef NULLBLK_TRACE
+#define TRACE
+#endif
+
+#include "nullblk.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cache.h"
+#include "conf.h"
+#include "console.h"
+#include "devimpl.h"
+#include "error.h"
+#include "heap.h"
+#include "memory.h"
+#include "misc.h"
+#include "riscv.h"
+#include "string.h"
+#include "thread.h"
+#include "timer.h"
+#include "uio.h"
+
+#ifndef NULLBLK_NAME
+#define NULLBLK_NAME "nullblk"
+#endif
+
+#define NULLBLK_LEAF_PAGES (PAGE_SIZE / sizeof(void *))  // retained pages mapped by one leaf table
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+/**
+ * @brief Storage device without backing store. Stores are dropped, fetches return zeros, a
+ * pattern or whatever the buffer held, after an optional synthetic latency. With
+ * NULLBLK_F_RETAIN, stored pages are kept in memory and read back.
+ */
+struct nullblk
+{
+    struct storage storage;   ///< Storage struct of the null device
+    unsigned long latency_us; ///< Synthetic completion latency of every request
+    int flags;                ///< NULLBLK_F_* flags
+    struct lock lock;         ///< Guards the retained page tables
+    void ***dir;              ///< Leaf tables of retained pages, NULL where nothing was stored
+    unsigned long ndir;       ///< Entries in dir
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int nullblk_open(struct storage *sto);
+static void nullblk_close(struct storage *sto);
+static long nullblk_fetch(struct storage *sto, unsigned long long pos, void *buf,
+                          unsigned long bytecnt);
+static long nullblk_store(struct storage *sto, unsigned long long pos, const void *buf,
+                          unsigned long bytecnt);
+static int nullblk_flush(struct storage *sto);
+static int nullblk_cntl(struct storage *sto, int cmd, void *arg);
+
+static void nullblk_delay(const struct nullblk *nb);
+static void nullblk_fill(const struct nullblk *nb, unsigned long long pos, void *buf,
+                         unsigned long bytecnt);
+static void *nullblk_page(struct nullblk *nb, unsigned long long pgno, int create);
+static void nullblk_drop(struct nullblk *nb);
+static long nullblk_retain_fetch(struct nullblk *nb, unsigned long long pos, void *buf,
+                                 unsigned long bytecnt);
+static long nullblk_retain_store(struct nullblk *nb, unsigned long long pos, const void *buf,
+                                 unsigned long bytecnt);
+
+// INTERNAL GLOBAL CONSTANTS
+//
+
+static const struct storage_intf nullblk_intf = {
+    .blksz = CACHE_BLKSZ,
+    .open = &nullblk_open,
+    .close = &nullblk_close,
+    .fetch = &nullblk_fetch,
+    .store = &nullblk_store,
+    .flush = &nullblk_flush,
+    .cntl = &nullblk_cntl};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * @brief Creates and registers a null storage device.
+ * @param size Capacity in bytes, rounded down to the block size
+ * @param latency_us Synthetic latency added to every request, 0 for none
+ * @param flags NULLBLK_F_* flags
+ * @return Instance number of the registered device, or negative error code if error
+ */
+int nullblk_attach(unsigned long long size, unsigned long latency_us, int flags)
+{
+    size = ROUND_DOWN(size, nullblk_intf.blksz);
+
+    if (size == 0)
+        return -EINVAL;
+
+    struct nullblk *nb = kcalloc(1, sizeof(*nb));
+
+    if (nb == NULL)
+        return -ENOMEM;
+
+    if (flags & NULLBLK_F_IMAGE)
+        flags |= NULLBLK_F_RETAIN;
+
+    nb->latency_us = latency_us;
+    nb->flags = flags;
+    lock_init(&nb->lock);
+
+    storage_init(&nb->storage, &nullblk_intf, size);
+
+    if (flags & NULLBLK_F_RETAIN)
+    {
+        unsigned long long npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+        nb->ndir = (npages + NULLBLK_LEAF_PAGES - 1) / NULLBLK_LEAF_PAGES;
+        nb->dir = kcalloc(nb->ndir, sizeof(*nb->dir));
+
+        if (nb->dir == NULL)
+        {
+            kfree(nb);
+            return -ENOMEM;
+        }
+    }
+
+    if (flags & NULLBLK_F_IMAGE)
+    {
+        // External symbols from linker script for embedded blob data
+        extern char _kimg_blob_start[], _kimg_blob_end[];
+        unsigned long imgsz = (unsigned long)(_kimg_blob_end - _kimg_blob_start);
+        long result = 0;  // kernel linked without a blob: start out empty
+
+        if (imgsz > size)
+            result = -EINVAL;
+        else if (imgsz != 0)
+            result = nullblk_retain_store(nb, 0, _kimg_blob_start, imgsz);
+
+        if (result != (long)imgsz)
+        {
+            nullblk_drop(nb);
+            return (result < 0) ? result : -ENOMEM;
+        }
+    }
+
+    int regno = register_device(NULLBLK_NAME, DEV_STORAGE, &nb->storage);
+
+    if (regno < 0)
+    {
+        nullblk_drop(nb);
+        return regno;
+    }
+
+    kprintf("nullblk: attached %s%d (%llu bytes, %lu us)\n", NULLBLK_NAME, regno, size,
+            latency_us);
+
+    return regno;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+static int nullblk_open(struct storage *sto)
+{
+    return 0;
+}
+
+static void nullblk_close(struct storage *sto)
+{
+}
+
+/**
+ * @brief Completes a read without touching any media, or from the retained pages with
+ * NULLBLK_F_RETAIN.
+ * @param sto Storage struct pointer for the null device
+ * @param pos Position in storage to read from
+ * @param buf Buffer to fill (unretained data is left as is unless NULLBLK_F_ZERO or
+ * NULLBLK_F_PATTERN is set)
+ * @param bytecnt Number of bytes to read
+ * @return Number of bytes read
+ */
+static long nullblk_fetch(struct storage *sto, unsigned long long pos, void *buf,
+                          unsigned long bytecnt)
+{
+    struct nullblk *nb = (struct nullblk *)((char *)sto - offsetof(struct nullblk, storage));
+
+    if (pos >= sto->capacity)
+        return 0;
+
+    bytecnt = MIN(bytecnt, sto->capacity - pos);
+
+    if (nb->flags & NULLBLK_F_RETAIN)
+        nullblk_retain_fetch(nb, pos, buf, bytecnt);
+    else
+        nullblk_fill(nb, pos, buf, bytecnt);
+
+    nullblk_delay(nb);
+    return bytecnt;
+}
+
+/**
+ * @brief Completes a write by dropping the data, or by keeping it with NULLBLK_F_RETAIN.
+ * @param sto Storage struct pointer for the null device
+ * @param pos Position in storage to write to
+ * @param buf Buffer with the data (only read with NULLBLK_F_RETAIN)
+ * @param bytecnt Number of bytes to write
+ * @return Number of bytes written, or -ENOMEM if no page could be retained
+ */
+static long nullblk_store(struct storage *sto, unsigned long long pos, const void *buf,
+                          unsigned long bytecnt)
+{
+    struct nullblk *nb = (struct nullblk *)((char *)sto - offsetof(struct nullblk, storage));
+    long result;
+
+    if (pos >= sto->capacity)
+        return 0;
+
+    bytecnt = MIN(bytecnt, sto->capacity - pos);
+    result = bytecnt;
+
+    if (nb->flags & NULLBLK_F_RETAIN)
+        result = nullblk_retain_store(nb, pos, buf, bytecnt);
+
+    nullblk_delay(nb);
+    return result;
+}
+
+static int nullblk_flush(struct storage *sto)
+{
+    return 0;  // nothing is ever cached
+}
+
+/**
+ * @brief _cntl_ functions for the null device.
+ * @param sto Storage struct pointer for the null device
+ * @param cmd command to execute. nullblk supports FCNTL_GETEND.
+ * @param arg Argument for commands
+ * @return 0 on success, error on failure or unsupported command
+ */
+static int nullblk_cntl(struct storage *sto, int cmd, void *arg)
+{
+    if (cmd == FCNTL_GETEND)
+    {
+        if (arg == NULL)
+            return -EINVAL;
+
+        *(unsigned long long *)arg = sto->capacity;
+        return 0;
+    }
+
+    return -ENOTSUP;
+}
+
+/**
+ * @brief Fills a buffer the way a fetch of unretained data does: zeros, the offset pattern or
+ * nothing, depending on the flags.
+ * @param nb Null device
+ * @param pos Device offset of the first byte of buf
+ * @param buf Buffer to fill
+ * @param bytecnt Number of bytes to fill
+ */
+static void nullblk_fill(const struct nullblk *nb, unsigned long long pos, void *buf,
+                         unsigned long bytecnt)
+{
+    if (nb->flags & NULLBLK_F_PATTERN)
+    {
+        // Each word holds its device offset, so a reader can check it got the right block
+        unsigned long whole = ROUND_DOWN(bytecnt, sizeof(uint64_t));
+
+        for (unsigned long i = 0; i < whole; i += sizeof(uint64_t))
+            *(uint64_t *)((char *)buf + i) = pos + i;
+
+        if (whole < bytecnt)  // partial last word, never write past the buffer
+        {
+            uint64_t word = pos + whole;
+            memcpy((char *)buf + whole, &word, bytecnt - whole);
+        }
+    }
+    else if (nb->flags & NULLBLK_F_ZERO)
+        memset(buf, 0, bytecnt);
+}
+
+/**
+ * @brief Looks up the retained page holding a device page. Caller holds nb->lock.
+ * @param nb Null device with NULLBLK_F_RETAIN
+ * @param pgno Device page number
+ * @param create Allocate the page (and its leaf table) if it was never stored to. A new page
+ * starts out with what a fetch of unretained data returns.
+ * @return Retained page, or NULL if there is none (or it could not be allocated)
+ */
+static void *nullblk_page(struct nullblk *nb, unsigned long long pgno, int create)
+{
+    void ***leaf = &nb->dir[pgno / NULLBLK_LEAF_PAGES];
+    void **slot;
+
+    if (*leaf == NULL)
+    {
+        if (!create)
+            return NULL;
+
+        *leaf = alloc_phys_page();
+        if (*leaf == NULL)
+            return NULL;
+
+        memset(*leaf, 0, PAGE_SIZE);
+    }
+
+    slot = &(*leaf)[pgno % NULLBLK_LEAF_PAGES];
+
+    if (*slot == NULL && create)
+    {
+        *slot = alloc_phys_page();
+        if (*slot == NULL)
+            return NULL;
+
+        memset(*slot, 0, PAGE_SIZE);
+        nullblk_fill(nb, pgno * PAGE_SIZE, *slot, PAGE_SIZE);
+    }
+
+    return *slot;
+}
+
+/**
+ * @brief Reads retained data. Pages never stored to read like unretained data.
+ * @param nb Null device with NULLBLK_F_RETAIN
+ * @param pos Position to read from, within capacity
+ * @param buf Buffer to fill
+ * @param bytecnt Number of bytes to read, within capacity
+ * @return Number of bytes read
+ */
+static long nullblk_retain_fetch(struct nullblk *nb, unsigned long long pos, void *buf,
+                                 unsigned long bytecnt)
+{
+    unsigned long done = 0;
+
+    lock_acquire(&nb->lock);
+
+    while (done < bytecnt)
+    {
+        unsigned long long at = pos + done;
+        unsigned long off = at % PAGE_SIZE;
+        unsigned long n = MIN(bytecnt - done, PAGE_SIZE - off);
+        void *page = nullblk_page(nb, at / PAGE_SIZE, 0);
+
+        if (page != NULL)
+            memcpy((char *)buf + done, (char *)page + off, n);
+        else
+            nullblk_fill(nb, at, (char *)buf + done, n);
+
+        done += n;
+    }
+
+    lock_release(&nb->lock);
+    return done;
+}
+
+/**
+ * @brief Keeps stored data, allocating pages on first store.
+ * @param nb Null device with NULLBLK_F_RETAIN
+ * @param pos Position to write to, within capacity
+ * @param buf Buffer with the data
+ * @param bytecnt Number of bytes to write, within capacity
+ * @return Number of bytes written, or -ENOMEM if not even the first page could be allocated
+ */
+static long nullblk_retain_store(struct nullblk *nb, unsigned long long pos, const void *buf,
+                                 unsigned long bytecnt)
+{
+    unsigned long done = 0;
+
+    lock_acquire(&nb->lock);
+
+    while (done < bytecnt)
+    {
+        unsigned long long at = pos + done;
+        unsigned long off = at % PAGE_SIZE;
+        unsigned long n = MIN(bytecnt - done, PAGE_SIZE - off);
+        void *page = nullblk_page(nb, at / PAGE_SIZE, 1);
+
+        if (page == NULL)
+            break;
+
+        memcpy((char *)page + off, (const char *)buf + done, n);
+        done += n;
+    }
+
+    lock_release(&nb->lock);
+    return (done == 0 && bytecnt != 0) ? -ENOMEM : (long)done;
+}
+
+/**
+ * @brief Frees a null device that was never registered, with its retained pages.
+ * @param nb Null device
+ */
+static void nullblk_drop(struct nullblk *nb)
+{
+    for (unsigned long d = 0; d < nb->ndir; d++)
+    {
+        if (nb->dir[d] == NULL)
+            continue;
+
+        for (unsigned long i = 0; i < NULLBLK_LEAF_PAGES; i++)
+            if (nb->dir[d][i] != NULL)
+                free_phys_page(nb->dir[d][i]);
+
+        free_phys_page(nb->dir[d]);
+    }
+
+    if (nb->dir != NULL)
+        kfree(nb->dir);
+
+    kfree(nb);
+}
+
+/**
+ * @brief Waits out the synthetic latency, either sleeping like an interrupt-driven device or
+ * spinning like a polled one.
+ * @param nb Null device
+ */
+static void nullblk_delay(const struct nullblk *nb)
+{
+    if (nb->latency_us == 0)
+        return;
+
+    if (nb->flags & NULLBLK_F_SPIN)
+    {
+        unsigned long long end = rdtime() + nb->latency_us * (TIMER_FREQ / 1000000);
+
+        while (rdtime() < end)
+            continue;
+    }
+    else
+        sleep_us(nb->latency_us);
+}
@@ -0,0 +1,29 @@
+/*! @file nullblk.h
+    @brief Null storage device that completes every request at once
+    @copyright Copyright (c) 2024-2025 University of Illinois
+
+*/
+
+#ifndef _NULLBLK_H_
+#define _NULLBLK_H_
+
+// Flags of nullblk_attach
+//
+// Without NULLBLK_F_RETAIN stores are dropped, which is the cheapest device for
+// the raw, blkq and cache paths but can not hold a filesystem. NULLBLK_F_RETAIN
+// keeps every stored page in memory (pages never stored to read as below), and
+// NULLBLK_F_IMAGE starts the device out with the KTFS image linked into the
+// kernel, so KTFS can be mounted on it.
+
+#define NULLBLK_F_ZERO 0x1     // fetch fills the buffer with zeros
+#define NULLBLK_F_PATTERN 0x2  // fetch fills each 8-byte word with its device offset
+#define NULLBLK_F_SPIN 0x4     // latency is a busy wait instead of a sleep
+#define NULLBLK_F_RETAIN 0x8   // stored pages are kept in memory and read back
+#define NULLBLK_F_IMAGE 0x10   // preload the linked-in KTFS image (implies NULLBLK_F_RETAIN)
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+extern int nullblk_attach(unsigned long long size, unsigned long latency_us, int flags);
+
+#endif  // _NULLBLK_H_
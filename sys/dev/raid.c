@@ -0,0 +1,546 @@
+/*! @file raid.c
+    @brief Striped and mirrored storage composed from several storage devices
+    @copyright Copyright (c) 2024-2025 University of Illinois
+
+*/
+
+#ifdef RAID_DEBUG
+#define DEBUG
+#endif
+
+#ifdef RAID_TRACE
+#define TRACE
+#endif
+
+#include "raid.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "console.h"
+#include "device.h"
+#include "devimpl.h"
+#include "error.h"
+#include "heap.h"
+#include "intr.h"
+#include "misc.h"
+#include "string.h"
+#include "thread.h"
+#include "uio.h"
+
+#ifndef RAID_NAME
+#define RAID_NAME "raid"
+#endif
+
+// Most member devices in one composite device
+#ifndef RAID_MEMBERS_MAX
+#define RAID_MEMBERS_MAX 4
+#endif
+
+// Most member requests in flight for one caller request; longer requests are done in rounds
+#ifndef RAID_JOBS_MAX
+#define RAID_JOBS_MAX 16
+#endif
+
+// INTERNAL TYPE DEFINITIONS
+//
+
+/**
+ * @brief Member requests issued together by one caller, waited on as a group.
+ */
+struct raid_batch {
+    int pending;            ///< Jobs not yet completed
+    struct condition done;  ///< Signalled when pending drops to zero
+};
+
+/**
+ * @brief One request on one member device, run by that member's worker thread.
+ */
+struct raid_job {
+    struct raid_job *next;     ///< Next job queued on the same member
+    struct raid_batch *batch;  ///< Batch the job belongs to
+    int member;                ///< Index of the member the job was queued on
+    unsigned long long pos;    ///< Byte offset on the member
+    char *buf;                 ///< Caller's buffer
+    unsigned long len;         ///< Number of bytes to transfer
+    int write;                 ///< 1 for store, 0 for fetch
+    long result;               ///< Bytes transferred or negative error code
+};
+
+/**
+ * @brief A member device with the queue its worker thread drains. Each member has its own
+ * worker so requests on different members run at the same time.
+ */
+struct raid_member {
+    struct storage *sto;      ///< Member storage device
+    struct raid_job *head;    ///< First queued job
+    struct raid_job *tail;    ///< Last queued job
+    int queued;               ///< Jobs queued or running, used to balance mirror reads
+    int stop;                 ///< Set to make the worker exit once its queue is empty
+    int tid;                  ///< Thread id of the worker
+    struct condition work;    ///< Signalled when a job is queued (or stop is set)
+};
+
+/**
+ * @brief Composite storage device.
+ */
+struct raid {
+    struct storage storage;     ///< Storage struct presented to users
+    struct storage_intf intf;   ///< Interface of storage, blksz copied from the members
+    enum raid_level level;      ///< RAID_STRIPE or RAID_MIRROR
+    unsigned long chunk;        ///< Stripe unit (mirror: read split unit), multiple of blksz
+    int nmembers;               ///< Number of entries of members in use
+    struct raid_member members[RAID_MEMBERS_MAX];
+};
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static int raid_open(struct storage *sto);
+static void raid_close(struct storage *sto);
+static long raid_fetch(struct storage *sto, unsigned long long pos, void *buf,
+                       unsigned long bytecnt);
+static long raid_store(struct storage *sto, unsigned long long pos, const void *buf,
+                       unsigned long bytecnt);
+static int raid_flush(struct storage *sto);
+static int raid_cntl(struct storage *sto, int cmd, void *arg);
+
+static long raid_rw(struct raid *rd, unsigned long long pos, char *buf, unsigned long len,
+                    int write);
+static void raid_post(struct raid *rd, struct raid_job *job);
+static void raid_worker(struct raid_member *m);
+static void raid_unwind(struct raid *rd, int nworkers);
+
+// INTERNAL GLOBAL CONSTANTS
+//
+
+static const struct storage_intf raid_intf = {
+    .open = &raid_open,
+    .close = &raid_close,
+    .fetch = &raid_fetch,
+    .store = &raid_store,
+    .flush = &raid_flush,
+    .cntl = &raid_cntl
+};
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+/**
+ * @brief Creates and registers a storage device striped or mirrored over the given members.
+ * @details The members must not be open; they are opened and closed together with the
+ * composite device. All members must have the same block size. The capacity is that of the
+ * smallest member (mirror) or nmembers times it, rounded down to whole chunks (stripe).
+ * @param level RAID_STRIPE or RAID_MIRROR
+ * @param members Member storage devices
+ * @param nmembers Number of members, 1 to RAID_MEMBERS_MAX
+ * @param chunk Stripe unit in bytes, a multiple of the block size
+ * @return Instance number of the registered device, or negative error code if error
+ */
+int raid_attach(enum raid_level level, struct storage **members, int nmembers,
+                unsigned long chunk)
+{
+    unsigned long long mincap;
+    unsigned int blksz;
+    struct raid *rd;
+    int tid;
+    int i;
+
+    if (members == NULL || nmembers < 1 || nmembers > RAID_MEMBERS_MAX)
+        return -EINVAL;
+
+    if (level != RAID_STRIPE && level != RAID_MIRROR)
+        return -EINVAL;
+
+    blksz = storage_blksz(members[0]);
+    mincap = storage_capacity(members[0]);
+
+    for (i = 0; i < nmembers; i++)
+    {
+        if (members[i] == NULL || storage_blksz(members[i]) != blksz)
+            return -EINVAL;
+        mincap = MIN(mincap, storage_capacity(members[i]));
+    }
+
+    if (blksz == 0 || chunk == 0 || chunk % blksz != 0)
+        return -EINVAL;
+
+    rd = kcalloc(1, sizeof(*rd));
+
+    if (rd == NULL)
+        return -ENOMEM;
+
+    rd->intf = raid_intf;
+    rd->intf.blksz = blksz;
+    rd->level = level;
+    rd->chunk = chunk;
+    rd->nmembers = nmembers;
+
+    if (level == RAID_STRIPE)
+        storage_init(&rd->storage, &rd->intf, ROUND_DOWN(mincap, chunk) * nmembers);
+    else
+        storage_init(&rd->storage, &rd->intf, mincap);
+
+    for (i = 0; i < nmembers; i++)
+    {
+        rd->members[i].sto = members[i];
+        condition_init(&rd->members[i].work, "raid_work");
+
+        tid = spawn_thread(RAID_NAME, (void (*)(void))&raid_worker, (uint64_t)&rd->members[i]);
+
+        if (tid < 0)
+        {
+            raid_unwind(rd, i);
+            return tid;
+        }
+
+        rd->members[i].tid = tid;
+    }
+
+    int regno = register_device(RAID_NAME, DEV_STORAGE, &rd->storage);
+
+    if (regno < 0)
+    {
+        raid_unwind(rd, nmembers);
+        return regno;
+    }
+
+    // The device is live, the workers now run for as long as the kernel does
+    for (i = 0; i < nmembers; i++)
+        thread_detach(rd->members[i].tid);
+
+    kprintf("raid: attached %s%d (%s of %d, %llu bytes)\n", RAID_NAME, regno,
+            (level == RAID_STRIPE) ? "stripe" : "mirror", nmembers, rd->storage.capacity);
+
+    return regno;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+/**
+ * @brief Opens every member device.
+ * @param sto Storage struct pointer for the composite device
+ * @return 0 on success, or the error of the first member that failed to open
+ */
+static int raid_open(struct storage *sto)
+{
+    struct raid *rd = (struct raid *)((char *)sto - offsetof(struct raid, storage));
+    int result;
+    int i;
+
+    for (i = 0; i < rd->nmembers; i++)
+    {
+        result = storage_open(rd->members[i].sto);
+
+        if (result != 0)
+        {
+            while (i-- > 0)
+                storage_close(rd->members[i].sto);
+            return result;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Closes every member device.
+ * @param sto Storage struct pointer for the composite device
+ */
+static void raid_close(struct storage *sto)
+{
+    struct raid *rd = (struct raid *)((char *)sto - offsetof(struct raid, storage));
+
+    for (int i = 0; i < rd->nmembers; i++)
+        storage_close(rd->members[i].sto);
+}
+
+static long raid_fetch(struct storage *sto, unsigned long long pos, void *buf,
+                       unsigned long bytecnt)
+{
+    struct raid *rd = (struct raid *)((char *)sto - offsetof(struct raid, storage));
+    return raid_rw(rd, pos, buf, bytecnt, 0);
+}
+
+static long raid_store(struct storage *sto, unsigned long long pos, const void *buf,
+                       unsigned long bytecnt)
+{
+    struct raid *rd = (struct raid *)((char *)sto - offsetof(struct raid, storage));
+    return raid_rw(rd, pos, (char *)buf, bytecnt, 1);
+}
+
+/**
+ * @brief Flushes every member device.
+ * @param sto Storage struct pointer for the composite device
+ * @return 0 on success, -ENOTSUP if no member can flush, or the first member error
+ */
+static int raid_flush(struct storage *sto)
+{
+    struct raid *rd = (struct raid *)((char *)sto - offsetof(struct raid, storage));
+    int result = -ENOTSUP;
+    int ret;
+
+    for (int i = 0; i < rd->nmembers; i++)
+    {
+        ret = storage_flush(rd->members[i].sto);
+
+        if (ret == 0 && result == -ENOTSUP)
+            result = 0;
+        else if (ret < 0 && ret != -ENOTSUP)
+            return ret;
+    }
+
+    return result;
+}
+
+/**
+ * @brief _cntl_ functions for the composite device.
+ * @param sto Storage struct pointer for the composite device
+ * @param cmd command to execute. raid supports FCNTL_GETEND.
+ * @param arg Argument for commands
+ * @return 0 on success, error on failure or unsupported command
+ */
+static int raid_cntl(struct storage *sto, int cmd, void *arg)
+{
+    if (cmd == FCNTL_GETEND)
+    {
+        if (arg == NULL)
+            return -EINVAL;
+
+        *(unsigned long long *)arg = sto->capacity;
+        return 0;
+    }
+
+    return -ENOTSUP;
+}
+
+/**
+ * @brief Splits a request into member requests, queues them on the member workers so they run
+ * in parallel, and waits for them. Stripes map each chunk to one member. Mirrors write the
+ * whole range to every member and read each chunk from the least busy member, falling back to
+ * the other members if that read fails.
+ * @param rd Composite device
+ * @param pos Starting position, aligned to the block size
+ * @param buf Caller's buffer
+ * @param len Number of bytes
+ * @param write 1 to store, 0 to fetch
+ * @return Number of bytes transferred, or negative error code if error
+ */
+static long raid_rw(struct raid *rd, unsigned long long pos, char *buf, unsigned long len,
+                    int write)
+{
+    struct raid_job jobs[RAID_JOBS_MAX];
+    struct raid_batch batch;
+    unsigned long blksz = rd->intf.blksz;
+    unsigned long done = 0;
+    int njobs;
+    int pie;
+    int i;
+
+    if (pos >= rd->storage.capacity)
+        return 0;
+
+    len = ROUND_DOWN(MIN(len, rd->storage.capacity - pos), blksz);
+
+    condition_init(&batch.done, "raid_batch");
+
+    while (done < len)
+    {
+        unsigned long off = done;
+
+        batch.pending = 0;
+        njobs = 0;
+
+        if (rd->level == RAID_MIRROR && write)
+        {
+            // Same range on every member
+            for (i = 0; i < rd->nmembers; i++)
+            {
+                jobs[i] = (struct raid_job){ .batch = &batch, .member = i, .pos = pos + off,
+                                             .buf = buf + off, .len = len - off, .write = 1 };
+                raid_post(rd, &jobs[i]);
+            }
+
+            njobs = rd->nmembers;
+        }
+        else
+        {
+            while (off < len && njobs < RAID_JOBS_MAX)
+            {
+                unsigned long long idx = (pos + off) / rd->chunk;
+                unsigned long in = (pos + off) % rd->chunk;
+                unsigned long plen = MIN(rd->chunk - in, len - off);
+                struct raid_job *job = &jobs[njobs++];
+
+                *job = (struct raid_job){ .batch = &batch, .buf = buf + off, .len = plen,
+                                          .write = write };
+
+                if (rd->level == RAID_STRIPE)
+                {
+                    job->member = idx % rd->nmembers;
+                    job->pos = (idx / rd->nmembers) * rd->chunk + in;
+                }
+                else
+                {
+                    job->member = 0;
+
+                    for (i = 1; i < rd->nmembers; i++)
+                        if (rd->members[i].queued < rd->members[job->member].queued)
+                            job->member = i;
+
+                    job->pos = pos + off;
+                }
+
+                raid_post(rd, job);
+                off += plen;
+            }
+        }
+
+        pie = disable_interrupts();
+
+        while (batch.pending != 0)
+            condition_wait(&batch.done);
+
+        restore_interrupts(pie);
+
+        // Account for the jobs in buffer order, stopping at the first short one
+
+        if (rd->level == RAID_MIRROR && write)
+        {
+            for (i = 0; i < njobs; i++)
+            {
+                if (jobs[i].result < 0)
+                    return (done > 0) ? (long)done : jobs[i].result;
+                if ((unsigned long)jobs[i].result != jobs[i].len)
+                    return (done > 0) ? (long)done : -EIO;
+            }
+
+            done = len;
+            continue;
+        }
+
+        for (i = 0; i < njobs; i++)
+        {
+            struct raid_job *job = &jobs[i];
+
+            for (int k = 1; job->result != (long)job->len && rd->level == RAID_MIRROR &&
+                            k < rd->nmembers; k++)
+                job->result = storage_fetch(rd->members[(job->member + k) % rd->nmembers].sto,
+                                            job->pos, job->buf, job->len);
+
+            if (job->result < 0)
+                return (done > 0) ? (long)done : job->result;
+
+            done += job->result;
+
+            if ((unsigned long)job->result != job->len)
+                return (long)done;
+        }
+    }
+
+    return (long)done;
+}
+
+/**
+ * @brief Queues a job on its member and wakes the member's worker.
+ * @param rd Composite device
+ * @param job Job to queue, job->member selects the member
+ */
+static void raid_post(struct raid *rd, struct raid_job *job)
+{
+    struct raid_member *m = &rd->members[job->member];
+    int pie;
+
+    pie = disable_interrupts();
+
+    job->next = NULL;
+
+    if (m->tail != NULL)
+        m->tail->next = job;
+    else
+        m->head = job;
+
+    m->tail = job;
+    m->queued += 1;
+    job->batch->pending += 1;
+
+    restore_interrupts(pie);
+
+    condition_broadcast(&m->work);
+}
+
+/**
+ * @brief Worker thread of one member: runs the member's queued jobs in order, forever.
+ * @param m Member whose queue the worker drains
+ */
+static void raid_worker(struct raid_member *m)
+{
+    struct raid_job *job;
+    long result;
+    int pie;
+
+    for (;;)
+    {
+        pie = disable_interrupts();
+
+        while (m->head == NULL && !m->stop)
+            condition_wait(&m->work);
+
+        if (m->head == NULL)  // stopped by raid_unwind
+        {
+            restore_interrupts(pie);
+            running_thread_exit();
+        }
+
+        job = m->head;
+        m->head = job->next;
+
+        if (m->head == NULL)
+            m->tail = NULL;
+
+        restore_interrupts(pie);
+
+        if (job->write)
+            result = storage_store(m->sto, job->pos, job->buf, job->len);
+        else
+            result = storage_fetch(m->sto, job->pos, job->buf, job->len);
+
+        // The job lives on the submitter's stack, so it is not touched once the batch completes
+
+        pie = disable_interrupts();
+
+        job->result = result;
+        m->queued -= 1;
+
+        if (--job->batch->pending == 0)
+            condition_broadcast(&job->batch->done);
+
+        restore_interrupts(pie);
+    }
+}
+
+/**
+ * @brief Undoes a failed raid_attach: stops the workers started so far, waits for them to
+ * exit and frees the device.
+ * @param rd Composite device that was never registered
+ * @param nworkers Number of members whose worker was started
+ */
+static void raid_unwind(struct raid *rd, int nworkers)
+{
+    int pie;
+    int i;
+
+    for (i = 0; i < nworkers; i++)
+    {
+        pie = disable_interrupts();
+        rd->members[i].stop = 1;
+        restore_interrupts(pie);
+        condition_broadcast(&rd->members[i].work);
+    }
+
+    for (i = 0; i < nworkers; i++)
+        thread_join(rd->members[i].tid);
+
+    kfree(rd);
+}
@@ -0,0 +1,23 @@
+/*! @file raid.h
+    @brief Striped and mirrored storage composed from several storage devices
+    @copyright Copyright (c) 2024-2025 University of Illinois
+
+*/
+
+#ifndef _RAID_H_
+#define _RAID_H_
+
+struct storage;  // forward declaration
+
+enum raid_level {
+    RAID_STRIPE,  // RAID-0: chunks are spread round-robin over the members
+    RAID_MIRROR   // RAID-1: every member holds a full copy
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+extern int raid_attach(enum raid_level level, struct storage** members, int nmembers,
+                       unsigned long chunk);
+
+#endif  // _RAID_H_
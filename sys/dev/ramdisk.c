@@ -48,7 +48,10 @@ static int ramdisk_open(struct storage *sto);
 static void ramdisk_close(struct storage *sto);
 static long ramdisk_fetch(struct storage *sto, unsigned long long pos, void *buf,
                           unsigned long bytecnt);
+static long ramdisk_store(struct storage *sto, unsigned long long pos, const void *buf,
+                          unsigned long bytecnt);
 static int ramdisk_cntl(struct storage *sto, int cmd, void *arg);
+static void *ramdisk_direct(struct storage *sto);
 
 // INTERNAL GLOBAL CONSTANTS
 //
@@ -58,8 +61,9 @@ static const struct storage_intf ramdisk_intf = {
     .open = &ramdisk_open,
     .close = &ramdisk_close,
     .fetch = &ramdisk_fetch,
-    .store = NULL, // Read-only storage (blob data in .rodata)
-    .cntl = &ramdisk_cntl};
+    .store = &ramdisk_store, // blob is linked into .data, so it can be written in place
+    .cntl = &ramdisk_cntl,
+    .direct = &ramdisk_direct};
 
 // EXPORTED FUNCTION DEFINITIONS
 //
@@ -103,6 +107,10 @@ void ramdisk_attach()
     // allocate memory storage and create device *rd
     size_t ramdisk_size = (size_t)(_kimg_blob_end - _kimg_blob_start);
 
+    // Kernel was linked without a blob, nothing to attach
+    if (ramdisk_size == 0)
+        return;
+
     struct ramdisk *rd = kcalloc(1, sizeof(*rd));
 
     if (rd == NULL)
@@ -192,9 +200,7 @@ static long ramdisk_fetch(struct storage *sto, unsigned long long pos, void *buf
     //struct ramdisk *rd = (struct ramdisk *)sto; // storage is first field -> OK
     struct ramdisk *rd = (struct ramdisk *)((char *)sto - offsetof(struct ramdisk, storage));
 
-    // TEMP TRACE:
-    kprintf("[ramdisk_fetch] pos=%llu len=%lu size=%lu\n",
-            pos, bytecnt, (unsigned long)rd->size);
+    trace("%s(pos=%llu,len=%lu)", __func__, pos, bytecnt);
 
     if (!buf)
         return -EINVAL;
@@ -206,6 +212,33 @@ static long ramdisk_fetch(struct storage *sto, unsigned long long pos, void *buf
     return count;
 }
 
+/**
+ * @brief Writes bytecnt number of bytes from buf to the disk.
+ * @details Performs proper bounds checks, then copies data from the passed buffer to the memory
+ * block. The size of the disk does not change.
+ * @param sto Storage struct pointer for memory storage
+ * @param pos Position in storage to write to
+ * @param buf Buffer to copy data from
+ * @param bytecnt Number of bytes to write to memory
+ * @return Number of bytes successfully written
+ */
+static long ramdisk_store(struct storage *sto, unsigned long long pos, const void *buf,
+                          unsigned long bytecnt)
+{
+    struct ramdisk *rd = (struct ramdisk *)((char *)sto - offsetof(struct ramdisk, storage));
+
+    trace("%s(pos=%llu,len=%lu)", __func__, pos, bytecnt);
+
+    if (!buf)
+        return -EINVAL;
+    if (pos >= rd->size)
+        return 0;
+    size_t avail = rd->size - pos;
+    size_t count = (bytecnt < avail) ? bytecnt : avail;
+    memcpy((char *)rd->buf + pos, buf, count);
+    return count;
+}
+
 /**
  * @brief _cntl_ functions for memory storage.
  * @details Memory storage supports basic control operations
@@ -213,7 +246,7 @@ static long ramdisk_fetch(struct storage *sto, unsigned long long pos, void *buf
  * directly return the value.
  * @details FCNTL_GETEND should return the capacity of the VirtIO block device in bytes.
  * @param sto Storage struct pointer for memory storage
- * @param cmd command to execute. ramdisk should support FCNTL_GETEND.
+ * @param cmd command to execute. ramdisk supports FCNTL_GETEND.
  * @param arg Argument for commands
  * @return 0 on success, error on failure or unsupported command
  */
@@ -237,4 +270,17 @@ static int ramdisk_cntl(struct storage *sto, int cmd, void *arg)
 
     // Any unsupported command:
     return -ENOTSUP;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Returns the backing memory block, so a cache on top of the ramdisk can hand out
+ * pointers into it instead of copying.
+ * @param sto Storage struct pointer for memory storage
+ * @return Start of the ramdisk memory
+ */
+static void *ramdisk_direct(struct storage *sto)
+{
+    struct ramdisk *rd = (struct ramdisk *)((char *)sto - offsetof(struct ramdisk, storage));
+
+    return rd->buf;
+}
@@ -21,7 +21,9 @@
 #include "error.h"
 #include "heap.h"
 #include "intr.h"
+#include "memory.h"
 #include "misc.h"
+#include "riscv.h"  // rdtime
 #include "string.h"
 #include "thread.h"
 #include "uio.h"  // FCNTL
@@ -56,8 +58,35 @@
 #define VIRTIO_BLK_F_WRITE_ZEROES 14
 
 // GK
-// Number of descriptors per request variable
-#define VIOBLK_REQ_DESCS 3
+// Maximum number of data segments in one request, each request is described by a single ring
+// descriptor pointing at an indirect table of header + segments + status (or, without
+// VIRTIO_F_INDIRECT_DESC, by a chain of that many ring descriptors)
+#ifndef VIOBLK_SEG_MAX
+#define VIOBLK_SEG_MAX 16
+#endif
+
+// Number of entries in each indirect table
+#define VIOBLK_INDIRECT_LEN (VIOBLK_SEG_MAX + 2)
+
+// Largest number of bytes moved by one request, so one large transfer cannot hog the device
+#ifndef VIOBLK_REQ_MAX
+#define VIOBLK_REQ_MAX 65536
+#endif
+
+// Most requests a thread publishes in one batch
+#ifndef VIOBLK_BATCH_MAX
+#define VIOBLK_BATCH_MAX 32
+#endif
+
+// Longest spin window (in microseconds) FCNTL_SETPOLL accepts
+#ifndef VIOBLK_POLL_MAX_US
+#define VIOBLK_POLL_MAX_US 1000
+#endif
+
+// Most request virtqueues used when the device offers VIRTIO_BLK_F_MQ
+#ifndef VIOBLK_QUEUES_MAX
+#define VIOBLK_QUEUES_MAX 4
+#endif
 
 // INTERNAL FUNCTION DECLARATIONS
 //
@@ -122,6 +151,14 @@ static long vioblk_storage_store(struct storage* sto, unsigned long long pos, co
  */
 static int vioblk_storage_cntl(struct storage* sto, int op, void* arg);
 
+/**
+ * @brief Sends a VIRTIO_BLK_T_FLUSH request and sleeps until the device reports that every write it
+ * has completed so far is on stable storage.
+ * @param sto Storage IO struct for the storage device
+ * @return 0 on success, -ENOTSUP if VIRTIO_BLK_F_FLUSH was not negotiated, or negative error code
+ */
+static int vioblk_storage_flush(struct storage* sto);
+
 /**
  * @brief The interrupt handler for the VirtIO device. When an interrupt occurs, the system will
  * call this function.
@@ -185,8 +222,33 @@ enum{
 
     // Data coming out (write)
     VIRTIO_BLK_T_OUT = 1,
+
+    // Write back the device's volatile cache, no data segments
+    VIRTIO_BLK_T_FLUSH = 4,
+
+    // Drop the data of a sector range, the data segment is a virtio_blk_discard_write_zeroes
+    VIRTIO_BLK_T_DISCARD = 11,
+
+    // Set a sector range to zeros, the data segment is a virtio_blk_discard_write_zeroes
+    VIRTIO_BLK_T_WRITE_ZEROES = 13,
 };
 
+// Data segment of discard and write zeroes requests, from 5.2.6 of the spec
+struct virtio_blk_discard_write_zeroes{
+
+    // First 512 byte sector of the range
+    uint64_t sector;
+
+    // Number of 512 byte sectors in the range
+    uint32_t num_sectors;
+
+    // Bit 0 is unmap, write zeroes may deallocate the range instead of writing it
+    uint32_t flags;
+};
+
+// Unmap flag of virtio_blk_discard_write_zeroes
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP 1
+
 // Status codes for vio to repost result of the operation to the driver
 enum{
 
@@ -200,16 +262,12 @@ enum{
     VIRTIO_BLK_S_UNSUPP = 2,
 };
 
-// Beginning of struct vioblk_storage is very similar to viorng_serial from viorng.c
-// Will hold the information needed for the virtio driver to interact with the virtual disk
-struct vioblk_storage{
-   
+// One request virtqueue with everything a submitter needs, so submitters on different queues never
+// share a lock, a free stack or a wait condition
+struct vioblk_queue{
 
-    // MMIO Register Block
-    volatile struct virtio_mmio_regs *regs;
-
-    // Interrupt Request line assigned to the VirtIO Device
-    int irqno;
+    // Index of the virtqueue on the device
+    int qid;
 
     // Virtqueue components
     // Descriptor table, each entry describes a buffer
@@ -233,12 +291,6 @@ struct vioblk_storage{
     // Create a stack pointer for the free indices list to be able to access the top of the stack
     int free_top;
 
-    // Allocate soace for the 3 descriptors so that there position on the stack can be remembered once they need to be popped off
-    // Do this for all three in the chain, header, data, and status
-    uint16_t req_desc_header[VIOBLK_QSIZE];
-    uint16_t req_desc_data[VIOBLK_QSIZE];
-    uint16_t req_desc_status[VIOBLK_QSIZE];
-
     // Allocate large memory pools to easy allocate physical addresses for the buffers
     // Store the req_hdr for every request, pretty much the input that the device reads
     struct virtio_blk_req_hdr * header_pool;
@@ -246,11 +298,45 @@ struct vioblk_storage{
     // Store the status byte of each requst as its the output result that the device writes
     volatile uint8_t * status_pool;
 
-    // Condition for when device finishes a request to wake threads up
+    // One indirect table of VIOBLK_INDIRECT_LEN entries per ring descriptor, the table of a request
+    // belongs to the ring descriptor it was popped with so the free stack allocates both
+    struct virtq_desc * indirect_pool;
+
+    // Number of physical pages backing indirect_pool, it is too large for the heap
+    unsigned int indirect_pages;
+
+    // Condition for when device finishes a request on this queue to wake threads up
     struct condition done;
 
-    // Thread locking to protect queue in multithreading kernels as we are implementing
+    // Threads asleep on done waiting for their own requests, the device has to interrupt for them
+    int sleepers;
+
+    // Thread locking to protect the queue in multithreading kernels as we are implementing
     struct lock queue_lock;
+};
+
+// Beginning of struct vioblk_storage is very similar to viorng_serial from viorng.c
+// Will hold the information needed for the virtio driver to interact with the virtual disk
+struct vioblk_storage{
+   
+
+    // MMIO Register Block
+    volatile struct virtio_mmio_regs *regs;
+
+    // Interrupt Request line assigned to the VirtIO Device
+    int irqno;
+
+    // Request virtqueues, one unless VIRTIO_BLK_F_MQ was negotiated
+    struct vioblk_queue queues[VIOBLK_QUEUES_MAX];
+
+    // Number of entries of queues in use
+    int num_queues;
+
+    // Largest data segment the device accepts (VIRTIO_BLK_F_SIZE_MAX), 0 if unlimited
+    uint32_t seg_size_max;
+
+    // Number of data segments allowed in one request (VIRTIO_BLK_F_SEG_MAX), at most VIOBLK_SEG_MAX
+    uint32_t seg_cnt_max;
 
     // A variable to store if someone is waiting for a condition
     int waiter;
@@ -263,8 +349,83 @@ struct vioblk_storage{
 
     // 1 if device is open, 0 if closed
     int is_open;
+
+    // 1 if VIRTIO_F_EVENT_IDX was negotiated, so kicks and interrupts go through used_event/avail_event
+    int event_idx;
+
+    // Polled completion window in timer ticks, 0 when polling is off (set through FCNTL_SETPOLL)
+    unsigned long poll_ticks;
+
+    // 1 if VIRTIO_BLK_F_FLUSH was negotiated, so the device accepts VIRTIO_BLK_T_FLUSH
+    int flush;
+
+    // 1 if VIRTIO_F_INDIRECT_DESC was negotiated, otherwise requests are chains of ring descriptors
+    int indirect;
+
+    // Largest discard in sectors (VIRTIO_BLK_F_DISCARD), 0 if the device cannot discard
+    uint32_t max_discard_sectors;
+
+    // Largest write zeroes in sectors (VIRTIO_BLK_F_WRITE_ZEROES), 0 if the device cannot write zeroes
+    uint32_t max_write_zeroes_sectors;
 };
 
+/**
+ * @brief Shared request path of fetch and store. Splits an aligned range into multi-block
+ * requests of one ring descriptor each (the data segments live in an indirect table, or in a
+ * descriptor chain without VIRTIO_F_INDIRECT_DESC), publishes a batch of them with a single kick,
+ * and sleeps until the whole batch is done.
+ * @param vbd Driver state of the VirtIO block device
+ * @param type VIRTIO_BLK_T_IN, VIRTIO_BLK_T_OUT, VIRTIO_BLK_T_FLUSH, VIRTIO_BLK_T_DISCARD or
+ * VIRTIO_BLK_T_WRITE_ZEROES
+ * @param pos Starting position, aligned to the block size
+ * @param buf Buffer to read into or write from
+ * @param bytecnt Number of bytes, a multiple of the block size (0 sends one request without data)
+ * @return The number of bytes transferred, or negative error code if error
+ */
+static long vioblk_rw(struct vioblk_storage* vbd, uint32_t type, unsigned long long pos, void* buf,
+                      unsigned long bytecnt);
+
+/**
+ * @brief Spins on the status bytes of a batch for at most poll_ticks, like the polled UART path, so
+ * a short request completes without an interrupt or a context switch.
+ * @param vbd Driver state of the VirtIO block device
+ * @param q Queue the batch was published on
+ * @param heads Ring descriptors of the requests in the batch
+ * @param nreq Number of requests in the batch
+ * @return 1 if every request completed within the window, 0 otherwise
+ */
+static int vioblk_poll(struct vioblk_storage* vbd, struct vioblk_queue* q, const uint16_t* heads,
+                       int nreq);
+
+/**
+ * @brief Sets up one request virtqueue: rings, free stack and the header, status and indirect
+ * pools, then hands the rings to the device.
+ * @param vbd Driver state of the VirtIO block device
+ * @param q Queue to set up
+ * @return 0 on success, or negative error code if error
+ */
+static int vioblk_queue_open(struct vioblk_storage* vbd, struct vioblk_queue* q);
+
+/**
+ * @brief Resets one request virtqueue on the device and frees everything vioblk_queue_open
+ * allocated for it.
+ * @param vbd Driver state of the VirtIO block device
+ * @param q Queue to tear down
+ * @return None
+ */
+static void vioblk_queue_close(struct vioblk_storage* vbd, struct vioblk_queue* q);
+
+/**
+ * @brief Discards or zeroes a byte range, split into requests of at most max_discard_sectors or
+ * max_write_zeroes_sectors each.
+ * @param vbd Driver state of the VirtIO block device
+ * @param type VIRTIO_BLK_T_DISCARD or VIRTIO_BLK_T_WRITE_ZEROES
+ * @param range Range to clear, aligned to the block size
+ * @return 0 on success, -ENOTSUP if the device lacks the feature, or negative error code if error
+ */
+static int vioblk_clear_range(struct vioblk_storage* vbd, uint32_t type,
+                              const struct storage_range* range);
+
 // Initialize the drivers vtable, the table of function pointers that tells the OS hwo to operate the block device
 // OS will invoke the function pointers in blk_device->intf because it never directly calls the vioblk functions
 // Need to define a storage_intf instance so that the vioblk storage functions can be called in that interface
@@ -277,6 +438,7 @@ static const struct storage_intf vioblk_storage_intf = {
     .close = vioblk_storage_close,
     .fetch = vioblk_storage_fetch,
     .store = vioblk_storage_store,
+    .flush = vioblk_storage_flush,
     .cntl = vioblk_storage_cntl
 };
 
@@ -342,18 +504,30 @@ void vioblk_attach(volatile struct virtio_mmio_regs* regs, int irqno) {
     __sync_synchronize();  // fence o,io
 
     // Negotiate features. We need:
-    //  - VIRTIO_F_RING_RESET and
-    //  - VIRTIO_F_INDIRECT_DESC
+    //  - VIRTIO_F_RING_RESET
     // We want:
-    //  - VIRTIO_BLK_F_BLK_SIZE and
-    //  - VIRTIO_BLK_F_TOPOLOGY.
+    //  - VIRTIO_F_INDIRECT_DESC to describe a request with one ring descriptor,
+    //  - VIRTIO_BLK_F_BLK_SIZE,
+    //  - VIRTIO_BLK_F_TOPOLOGY,
+    //  - VIRTIO_F_EVENT_IDX,
+    //  - VIRTIO_BLK_F_SIZE_MAX and VIRTIO_BLK_F_SEG_MAX to size indirect requests,
+    //  - VIRTIO_BLK_F_FLUSH for write barriers,
+    //  - VIRTIO_BLK_F_DISCARD and VIRTIO_BLK_F_WRITE_ZEROES to clear ranges without sending data and
+    //  - VIRTIO_BLK_F_MQ to give submitters their own virtqueues.
 
     virtio_featset_init(needed_features);
     virtio_featset_add(needed_features, VIRTIO_F_RING_RESET);
-    virtio_featset_add(needed_features, VIRTIO_F_INDIRECT_DESC);
     virtio_featset_init(wanted_features);
+    virtio_featset_add(wanted_features, VIRTIO_F_INDIRECT_DESC);
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_BLK_SIZE);
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_TOPOLOGY);
+    virtio_featset_add(wanted_features, VIRTIO_F_EVENT_IDX);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_SIZE_MAX);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_SEG_MAX);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_FLUSH);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_DISCARD);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_WRITE_ZEROES);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_MQ);
     result = virtio_negotiate_features(regs, enabled_features, wanted_features, needed_features);
 
     if (result != 0) {
@@ -396,26 +570,79 @@ void vioblk_attach(volatile struct virtio_mmio_regs* regs, int irqno) {
     // Mark the device as no open for now as it is not being used yet
     vbd->is_open = 0;
 
-    // Set the queue size to 0 unitl read from open()
-    vbd->q_size = 0;
+    // Remember if the device agreed to event index based notification suppression
+    vbd->event_idx = virtio_featset_test(enabled_features, VIRTIO_F_EVENT_IDX);
 
-    // Inititalize used_seen index to 0 before starting
-    vbd->used_idx_seen = 0;
+    // Remember if the device has a write cache we can flush
+    vbd->flush = virtio_featset_test(enabled_features, VIRTIO_BLK_F_FLUSH);
 
-    // Set free_stack to NULL as will be initialized in open()
-    vbd->free_stack = NULL;
-    
-    // Stack starts empty
-    vbd->free_top = 0;
+    // Remember if a request can live in an indirect table, otherwise it takes a chain of ring descriptors
+    vbd->indirect = virtio_featset_test(enabled_features, VIRTIO_F_INDIRECT_DESC);
 
-    // Initialize waiter
-    vbd->waiter = 0;
+    // Range limits of discard and write zeroes, a feature the device offers with a limit of 0 is unusable
+    vbd->max_discard_sectors = 0;
+    vbd->max_write_zeroes_sectors = 0;
+
+    if(virtio_featset_test(enabled_features, VIRTIO_BLK_F_DISCARD)){
 
-    // Create a condition variable to use to put threads to sleep
-    condition_init(&vbd->done, "vioblk.done");
+        vbd->max_discard_sectors = regs->config.blk.max_discard_sectors;
+    }
 
-    // Initialize a lock for the virtqueue state, so that it can work without interruption
-    lock_init(&vbd->queue_lock);
+    if(virtio_featset_test(enabled_features, VIRTIO_BLK_F_WRITE_ZEROES)){
+
+        vbd->max_write_zeroes_sectors = regs->config.blk.max_write_zeroes_sectors;
+    }
+
+    // Segment limits of the device, used when splitting a request into data descriptors
+    vbd->seg_size_max = 0;
+    vbd->seg_cnt_max = VIOBLK_SEG_MAX;
+
+    if(virtio_featset_test(enabled_features, VIRTIO_BLK_F_SIZE_MAX)){
+
+        vbd->seg_size_max = regs->config.blk.size_max;
+    }
+
+    if(virtio_featset_test(enabled_features, VIRTIO_BLK_F_SEG_MAX) && regs->config.blk.seg_max != 0){
+
+        vbd->seg_cnt_max = MIN(regs->config.blk.seg_max, VIOBLK_SEG_MAX);
+    }
+
+    // One request queue, or as many as the device has (up to VIOBLK_QUEUES_MAX) with VIRTIO_BLK_F_MQ
+    vbd->num_queues = 1;
+
+    if(virtio_featset_test(enabled_features, VIRTIO_BLK_F_MQ) && regs->config.blk.num_queues > 1){
+
+        vbd->num_queues = MIN(regs->config.blk.num_queues, VIOBLK_QUEUES_MAX);
+    }
+
+    for(int i = 0; i < vbd->num_queues; i++){
+
+        struct vioblk_queue * q = &vbd->queues[i];
+
+        // Request queues are virtqueues 0 to num_queues - 1
+        q->qid = i;
+
+        // Set the queue size to 0 unitl read from open()
+        q->q_size = 0;
+
+        // Inititalize used_seen index to 0 before starting
+        q->used_idx_seen = 0;
+
+        // Set free_stack to NULL as will be initialized in open()
+        q->free_stack = NULL;
+
+        // Stack starts empty
+        q->free_top = 0;
+
+        // Create a condition variable to use to put threads to sleep
+        condition_init(&q->done, "vioblk.done");
+
+        // Initialize a lock for the virtqueue state, so that it can work without interruption
+        lock_init(&q->queue_lock);
+    }
+
+    // Initialize waiter
+    vbd->waiter = 0;
 
     // Build the dynamic interface for the standard function pointers of this driver for the vbd
     // Allocate heap space for the struct storage_intf and store pointer into dynamic_intf
@@ -473,8 +700,77 @@ static int vioblk_storage_open(struct storage* sto) {
         return -EBUSY;
     }
 
-    // Select virtual queue 0 as virtio queue that all queue operations will apply to
-    vbd->regs->queue_sel = 0;
+    // Set up every request queue, undoing the ones already set up if one fails
+    for(int i = 0; i < vbd->num_queues; i++){
+
+        int result = vioblk_queue_open(vbd, &vbd->queues[i]);
+
+        if(result != 0){
+
+            while(i-- > 0){
+
+                vioblk_queue_close(vbd, &vbd->queues[i]);
+            }
+
+            return result;
+        }
+    }
+
+    // Enable device intterups now that the queue is live and can properly recieve and execute
+    enable_intr_source(vbd->irqno, VIOBLK_INTR_PRIO, vioblk_isr, vbd);
+
+    // Mark device as opened and return
+    vbd->is_open = 1;
+
+    // Check in the console that the device was actualy opened by printing the values of the rings and set values to the console
+    kprintf("vioblk_storage_open: queues=%d qlen=%u irq=%d\n", vbd->num_queues, vbd->queues[0].q_size, vbd->irqno);
+    return 0;
+}
+
+static void vioblk_storage_close(struct storage* sto) {
+    // FIXME
+
+    // Use the container_of we defined above to get vbd from the embedded wrapper
+    struct vioblk_storage * vbd = container_of(sto, struct vioblk_storage, blk_device);
+
+    // Check if open, if not return
+    if(!vbd->is_open){
+
+        return;
+    }
+
+    // stop interrupts from this device as it is being closed
+    disable_intr_source(vbd->irqno);
+
+    // Reset and free every request queue
+    for(int i = 0; i < vbd->num_queues; i++){
+
+        vioblk_queue_close(vbd, &vbd->queues[i]);
+    }
+
+    // Check for any latched device interrupts
+    // Local scope so that the variable pending only exists within these braces
+    {
+        // Read the device's intr status reg to check if any bits are set
+        uint32_t pending = vbd->regs->interrupt_status;
+
+        // if any bits are set, write the same bits to the ack register
+        if(pending){
+
+            // Acknoledeges taht the device saw the interrupts and that the intr can be cleared
+            vbd->regs->interrupt_ack = pending;
+        }
+    }
+
+    // Mark the device as closed
+    vbd->is_open = 0;
+    
+}
+
+static int vioblk_queue_open(struct vioblk_storage* vbd, struct vioblk_queue* q) {
+
+    // Select this virtqueue as the one that all queue operations will apply to
+    vbd->regs->queue_sel = q->qid;
 
     // CPU finishes writing queue_sel before anything else
     __sync_synchronize();
@@ -497,62 +793,55 @@ static int vioblk_storage_open(struct storage* sto) {
         qlen = qmax;
     }
 
-    // We have qlen now so write to device so taht queue 0 will be set to that 
+    // We have qlen now so write to device so taht the queue will be set to that
     vbd->regs->queue_num = qlen;
 
     // Synchronize so that the queue_num is finished before any MMIO changes
     __sync_synchronize();
 
     // Set the chosedn queue length in the driver state
-    vbd->q_size = qlen;
+    q->q_size = qlen;
 
     // Now to allocate space for the desc, avail, and used rings and descroptor tables
     // For the descriptor table, there is one virtq_desc per entry so multiple size of virtq_desc by qlen and allocate
-    vbd->desc = (struct virtq_desc *) kmalloc(sizeof(struct virtq_desc) * qlen);
+    q->desc = (struct virtq_desc *) kmalloc(sizeof(struct virtq_desc) * qlen);
 
     // For the available ring, its given from the driver to the device queue
-    vbd->avail = (struct virtq_avail *) kmalloc(VIRTQ_AVAIL_SIZE(qlen));
+    q->avail = (struct virtq_avail *) kmalloc(VIRTQ_AVAIL_SIZE(qlen));
 
     // Similar for the used ring except this one is device to driver, but similar allocation to avail
-    vbd->used = (struct virtq_used *) kmalloc(VIRTQ_USED_SIZE(qlen));
+    q->used = (struct virtq_used *) kmalloc(VIRTQ_USED_SIZE(qlen));
 
-    // Allocation fail checks, if either of them is not "true", then set to fiaed and signal memory error
-    if(!vbd->desc || !vbd->avail || !vbd->used){
+    // Allocation fail checks, if either of them is not "true", then undo the queue and signal memory error
+    if(!q->desc || !q->avail || !q->used){
 
-        vbd->regs->status |= VIRTIO_STAT_FAILED;
+        vioblk_queue_close(vbd, q);
         return -ENOMEM;
     }
 
     // Zero initialize the virtqueue buffers, basically so that they start clear
-    memset((void *) vbd->desc, 0, sizeof(struct virtq_desc) * qlen);
-    memset((void *) vbd->avail, 0, VIRTQ_AVAIL_SIZE(qlen));
-    memset((void *) vbd->used, 0, VIRTQ_USED_SIZE(qlen));
+    memset((void *) q->desc, 0, sizeof(struct virtq_desc) * qlen);
+    memset((void *) q->avail, 0, VIRTQ_AVAIL_SIZE(qlen));
+    memset((void *) q->used, 0, VIRTQ_USED_SIZE(qlen));
 
-    // inititalse the descriptor positions and keep them clear to be stored in fetch and store
-    // Use xFF as the value as that is an invalid queue spot
-    memset(vbd->req_desc_header, 0xFF, sizeof(vbd->req_desc_header));
-    memset(vbd->req_desc_data, 0xFF, sizeof(vbd->req_desc_data));
-    memset(vbd->req_desc_status, 0xFF, sizeof(vbd->req_desc_status));
-
-    
     // Attach the virtq for device communication using function from virtio.h
     // Tells device the queue id, the number of entries based on qlen, and the buffer bases
-    virtio_attach_virtq(vbd->regs, 0, qlen, (uint64_t)(uintptr_t)vbd->desc, (uint64_t)(uintptr_t)vbd->used, (uint64_t)(uintptr_t)vbd->avail);
+    virtio_attach_virtq(vbd->regs, q->qid, qlen, (uint64_t)(uintptr_t)q->desc, (uint64_t)(uintptr_t)q->used, (uint64_t)(uintptr_t)q->avail);
 
-    // After wiring the addresses, enable queue 0 so that the device can use it
-    virtio_enable_virtq(vbd->regs, 0);
+    // After wiring the addresses, enable the queue so that the device can use it
+    virtio_enable_virtq(vbd->regs, q->qid);
 
     // Record the curent used idx as the starting point so new completions can be seen later
-    vbd->used_idx_seen = vbd->used->idx;
+    q->used_idx_seen = q->used->idx;
 
     // Build the descriptor free-list of indicies
     // Start by allocating a stack of free indicies for the virtqueue
-    vbd->free_stack = (uint16_t *) (kmalloc)(sizeof(uint16_t) * qlen);
+    q->free_stack = (uint16_t *) (kmalloc)(sizeof(uint16_t) * qlen);
 
-    // Fail check, if allocation failed, set status and return error
-    if(!vbd->free_stack){
+    // Fail check, if allocation failed, undo the queue and return error
+    if(!q->free_stack){
 
-        vbd->regs->status |= VIRTIO_STAT_FAILED;
+        vioblk_queue_close(vbd, q);
         return -ENOMEM;
     }
 
@@ -560,124 +849,101 @@ static int vioblk_storage_open(struct storage* sto) {
     for(uint16_t i = 0; i < qlen; i++){
 
         // Descriptor IDs
-        vbd->free_stack[i] = i;
+        q->free_stack[i] = i;
     }
 
     // Set the stack pointer to one past the last valid entry so qlen as stack goes up to qlen - 1 in the loop
-    vbd->free_top = qlen;
+    q->free_top = qlen;
 
     // Allocate header/status pools
     // Make space for qlen requeust headers, one per in-flight request where each header tells device what to r/w and where
-    vbd->header_pool = (struct virtio_blk_req_hdr *) (kmalloc(sizeof(struct virtio_blk_req_hdr) * qlen));
+    q->header_pool = (struct virtio_blk_req_hdr *) (kmalloc(sizeof(struct virtio_blk_req_hdr) * qlen));
 
     // Space for 1 byte statuts where device writes after a request, OK or ERR
-    vbd->status_pool = (volatile uint8_t *) kmalloc(qlen);
+    q->status_pool = (volatile uint8_t *) kmalloc(qlen);
+
+    // One indirect table per ring descriptor, the device reads them by physical address so they
+    // come from contiguous physical pages rather than the heap. Chained requests need none.
+    if(vbd->indirect){
+
+        q->indirect_pages = ROUND_UP(sizeof(struct virtq_desc) * VIOBLK_INDIRECT_LEN * qlen, PAGE_SIZE) / PAGE_SIZE;
+        q->indirect_pool = (struct virtq_desc *) alloc_phys_pages(q->indirect_pages);
+    }
 
     // Allocation fail check, if failed return Error
-    if(!vbd->header_pool || !vbd->status_pool){
+    if(!q->header_pool || !q->status_pool || (vbd->indirect && !q->indirect_pool)){
 
-        vbd->regs->status |= VIRTIO_STAT_FAILED;
+        vioblk_queue_close(vbd, q);
         return -ENOMEM;
     }
 
     // Zero initialize the allocated memory to make sure clear to start
-    memset((void *) vbd->header_pool, 0, sizeof(struct virtio_blk_req_hdr) * qlen);
-    memset((void *) vbd->status_pool, 0, qlen);
-
-    // Enable device intterups now that the queue is live and can properly recieve and execute
-    enable_intr_source(vbd->irqno, VIOBLK_INTR_PRIO, vioblk_isr, vbd);
-
-    // Mark device as opened and return
-    vbd->is_open = 1;
+    memset((void *) q->header_pool, 0, sizeof(struct virtio_blk_req_hdr) * qlen);
+    memset((void *) q->status_pool, 0, qlen);
 
-    // Check in the console that the device was actualy opened by printing the values of the rings and set values to the console
-    kprintf("vioblk_storage_open: qlen=%u irq=%d desc=%p avail=%p used=%p\n", vbd->q_size, vbd->irqno, vbd->desc, vbd->avail, vbd->used);
     return 0;
 }
 
-static void vioblk_storage_close(struct storage* sto) {
-    // FIXME
-
-    // Use the container_of we defined above to get vbd from the embedded wrapper
-    struct vioblk_storage * vbd = container_of(sto, struct vioblk_storage, blk_device);
-
-    // Check if open, if not return
-    if(!vbd->is_open){
-
-        return;
-    }
-
-    // stop interrupts from this device as it is being closed
-    disable_intr_source(vbd->irqno);
+static void vioblk_queue_close(struct vioblk_storage* vbd, struct vioblk_queue* q) {
 
-    // Select virtual queue 0 as virtio queue that all queue operations will apply to
-    vbd->regs->queue_sel = 0;
+    // Select this virtqueue as the one that all queue operations will apply to
+    vbd->regs->queue_sel = q->qid;
 
     // CPU finishes writing queue_sel before anything else
     __sync_synchronize();
 
-    // Device to reset queue 0, clears ring/state to stop it from being used
-    virtio_reset_virtq(vbd->regs, 0);
-
-    // Check for any latched device interrupts
-    // Local scope so that the variable pending only exists within these braces
-    {
-        // Read the device's intr status reg to check if any bits are set
-        uint32_t pending = vbd->regs->interrupt_status;
-
-        // if any bits are set, write the same bits to the ack register
-        if(pending){
-
-            // Acknoledeges taht the device saw the interrupts and that the intr can be cleared
-            vbd->regs->interrupt_ack = pending;
-        }
-    }
+    // Device to reset the queue, clears ring/state to stop it from being used
+    virtio_reset_virtq(vbd->regs, q->qid);
 
     // Free all the queue/shared-mem allocations, use the kfree function
-    if(vbd->desc){
+    if(q->desc){
 
-        kfree((void *) vbd->desc);
-        vbd->desc = NULL;
+        kfree((void *) q->desc);
+        q->desc = NULL;
     }
 
-    if(vbd->avail){
+    if(q->avail){
 
-        kfree((void *) vbd->avail);
-        vbd->avail = NULL;
+        kfree((void *) q->avail);
+        q->avail = NULL;
     }
 
-    if(vbd->used){
+    if(q->used){
 
-        kfree((void *) vbd->used);
-        vbd->used = NULL;
+        kfree((void *) q->used);
+        q->used = NULL;
     }
 
-    if(vbd->free_stack){
+    if(q->free_stack){
 
-        kfree((void *) vbd->free_stack);
-        vbd->free_stack = NULL;
+        kfree((void *) q->free_stack);
+        q->free_stack = NULL;
     }
 
-    if(vbd->header_pool){
+    if(q->header_pool){
 
-        kfree((void *) vbd->header_pool);
-        vbd->header_pool = NULL;
+        kfree((void *) q->header_pool);
+        q->header_pool = NULL;
     }
     
-    if(vbd->status_pool){
+    if(q->status_pool){
 
-        kfree((void *) vbd->status_pool);
-        vbd->status_pool = NULL;
+        kfree((void *) q->status_pool);
+        q->status_pool = NULL;
+    }
+
+    if(q->indirect_pool){
+
+        free_phys_pages((void *) q->indirect_pool, q->indirect_pages);
+        q->indirect_pool = NULL;
+        q->indirect_pages = 0;
     }
 
     // Clear the driver state elements of the queue, size, seen and stack top
-    vbd->q_size = 0;
-    vbd->used_idx_seen = 0;
-    vbd->free_top = 0;
+    q->q_size = 0;
+    q->used_idx_seen = 0;
+    q->free_top = 0;
 
-    // Mark the device as closed
-    vbd->is_open = 0;
-    
 }
 
 static long vioblk_storage_fetch(struct storage* sto, unsigned long long pos, void* buf,
@@ -705,8 +971,6 @@ static long vioblk_storage_fetch(struct storage* sto, unsigned long long pos, vo
     // Negotiated block size
     unsigned int blksz = vbd->blksz;
 
-    
-
     // Check if the starting position is greater than or at the capacity
     if(pos >= cap){
 
@@ -723,58 +987,60 @@ static long vioblk_storage_fetch(struct storage* sto, unsigned long long pos, vo
         bytecnt = (unsigned long) max_avail_bytes;
     }
 
-    // Start counter for how many bytes read in loop
-    unsigned long bytes_read = 0;
-
-    // Store the offset from the unaligned start
-    unsigned long long offset_block = pos % blksz;
+    // Unaligned ranges are handled above the driver (storage_read/storage_write), so pos is aligned here
+    // By MP3 Errata, round down bytecnt to a multiple of blksz
+    bytecnt = (bytecnt / blksz) * blksz;
 
-    // Need to create a case for an unaliigned start, use a temp buffer to copy the correct startig offset into the actual buffer
-    if(offset_block != 0){
+    // If it rounds down to 0, return
+    if(bytecnt == 0){
 
-        // Need to read the sector that contains the pos aligning it down
-        unsigned long long sector_start = pos - offset_block;
+        return 0;
+    }
 
-        // How much from the sectore we actually want
-        unsigned long copy_len = vbd->blksz - offset_block;
+    // Hand the aligned part to the shared request path, which batches the blocks into as few kicks
+    // and interrupts as possible
+    return vioblk_rw(vbd, VIRTIO_BLK_T_IN, pos, buf, bytecnt);
+}
 
-        // If tis over the bytecnt, set it to bytecnt to not overrun
-        if(copy_len > bytecnt){
+static long vioblk_storage_store(struct storage* sto, unsigned long long pos, const void* buf,
+                                 unsigned long bytecnt) {
+    // FIXME
 
-            copy_len = bytecnt;
-        }
+    // Use the container_of we defined above to get vbd from the embedded wrapper
+    struct vioblk_storage * vbd = container_of(sto, struct vioblk_storage, blk_device);
 
-        // Create the temp bufffer to holf the sector
-        unsigned char temp[512];
+    // Check if open, if not return
+    if(!vbd->is_open){
 
-        // Read exactly 1 block into the temp buffer
-        long n_bytes = vioblk_storage_fetch(sto, sector_start, temp, blksz);
+        return 0;
+    }
 
-        // USe the blksz to read the correct number of bytes
-        if(n_bytes != (long) blksz){
+    // Check for unaligned reads
+    //if((pos % vbd->blksz) != 0){
 
-            if(bytes_read > 0){
+        //return 0;
+   // }
 
-                return (long) bytes_read;
-            }
+    // Store the capacity of the disk in bytes
+    unsigned long long cap = sto->capacity;
 
-            return -1;
-        }
+    // Negotiated block size
+    unsigned int blksz = vbd->blksz;
 
-        // Copy the aligned bits to what is asctually wanted
-        memcpy((char *) buf, temp + offset_block, copy_len);
+    // Check if the starting position is greater than or at the capacity
+    if(pos >= cap){
 
-        // Incremeent everything
-        pos += copy_len;
-        buf = (char *) buf + copy_len;
-        bytecnt -= copy_len;
-        bytes_read += copy_len;
+        return 0;
+    }
 
-        // If the whole request was finished through this finish, otherwise continue as we did before
-        if(bytecnt == 0){
+    // Given that we still have bytes lefts as we passed through, find max bytes still available
+    unsigned long long max_avail_bytes = cap - pos;
+    
+    // Check that we are not reading past the end of the disk
+    // have to read bytecnt bytes so if its larger than max, change
+    if((unsigned long long) bytecnt > max_avail_bytes){
 
-            return (long) bytes_read;
-        }
+        bytecnt = (unsigned long) max_avail_bytes;
     }
 
     // By MP3 Errata, round down bytecnt to a multiple of blksz
@@ -786,615 +1052,503 @@ static long vioblk_storage_fetch(struct storage* sto, unsigned long long pos, vo
         return 0;
     }
 
+    // Hand the whole aligned range to the shared request path
+    return vioblk_rw(vbd, VIRTIO_BLK_T_OUT, pos, (void *) buf, bytecnt);
+}
 
-    // Loop to read through required number of bytes
-    while(bytes_read < bytecnt){
+static long vioblk_rw(struct vioblk_storage* vbd, uint32_t type, unsigned long long pos, void* buf,
+                      unsigned long bytecnt) {
 
-        // Read through the bytes in chunks
-        // First iteration will be remaining bytes to reach bytecnt
-        unsigned int chunk = (unsigned int)(bytecnt - bytes_read);
-        
+    // Negotiated block size, every request moves a multiple of it
+    unsigned int blksz = vbd->blksz;
 
-        // Cap the chunk at blksz because it cant handle larger requests
-        if(chunk > vbd->blksz){
+    // Spread submitters over the request queues by thread id, a thread always lands on the same one
+    struct vioblk_queue * q = &vbd->queues[running_thread() % vbd->num_queues];
 
-            chunk = vbd->blksz;
-        }
+    // Largest request: bounded by VIOBLK_REQ_MAX and by what the segment limits of the device allow
+    unsigned long req_max = VIOBLK_REQ_MAX;
 
-        // Defensive check to not build 0-len request
-        if(chunk == 0){
+    // A chained request takes header + segments + status ring descriptors, all of them must fit in the ring
+    uint32_t seg_cnt = vbd->seg_cnt_max;
 
-            break;
-        }
+    if(!vbd->indirect && seg_cnt + 2 > q->q_size){
 
-        // Current read starts at absolute_pos which is the curernt posistion plus bytes done
-        // VirtIO spec uses sectors, not bytes so convert bytes into sector
-        unsigned long long absolute_pos = pos + bytes_read;
-        unsigned long long sector = absolute_pos / 512ULL;
+        seg_cnt = q->q_size - 2;
+    }
 
-        // Create a pointer that points to where the chunk should be written into the buffer
-        // buf is the start of the users buf, and store bytes done after bytes after the start into the pointer
-        void * chunk_buf = (char *)buf + bytes_read;
+    if(vbd->seg_size_max != 0 && (unsigned long) vbd->seg_size_max * seg_cnt < req_max){
 
-        // Build the dscriptor chain, from the specs its a header, data buffer, and the status
-        // Use the allocated space from the free stack to pop three ids off the stack that can be used for the descriptor chains
-        // Before starting the process, lock the queue to protect it
-        lock_acquire(&vbd->queue_lock);
+        req_max = (unsigned long) vbd->seg_size_max * seg_cnt;
+    }
 
-        // If there are not enough free indicies, then release the lock
-        if(vbd->free_top < 3){
+    req_max = ROUND_DOWN(req_max, blksz);
 
-            // Release the lock
-            lock_release(&vbd->queue_lock);
-            break;
-        }
+    // A device limit below one block cannot be honored, fall back to one block per request
+    if(req_max == 0){
 
-        // Pop the descriptor IDs off the stack and start the chain
-        uint16_t desc_header = vbd->free_stack[--vbd->free_top];
+        req_max = blksz;
+    }
 
-        uint16_t desc_data = vbd->free_stack[--vbd->free_top];
+    // Ring descriptor and length of every request in the current batch
+    uint16_t heads[VIOBLK_BATCH_MAX];
+    unsigned long lens[VIOBLK_BATCH_MAX];
 
-        uint16_t desc_status = vbd->free_stack[--vbd->free_top];
+    // Start counter for how many bytes were transferred
+    unsigned long bytes_done = 0;
 
-        // Remember the position of the descriptors for this head and store it for the ISR to use to pop off the stack
-        // Map the ID into the ring index by moding the queue size
-        uint16_t slot = (uint16_t) (desc_header % vbd->q_size);
-        
-        // Store the ID's used for the requests
-        vbd->req_desc_header[slot] = desc_header;
-        vbd->req_desc_data[slot] = desc_data;
-        vbd->req_desc_status[slot] = desc_status;
-        
-        // Use the decriptor header to find the header in the array of header pool and status pool that belongs to the rqueust
-        // So header and status are pointers to the header and status byte of the request
-        struct virtio_blk_req_hdr * header = &vbd->header_pool[desc_header];
-        volatile uint8_t * status = &vbd->status_pool[desc_header];
+    // Loop until the whole range was transferred or a request failed, a flush goes around once
+    for(;;){
 
-        // fill virtio-blk request header with struct values necessary
-        // Fetching so we are currently reading
-        header->type = VIRTIO_BLK_T_IN; 
+        // Protect the descriptor table, free stack and avail ring while the batch is built
+        lock_acquire(&q->queue_lock);
 
-        // Leave this for padding
-        header->reserved = 0;
+        // Remember where the avail ring was so we can tell the device how far it moved
+        uint16_t old_avail_idx = q->avail->idx;
 
-        // Starting sector number on the disk where the read shoul start
-        header->sector = sector;
+        // Number of requests in this batch and bytes they cover
+        int nreq = 0;
+        unsigned long batch_bytes = 0;
 
-        // Clear the statys by setting it to xffu so that the device will write the outcome
-        * status = 0xFFu;
+        // Ring descriptors the next request needs, one with indirect tables
+        int ndesc = 1;
 
-        // Fill in the descriptors for the this request and chaing them together
-        // Header descriptor
-        vbd->desc[desc_header].addr = (uint64_t)(uintptr_t) header;
-        vbd->desc[desc_header].len = (uint32_t) sizeof(* header);
+        // Build requests until we run out of bytes or free ring descriptors
+        // A zero byte range still builds one request, that is how a flush goes out
+        while((nreq == 0 || bytes_done + batch_bytes < bytecnt) && nreq < VIOBLK_BATCH_MAX){
 
-        // Continute chain by flagging next and setting next to the next chain
-        vbd->desc[desc_header].flags = VIRTQ_DESC_F_NEXT;
-        vbd->desc[desc_header].next = desc_data;
+            // Bytes and buffer of this request
+            unsigned long req_len = MIN(bytecnt - bytes_done - batch_bytes, req_max);
+            char * req_buf = (char *) buf + bytes_done + batch_bytes;
 
-        // Data descriptor, device writes into the buffer
-        vbd->desc[desc_data].addr = (uint64_t)(uintptr_t) chunk_buf;
-        vbd->desc[desc_data].len = (uint32_t) chunk;
+            // Data segments of this request, no larger than the device accepts
+            int nseg = (vbd->seg_size_max == 0) ? (req_len != 0) : (int) ((req_len + vbd->seg_size_max - 1) / vbd->seg_size_max);
 
-        // Continute chain by flagging next and setting next to the next chain
-        // Descriptor will write into the buffer and then move to the other descriptor
-        vbd->desc[desc_data].flags = (VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT);
-        vbd->desc[desc_data].next = desc_status;
+            ndesc = vbd->indirect ? 1 : nseg + 2;
 
-        // Status descriptor, device writes
-        vbd->desc[desc_status].addr = (uint64_t)(uintptr_t) status;
-        vbd->desc[desc_status].len = 1;
+            if(q->free_top < ndesc){
 
-        // Continute chain by flagging next and setting next to the next chain
-        // Descriptor will write, no need for next
-        vbd->desc[desc_status].flags = VIRTQ_DESC_F_WRITE;
-        vbd->desc[desc_status].next = 0;
+                break;
+            }
 
-        // Now that the descriptors are filled in, publish the request to the available ring
-        uint16_t avail_idx = vbd->avail->idx;
+            // Pop the ring descriptor, its indirect table, header and status come with it
+            uint16_t desc_head = q->free_stack[--q->free_top];
+            struct virtio_blk_req_hdr * header = &q->header_pool[desc_head];
+            volatile uint8_t * status = &q->status_pool[desc_head];
 
-        // Wrap around the ring when the end is reached
-        // Next request to process starts at desc_header
-        vbd->avail->ring[avail_idx % vbd->q_size] = desc_header;
+            // Entries of the request: slots 0 to nseg + 1 of the indirect table, or a chain of ring
+            // descriptors starting at the head
+            struct virtq_desc * table;
+            uint16_t chain[VIOBLK_INDIRECT_LEN];
 
-        // Ensure that the writes to the ring are visibile before updating idk
-        __sync_synchronize();
+            if(vbd->indirect){
 
-        // Update the index of the avaialle index
-        vbd->avail->idx = (uint16_t)(avail_idx + 1);
+                table = &q->indirect_pool[desc_head * VIOBLK_INDIRECT_LEN];
 
-        // Store what the used index was before we notify the device
-        //uint16_t old_used_idx = vbd->used_idx_seen;
+                for(int i = 0; i < nseg + 2; i++){
 
-        // Notify the device queue that there is a request in the avail ring
-        virtio_notify_avail(vbd->regs, 0);
+                    chain[i] = i;
+                }
+            }
 
-        // Release the lock as there is no need for the queue to be protected as its not being updated
-        lock_release(&vbd->queue_lock);
+            else{
 
-        // Wait for ISR to finish the rquest, just wait unitl used->idx changes
-        // ISR may have already run so only sleep if no progress has occurred
-        // int pie = disable_interrupts();
+                table = q->desc;
+                chain[0] = desc_head;
 
-        // if(vbd->used_idx_seen == old_used_idx){
+                for(int i = 1; i < nseg + 2; i++){
 
-        int pie = disable_interrupts();
-        
-        if(*status == 0xFFu){
+                    chain[i] = q->free_stack[--q->free_top];
+                }
+            }
 
-            condition_wait(&vbd->done);
-        }
-        
-        else{
+            // Fill in the request header, VirtIO addresses the disk in 512 byte sectors whatever blksz is
+            header->type = type;
+            header->reserved = 0;
+            header->sector = (pos + bytes_done + batch_bytes) / 512ULL;
 
-            restore_interrupts(pie);
-        }
+            // Clear the status by setting it to 0xFF so that the device will write the outcome
+            * status = 0xFFu;
 
-        while(*status == 0xFFu){
+            // First entry is the header, device reads it
+            table[chain[0]].addr = (uint64_t)(uintptr_t) header;
+            table[chain[0]].len = (uint32_t) sizeof(* header);
+            table[chain[0]].flags = VIRTQ_DESC_F_NEXT;
+            table[chain[0]].next = chain[1];
 
-            //int pie = disable_interrupts();
-            //if(vbd->used_idx_seen == old_used_idx){
+            // Then the data, split into segments no larger than the device accepts
+            unsigned long seg_off = 0;
 
-            //vbd->waiter = 1;
-            condition_wait(&vbd->done);
-            //running_thread_yield();
-           // }
-            //restore_interrupts(pie);
+            for(int i = 0; i < nseg; i++){
 
-        }   
-        //vbd->waiter = 0;
+                unsigned long seg_len = req_len - seg_off;
 
-        // restore_interrupts(pie);
+                if(vbd->seg_size_max != 0 && seg_len > vbd->seg_size_max){
 
-        lock_acquire(&vbd->queue_lock);
+                    seg_len = vbd->seg_size_max;
+                }
 
-         // Check what the newest entry is, used idx says its finished up tot that index, while seen is whats processed
-        // q_size will be used for the wrapping of the ring buffer
-        uint16_t used_idx = vbd->used->idx;
-        uint16_t seen = vbd->used_idx_seen;
-        uint16_t qsz = vbd->q_size;
+                struct virtq_desc * seg = &table[chain[1 + i]];
 
-        // Walk tbrough every new entry, loop over each one not processed yet
-        while(seen != used_idx){
+                // Device writes into the buffer only for reads
+                seg->addr = (uint64_t)(uintptr_t) (req_buf + seg_off);
+                seg->len = (uint32_t) seg_len;
+                seg->flags = (type == VIRTIO_BLK_T_IN) ? (VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT) : VIRTQ_DESC_F_NEXT;
+                seg->next = chain[2 + i];
 
-            // Used entries are in a ring buffer
-            uint16_t slot = (uint16_t) (seen % qsz);
+                seg_off += seg_len;
+            }
 
-            // Each used element tells us which descriptor chain was completed
-            struct virtq_used_elem * used_elem = &vbd->used->ring[slot];
+            // Last entry is the status byte, device writes, end of the chain
+            table[chain[1 + nseg]].addr = (uint64_t)(uintptr_t) status;
+            table[chain[1 + nseg]].len = 1;
+            table[chain[1 + nseg]].flags = VIRTQ_DESC_F_WRITE;
+            table[chain[1 + nseg]].next = 0;
 
-            // Head descriptor index we had on the queue
-            uint16_t head_id = used_elem->id;
-            
-            // Check which request was completed and where
-            //kprintf("vioblk_isr: completed head=%u at slot=%u\n",head_id, slot);
+            // With indirect tables the ring descriptor just points at the table
+            if(vbd->indirect){
 
-            // Use the saved ids and find the slot that was used
-            uint16_t slot_used = (uint16_t) (head_id % qsz);
+                q->desc[desc_head].addr = (uint64_t)(uintptr_t) table;
+                q->desc[desc_head].len = (uint32_t) (sizeof(struct virtq_desc) * (nseg + 2));
+                q->desc[desc_head].flags = VIRTQ_DESC_F_INDIRECT;
+                q->desc[desc_head].next = 0;
+            }
 
-            // Use the stired value to push them back on the right spot in the stack
-            uint16_t header_pull = vbd->req_desc_header[slot_used];
-            uint16_t data_pull = vbd->req_desc_data[slot_used];
-            uint16_t status_pull = vbd->req_desc_status[slot_used];
+            // Place the head in the avail ring, it only becomes visible when the idx is updated below
+            q->avail->ring[(uint16_t)(old_avail_idx + nreq) % q->q_size] = desc_head;
 
-            // Returns the 3 descriptor Ids from the stack
-            // Check validity and then put back in correct spot
+            // Remember the head and length so we can wait on it and reclaim it
+            heads[nreq] = desc_head;
+            lens[nreq] = req_len;
+            nreq++;
 
-            if(status_pull != 0xFFFFu && vbd->free_top < vbd->q_size){
+            batch_bytes += req_len;
+        }
 
-                vbd->free_stack[vbd->free_top++] = header_pull;
-            }
+        // Every descriptor is in flight for other threads, sleep until some of them complete
+        if(nreq == 0){
 
-            if(data_pull != 0xFFFFu && vbd->free_top < vbd->q_size){
+            lock_release(&q->queue_lock);
 
-                vbd->free_stack[vbd->free_top++] = data_pull;
-            }
+            // Re-check with interrupts off so a reclaim cannot slip in between the check and the wait
+            int pie = disable_interrupts();
 
-            if(header_pull != 0xFFFFu && vbd->free_top < vbd->q_size){
+            if(q->free_top < ndesc){
 
-                vbd->free_stack[vbd->free_top++] = status_pull;
+                condition_wait(&q->done);
             }
-            
-            // Clear the remembered used slot to 0xFFFF
-            vbd->req_desc_header[slot_used] = 0xFFFFu;
-            vbd->req_desc_data[slot_used] = 0xFFFFu;
-            vbd->req_desc_status[slot_used] = 0xFFFFu;
-
-            // move to next used entr
-            seen++;
-        }
 
-        // store updated what has been seen
-        vbd->used_idx_seen = used_idx;
+            restore_interrupts(pie);
+            continue;
+        }
 
-        lock_release(&vbd->queue_lock);
+        // When polling without EVENT_IDX, ask the device not to interrupt for this batch unless some
+        // thread is already asleep waiting for one (with EVENT_IDX the stale used_event does this)
+        if(vbd->poll_ticks != 0 && !vbd->event_idx && q->sleepers == 0){
 
+            q->avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+        }
 
-        // Release the lock as there is no need for the queue to be protected as its not being updated
-        // lock_release(&vbd->queue_lock);
-        // }
+        // Ensure that the writes to the ring are visible before updating idx, then publish the whole batch at once
+        __sync_synchronize();
+        q->avail->idx = (uint16_t)(old_avail_idx + nreq);
 
-        //restore_interrupts(pie);
+        // One kick for the whole batch, and none at all if the device said it is still processing the ring
+        if(virtq_notify_needed(q->avail, q->used, q->q_size, old_avail_idx, vbd->event_idx)){
 
-        // Now that the ISR has completed, figure out which descriptor chain completed
-       // uint16_t completed_header = vbd->used->ring[old_used_idx % vbd->q_size].id;
+            virtio_notify_avail(vbd->regs, q->qid);
+        }
 
-        // Once we know the ID of the completed head, we can reclaim the chain and push them back onto the stack
-        // AS they are not being used, they are free so they are now on the free stack
-        
-        // vbd->free_stack[vbd->free_top++] = desc_status;
+        lock_release(&q->queue_lock);
 
-        // vbd->free_stack[vbd->free_top++] = desc_data;
+        // Set if we sleep on the interrupt and so count as a sleeper until the batch is reclaimed
+        int slept = 0;
 
-        // vbd->free_stack[vbd->free_top++] = desc_header;
+        // In polled mode, spin on the status bytes first, the interrupt is only armed if the window runs out
+        if(vbd->poll_ticks == 0 || !vioblk_poll(vbd, q, heads, nreq)){
 
-        // Check the status, set the status pointer to an int so we can compare
+            lock_acquire(&q->queue_lock);
 
-        // Release the lock as there is no need for the queue to be protected as its not being updated
-        // lock_release(&vbd->queue_lock); 
+            // Pollers stop suppressing interrupts while we sleep
+            q->sleepers++;
+            slept = 1;
 
-        uint8_t status_check = * status;
+            // Only interrupt once everything in flight is done instead of once per request
+            if(vbd->event_idx){
 
-     
+                virtq_set_used_event(q->avail, q->q_size, (uint16_t)(q->avail->idx - 1));
 
-        // Check to see if the device properly finished the request
-        if(status_check == VIRTIO_BLK_S_OK){
+                // The device may have finished everything before it could see the new used_event, in that case
+                // no interrupt is coming so wake any sleeping thread ourselves
+                if(q->used->idx == q->avail->idx){
 
-            // Chunk has been read
-            bytes_read += chunk;
-        }
+                    condition_broadcast(&q->done);
+                }
+            }
 
-        // If not, break
-        else{
+            // Re-arm the interrupt a poller may have suppressed, the status checks below come after it so
+            // a request that completed while it was off is still seen
+            else{
 
-            break;
-        }
-    }
+                q->avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+                __sync_synchronize();
+            }
 
-    // return the number of bytes read
-    return (long) bytes_read;
-}
+            lock_release(&q->queue_lock);
 
-static long vioblk_storage_store(struct storage* sto, unsigned long long pos, const void* buf,
-                                 unsigned long bytecnt) {
-    // FIXME
+            // Wait for every request in the batch, the ISR broadcasts done whenever the device interrupts
+            int pie = disable_interrupts();
 
-    // Use the container_of we defined above to get vbd from the embedded wrapper
-    struct vioblk_storage * vbd = container_of(sto, struct vioblk_storage, blk_device);
+            for(int i = 0; i < nreq; i++){
 
-    // Check if open, if not return
-    if(!vbd->is_open){
+                while(q->status_pool[heads[i]] == 0xFFu){
 
-        return 0;
-    }
+                    condition_wait(&q->done);
+                }
+            }
 
-    // Check for unaligned reads
-    //if((pos % vbd->blksz) != 0){
+            restore_interrupts(pie);
+        }
 
-        //return 0;
-   // }
+        // The device writes the status byte after the data, keep our reads of the data after it
+        __sync_synchronize();
 
-    // Store the capacity of the disk in bytes
-    unsigned long long cap = sto->capacity;
+        // Check the outcome of the requests in order and return the ring descriptors to the free stack
+        int failed = 0;
 
-    // Negotiated block size
-    unsigned int blksz = vbd->blksz;
+        lock_acquire(&q->queue_lock);
 
-    // Check if the starting position is greater than or at the capacity
-    if(pos >= cap){
+        // No longer waiting on the interrupt
+        q->sleepers -= slept;
 
-        return 0;
-    }
+        for(int i = 0; i < nreq; i++){
 
-    // Given that we still have bytes lefts as we passed through, find max bytes still available
-    unsigned long long max_avail_bytes = cap - pos;
-    
-    // Check that we are not reading past the end of the disk
-    // have to read bytecnt bytes so if its larger than max, change
-    if((unsigned long long) bytecnt > max_avail_bytes){
+            // Bytes only count up to the first failed request
+            if(q->status_pool[heads[i]] != VIRTIO_BLK_S_OK){
 
-        bytecnt = (unsigned long) max_avail_bytes;
-    }
+                failed = 1;
+            }
 
-    // By MP3 Errata, round down bytecnt to a multiple of blksz
-    bytecnt = (bytecnt / blksz) * blksz;
+            else if(!failed){
 
-    // If it rounds down to 0, return
-    if(bytecnt == 0){
+                bytes_done += lens[i];
+            }
 
-        return 0;
-    }
+            // The indirect table goes back with its ring descriptor, a chain goes back descriptor by descriptor
+            uint16_t d = heads[i];
 
-    // Start counter for how many bytes written in loop
-    unsigned long bytes_written = 0;
+            for(;;){
 
-    // Loop to read through required number of bytes
-    while(bytes_written < bytecnt){
+                q->free_stack[q->free_top++] = d;
 
-        // write through the bytes in chunks
-        // First iteration will be remaining bytes to reach bytecnt
-        unsigned int chunk = (unsigned int)(bytecnt - bytes_written);
+                if(!(q->desc[d].flags & VIRTQ_DESC_F_NEXT)){
 
-        // Cap the chunk at blksz because it cant handle larger requests
-        if(chunk > vbd->blksz){
+                    break;
+                }
 
-            chunk = vbd->blksz;
+                d = q->desc[d].next;
+            }
         }
 
-        // Defensive check to not build 0-len request
-        if(chunk == 0){
+        // Record how far the used ring has moved
+        q->used_idx_seen = q->used->idx;
 
-            break;
-        }
+        // Wake threads that were waiting for free descriptors
+        condition_broadcast(&q->done);
 
-        // Current read starts at absolute_pos which is the curernt posistion plus bytes done
-        // VirtIO spec uses sectors, not bytes so convert bytes into sector
-        unsigned long long absolute_pos = pos + bytes_written;
-        unsigned long long sector = absolute_pos / 512ULL;
+        lock_release(&q->queue_lock);
 
-        // Create a pointer that points to where the chunk should be written into the buffer
-        // buf is the start of the users buf, and store bytes done after bytes after the start into the pointer
-        void * chunk_buf = (char *)buf + bytes_written;
+        // Stop at the first failed request
+        if(failed){
 
-        // Build the dscriptor chain, from the specs its a header, data buffer, and the status
-        // Use the allocated space from the free stack to pop three ids off the stack that can be used for the descriptor chains
-        // Before starting the process, lock the queue to protect it
-        lock_acquire(&vbd->queue_lock);
+            // If nothing at all was transferred, report an I/O error
+            if(bytes_done == 0){
 
-        // If there are not enough free indicies, then release the lock
-        if(vbd->free_top < 3){
+                return -EIO;
+            }
 
-            // Release the lock
-            lock_release(&vbd->queue_lock);
             break;
         }
 
-        // Pop the descriptor IDs off the stack and start the chain
-        uint16_t desc_header = vbd->free_stack[--vbd->free_top];
-
-        uint16_t desc_data = vbd->free_stack[--vbd->free_top];
-
-        uint16_t desc_status = vbd->free_stack[--vbd->free_top];
-
-        // Remember the position of the descriptors for this head and store it for the ISR to use to pop off the stack
-        // Map the ID into the ring index by moding the queue size
-        uint16_t slot = (uint16_t) (desc_header % vbd->q_size);
-        
-        // Store the ID's used for the requests
-        vbd->req_desc_header[slot] = desc_header;
-        vbd->req_desc_data[slot] = desc_data;
-        vbd->req_desc_status[slot] = desc_status;
-        
-
-        // Use the decriptor header to find the header in the array of header pool and status pool that belongs to the rqueust
-        // So header and status are pointers to the header and status byte of the request
-        struct virtio_blk_req_hdr * header = &vbd->header_pool[desc_header];
-        volatile uint8_t * status = &vbd->status_pool[desc_header];
-
-        // fill virtio-blk request header with struct values necessary
-        // Fetching so we are currently writing
-        header->type = VIRTIO_BLK_T_OUT; 
-
-        // Leave this for padding
-        header->reserved = 0;
+        // Done once the whole range was transferred
+        if(bytes_done >= bytecnt){
 
-        // Starting sector number on the disk where the read shoul start
-        header->sector = sector;
-
-        // Clear the statys by setting it to xffu so that the device will write the outcome
-        * status = 0xFFu;
-
-        // Fill in the descriptors for the this request and chaing them together
-        // Header descriptor
-        vbd->desc[desc_header].addr = (uint64_t)(uintptr_t) header;
-        vbd->desc[desc_header].len = (uint32_t) sizeof(* header);
-
-        // Continute chain by flagging next and setting next to the next chain
-        vbd->desc[desc_header].flags = VIRTQ_DESC_F_NEXT;
-        vbd->desc[desc_header].next = desc_data;
+            break;
+        }
+    }
 
-        // Data descriptor, device writes into the buffer
-        vbd->desc[desc_data].addr = (uint64_t)(uintptr_t) chunk_buf;
-        vbd->desc[desc_data].len = (uint32_t) chunk;
+    return (long) bytes_done;
+}
 
-        // Continute chain by flagging next and setting next to the next chain
-        // Descriptor will move into the descriptor
-        vbd->desc[desc_data].flags = VIRTQ_DESC_F_NEXT;
-        vbd->desc[desc_data].next = desc_status;
+static int vioblk_poll(struct vioblk_storage* vbd, struct vioblk_queue* q, const uint16_t* heads,
+                       int nreq) {
 
-        // Status descriptor, device writes
-        vbd->desc[desc_status].addr = (uint64_t)(uintptr_t) status;
-        vbd->desc[desc_status].len = 1;
+    // Start of the spin window
+    unsigned long long start = rdtime();
 
-        // Continute chain by flagging next and setting next to the next chain
-        // Descriptor will write, no need for next
-        vbd->desc[desc_status].flags = VIRTQ_DESC_F_WRITE;
-        vbd->desc[desc_status].next = 0;
+    // Spin on each status byte in turn, the device writes it last so the data is in place once it changes
+    for(int i = 0; i < nreq; i++){
 
-        // Now that the descriptors are filled in, publish the request to the available ring
-        uint16_t avail_idx = vbd->avail->idx;
+        while(q->status_pool[heads[i]] == 0xFFu){
 
-        // Wrap around the ring when the end is reached
-        // Next request to process starts at desc_header
-        vbd->avail->ring[avail_idx % vbd->q_size] = desc_header;
+            // Window ran out, let the caller fall back to sleeping on the interrupt
+            if(rdtime() - start > vbd->poll_ticks){
 
-        // Ensure that the writes to the ring are visibile before updating idk
-        __sync_synchronize();
+                return 0;
+            }
+        }
+    }
 
-        // Update the index of the avaialle index
-        vbd->avail->idx = (uint16_t)(avail_idx + 1);
+    return 1;
+}
 
-        // Store what the used index was before we notify the device
-        //uint16_t old_used_idx = vbd->used_idx_seen;
+static int vioblk_storage_cntl(struct storage* sto, int op, void* arg) {
+    // FIXME
 
-        // Notify the device queue that there is a request in the avail ring
-        virtio_notify_avail(vbd->regs, 0);
+    // If the operation is GETEND, return the capacity in bytes
+    if(op == FCNTL_GETEND){
 
-        
-        // Release the lock as there is no need for the queue to be protected as its not being updated
-        lock_release(&vbd->queue_lock);
+        // If the caller does not provide a valid pointe, then return an error
+        if(arg == NULL){
 
-         // Wait for ISR to finish the rquest, just wait unitl used->idx changes
-        // ISR may have already run so only sleep if no progress has occurred
-        //int pie = disable_interrupts();
+            return -EINVAL;
+        }
 
-        //if(vbd->used_idx_seen == old_used_idx){
+        // Write capacity of the the storage into the argument
+        * (unsigned long long *) arg = sto->capacity;
 
-        int pie = disable_interrupts();
+        // return 0 for success
+        return 0;
+    }
 
-        if(*status == 0xFFu){
+    // Use the container_of we defined above to get vbd from the embedded wrapper
+    struct vioblk_storage * vbd = container_of(sto, struct vioblk_storage, blk_device);
 
-            condition_wait(&vbd->done);
-        }
+    // Set the polled completion window in microseconds, 0 turns polling off
+    if(op == FCNTL_SETPOLL){
 
-        else{
+        if(arg == NULL || * (unsigned long *) arg > VIOBLK_POLL_MAX_US){
 
-            restore_interrupts(pie);
+            return -EINVAL;
         }
 
-        while(*status == 0xFFu){
+        vbd->poll_ticks = * (unsigned long *) arg * (TIMER_FREQ / 1000000);
+        return 0;
+    }
 
-            //int pie = disable_interrupts();
-            //if(vbd->used_idx_seen == old_used_idx){
+    // Report the polled completion window in microseconds
+    if(op == FCNTL_GETPOLL){
 
-            //vbd->waiter = 1;
-            condition_wait(&vbd->done);
-            //running_thread_yield();
-           // }s
-            //restore_interrupts(pie);
+        if(arg == NULL){
 
-        }   
-        //vbd->waiter = 0;
+            return -EINVAL;
+        }
 
-        //restore_interrupts(pie);
+        * (unsigned long *) arg = vbd->poll_ticks / (TIMER_FREQ / 1000000);
+        return 0;
+    }
 
-        lock_acquire(&vbd->queue_lock);
+    // Drop or zero a range of the disk without moving its data
+    if(op == FCNTL_DISCARD){
 
-        // Check what the newest entry is, used idx says its finished up tot that index, while seen is whats processed
-        // q_size will be used for the wrapping of the ring buffer
-        uint16_t used_idx = vbd->used->idx;
-        uint16_t seen = vbd->used_idx_seen;
-        uint16_t qsz = vbd->q_size;
+        return vioblk_clear_range(vbd, VIRTIO_BLK_T_DISCARD, (const struct storage_range *) arg);
+    }
 
-        // Walk tbrough every new entry, loop over each one not processed yet
-        while(seen != used_idx){
+    if(op == FCNTL_WRITE_ZEROES){
 
-            // Used entries are in a ring buffer
-            uint16_t slot = (uint16_t) (seen % qsz);
+        return vioblk_clear_range(vbd, VIRTIO_BLK_T_WRITE_ZEROES, (const struct storage_range *) arg);
+    }
 
-            // Each used element tells us which descriptor chain was completed
-            struct virtq_used_elem * used_elem = &vbd->used->ring[slot];
+    // Return not supported for anything else
+    return -ENOTSUP;
+}
 
-            // Head descriptor index we had on the queue
-            uint16_t head_id = used_elem->id;
-            
-            // Check which request was completed and where
-            kprintf("vioblk_isr: completed head=%u at slot=%u\n",head_id, slot);
+static int vioblk_clear_range(struct vioblk_storage* vbd, uint32_t type,
+                              const struct storage_range* range) {
 
-            // Use the saved ids and find the slot that was used
-            uint16_t slot_used = (uint16_t) (head_id % qsz);
+    // Largest request the device accepts for this type, 0 means it cannot do it at all
+    uint32_t max_sectors = (type == VIRTIO_BLK_T_DISCARD) ? vbd->max_discard_sectors : vbd->max_write_zeroes_sectors;
 
-            // Use the stired value to push them back on the right spot in the stack
-            uint16_t header_pull = vbd->req_desc_header[slot_used];
-            uint16_t data_pull = vbd->req_desc_data[slot_used];
-            uint16_t status_pull = vbd->req_desc_status[slot_used];
+    if(max_sectors == 0){
 
-            // Returns the 3 descriptor Ids from the stack
-            // Check validity and then put back in correct spot
+        return -ENOTSUP;
+    }
 
-            if(status_pull != 0xFFFFu && vbd->free_top < vbd->q_size){
+    // The range has to be whole blocks inside the disk
+    if(range == NULL || !vbd->is_open){
 
-                vbd->free_stack[vbd->free_top++] = header_pull;
-            }
+        return -EINVAL;
+    }
 
-            if(data_pull != 0xFFFFu && vbd->free_top < vbd->q_size){
+    if(range->pos % vbd->blksz != 0 || range->len % vbd->blksz != 0 ||
+       range->pos > vbd->blk_device.capacity || range->len > vbd->blk_device.capacity - range->pos){
 
-                vbd->free_stack[vbd->free_top++] = data_pull;
-            }
+        return -EINVAL;
+    }
 
-            if(header_pull != 0xFFFFu && vbd->free_top < vbd->q_size){
+    // Keep every request a whole number of blocks
+    unsigned long long chunk_max = ROUND_DOWN((unsigned long long) max_sectors * 512ULL, vbd->blksz);
 
-                vbd->free_stack[vbd->free_top++] = status_pull;
-            }
-            
-            // Clear the remembered used slot to 0xFFFF
-            vbd->req_desc_header[slot_used] = 0xFFFFu;
-            vbd->req_desc_data[slot_used] = 0xFFFFu;
-            vbd->req_desc_status[slot_used] = 0xFFFFu;
-
-            // move to next used entr
-            seen++;
-        }
+    if(chunk_max == 0){
 
-        // store updated what has been seen
-        vbd->used_idx_seen = used_idx;
+        chunk_max = vbd->blksz;
+    }
 
-        lock_release(&vbd->queue_lock);
+    unsigned long long done = 0;
 
-        // Release the lock as there is no need for the queue to be protected as its not being updated
-        //lock_release(&vbd->queue_lock);
+    // One request per chunk, each with a single range segment the device reads
+    while(done < range->len){
 
-        //}
-        // restore_interrupts(pie);
+        unsigned long long chunk = MIN(range->len - done, chunk_max);
 
+        struct virtio_blk_discard_write_zeroes seg;
 
-        // Now that the ISR has completed, figure out which descriptor chain completed
-        //uint16_t completed_header = vbd->used->ring[old_used_idx % vbd->q_size].id;
+        seg.sector = (range->pos + done) / 512ULL;
+        seg.num_sectors = (uint32_t) (chunk / 512ULL);
 
-        // Once we know the ID of the completed head, we can reclaim the chain and push them back onto the stack
-        // AS they are not being used, they are free so they are now on the free stack
-        // vbd->free_stack[vbd->free_top++] = desc_status;
+        // Let write zeroes deallocate the range so a sparse backing file stays sparse
+        seg.flags = (type == VIRTIO_BLK_T_WRITE_ZEROES) ? VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP : 0;
 
-        // vbd->free_stack[vbd->free_top++] = desc_data;
+        // The header sector is unused for these requests
+        long result = vioblk_rw(vbd, type, 0, &seg, sizeof(seg));
 
-        // vbd->free_stack[vbd->free_top++] = desc_header;
+        if(result < 0){
 
-        // Release the lock as there is no need for the queue to be protected as its not being updated
-        // lock_release(&vbd->queue_lock);
+            return (int) result;
+        }
 
-        // Check the status, set the status pointer to an int so we can compare
-        uint8_t status_check = * status;
+        done += chunk;
+    }
 
-       
+    return 0;
+}
 
-        // Check to see if the device properly finished the request
-        if(status_check == VIRTIO_BLK_S_OK){
+static int vioblk_storage_flush(struct storage* sto) {
 
-            // Chunk has been read
-            bytes_written += chunk;
-        }
+    // Use the container_of we defined above to get vbd from the embedded wrapper
+    struct vioblk_storage * vbd = container_of(sto, struct vioblk_storage, blk_device);
 
-        // If not, break
-        else{
+    // Nothing to flush on a closed device
+    if(!vbd->is_open){
 
-            break;
-        }
+        return -EINVAL;
     }
 
-    return (long) bytes_written;
-}
+    // Without VIRTIO_BLK_F_FLUSH the device gives no way to ask for a barrier
+    if(!vbd->flush){
 
-static int vioblk_storage_cntl(struct storage* sto, int op, void* arg) {
-    // FIXME
-
-    // If the operation is GETEND, return the capacity in bytes
-    if(op == FCNTL_GETEND){
-
-        // If the caller does not provide a valid pointe, then return an error
-        if(arg == NULL){
+        return -ENOTSUP;
+    }
 
-            return -EINVAL;
-        }
+    // A flush is a header and a status byte with no data, the sector field must be 0
+    long result = vioblk_rw(vbd, VIRTIO_BLK_T_FLUSH, 0, NULL, 0);
 
-        // Write capacity of the the storage into the argument
-        * (unsigned long long *) arg = sto->capacity;
+    // Any failure of the request is a failed barrier
+    if(result < 0){
 
-        // return 0 for success
-        return 0;
+        return (int) result;
     }
 
-    // Return not supported for anything else
-    return -ENOTSUP;
+    return 0;
 }
 
 // ISR helper to check if any thread is waiting, ran into an assertion error so this to fix that
@@ -1447,7 +1601,11 @@ static void vioblk_isr(int irqno, void* aux) {
     // Check if someone is waiting, if they are, then broadcast
     
 
-    condition_broadcast(&vbd->done);
+    // The interrupt is shared by all request queues, wake the waiters of each
+    for(int i = 0; i < vbd->num_queues; i++){
+
+        condition_broadcast(&vbd->queues[i].done);
+    }
     
 
     // Release the lock as we are done changing any virtqueue structure
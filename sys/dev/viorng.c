@@ -99,6 +99,7 @@ struct viorng_serial
     uint8_t *buf;            // Pointer to buffer for random data
     uint32_t buf_len;        // Length of buffer in bytes
     volatile int data_ready; // Flag: 1 if new random data is available
+    int event_idx;           // 1 if VIRTIO_F_EVENT_IDX was negotiated
     struct condition ready; // CP3: used to check conditions for spin waiting
 };
 
@@ -153,6 +154,7 @@ void viorng_attach(volatile struct virtio_mmio_regs *regs, int irqno)
     // Negotiate VirtIO features
     virtio_featset_init(needed_features);
     virtio_featset_init(wanted_features);
+    virtio_featset_add(wanted_features, VIRTIO_F_EVENT_IDX);
     result = virtio_negotiate_features(regs,
                                        enabled_features, wanted_features, needed_features);
 
@@ -170,6 +172,7 @@ void viorng_attach(volatile struct virtio_mmio_regs *regs, int irqno)
     vrng->buf_len = VIORNG_BUFSZ;
     vrng->data_ready = 0;
     vrng->table_size = 1;
+    vrng->event_idx = virtio_featset_test(enabled_features, VIRTIO_F_EVENT_IDX);
     vrng->buf = kcalloc(1, vrng->buf_len);
 
     //CP3: add condition 
@@ -273,12 +276,21 @@ static int viorng_serial_recv(struct serial *ser, void *buf, unsigned int bufsz)
     v->data_ready = 0;
 
     // Make descriptor visible to device
-    v->avail.idx++;
-    v->avail.ring[v->avail.idx % v->table_size] = 0;
+    uint16_t old_idx = v->avail.idx;
+    v->avail.ring[old_idx % v->table_size] = 0;
+
+    // Ask for an interrupt when exactly this request completes; set before the
+    // device can see the request, or a fast completion could miss the old event
+    if (v->event_idx)
+        virtq_set_used_event(&v->avail, v->table_size, old_idx);
+
     __sync_synchronize();
+    v->avail.idx = old_idx + 1;
+
     //kprintf("[viorng] Requesting data: avail.idx=%d, used.idx=%d\n", v->avail.idx, v->used.idx);
-    // Notify device queue is ready
-    virtio_notify_avail(v->regs, 0);
+    // Notify device queue is ready, unless it asked not to be
+    if (virtq_notify_needed(&v->avail, &v->used, v->table_size, old_idx, v->event_idx))
+        virtio_notify_avail(v->regs, 0);
     //kprintf("[viorng-isr] Data ready: avail.idx=%d, used.idx=%d\n", v->avail.idx, v->used.idx);
     // Spin until device completes transfer
 
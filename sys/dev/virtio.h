@@ -135,9 +135,10 @@ struct virtq_avail {
 
 // VIRTQ_AVAIL_SIZE(n)
 // Evaluates to a compile-time constant giving the size of a virtq avail ring
-// sized for /n/ elements.
+// sized for /n/ elements. Includes the trailing used_event field (used when
+// VIRTIO_F_EVENT_IDX is negotiated).
 
-#define VIRTQ_AVAIL_SIZE(n) (sizeof(struct virtq_avail) + (n) * sizeof(uint16_t))
+#define VIRTQ_AVAIL_SIZE(n) (sizeof(struct virtq_avail) + ((n) + 1) * sizeof(uint16_t))
 
 struct virtq_used_elem {
     uint32_t id;   ///< Index of start of used descriptor chain
@@ -152,9 +153,11 @@ struct virtq_used {
 
 // VIRTQ_USED_SIZE(n)
 // Evaluates to a compile-time constant giving the size of a virtq used ring
-// sized for /n/ elements.
+// sized for /n/ elements. Includes the trailing avail_event field (used when
+// VIRTIO_F_EVENT_IDX is negotiated).
 
-#define VIRTQ_USED_SIZE(n) (sizeof(struct virtq_used) + (n) * sizeof(struct virtq_used_elem))
+#define VIRTQ_USED_SIZE(n) \
+    (sizeof(struct virtq_used) + (n) * sizeof(struct virtq_used_elem) + sizeof(uint16_t))
 
 // EXPORTED FUNCTION DEFINITIONS
 //
@@ -197,6 +200,34 @@ extern int virtio_negotiate_features(volatile struct virtio_mmio_regs* regs,
  */
 static inline void virtio_notify_avail(volatile struct virtio_mmio_regs* regs, int qid);
 
+/**
+ * @brief Decides whether the device must be notified after the driver moved the
+ * avail index from old_idx to the current avail->idx.
+ * @details With VIRTIO_F_EVENT_IDX, the device is notified only if the avail
+ * index crossed the avail_event published by the device. Without it, the
+ * device's VIRTQ_USED_F_NO_NOTIFY hint is honored.
+ * @param avail avail ring of the virtq
+ * @param used used ring of the virtq
+ * @param len len of virtq
+ * @param old_idx avail index before the new entries were published
+ * @param event_idx non-zero if VIRTIO_F_EVENT_IDX was negotiated
+ * @return 1 if the device must be notified, 0 otherwise
+ */
+static inline int virtq_notify_needed(const volatile struct virtq_avail* avail,
+                                      const volatile struct virtq_used* used, uint_fast16_t len,
+                                      uint16_t old_idx, int event_idx);
+
+/**
+ * @brief Tells the device to interrupt only once the used index moves past idx.
+ * @details Only meaningful when VIRTIO_F_EVENT_IDX was negotiated.
+ * @param avail avail ring of the virtq
+ * @param len len of virtq
+ * @param idx used index after which the driver wants an interrupt
+ * @return void
+ */
+static inline void virtq_set_used_event(volatile struct virtq_avail* avail, uint_fast16_t len,
+                                        uint16_t idx);
+
 /**
  * @brief Attaches virtq for device communication
  * @param regs register struct for device
@@ -311,6 +342,31 @@ static void virtio_notify_avail(volatile struct virtio_mmio_regs* regs, int qid)
     regs->queue_notify = qid;
 }
 
+// Evaluates to 1 if moving an index from old_idx to new_idx crossed event_idx,
+// which is how both sides of a virtq decide whether to notify with
+// VIRTIO_F_EVENT_IDX (see virtio spec 2.7.10).
+
+static inline int virtq_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx) {
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+static inline int virtq_notify_needed(const volatile struct virtq_avail* avail,
+                                      const volatile struct virtq_used* used, uint_fast16_t len,
+                                      uint16_t old_idx, int event_idx) {
+    __sync_synchronize();  // fence w,r: publish avail->idx before reading device's hint
+
+    if (event_idx)  // avail_event follows the used ring
+        return virtq_need_event(*(const volatile uint16_t*)&used->ring[len], avail->idx, old_idx);
+    else
+        return !(used->flags & VIRTQ_USED_F_NO_NOTIFY);
+}
+
+static inline void virtq_set_used_event(volatile struct virtq_avail* avail, uint_fast16_t len,
+                                        uint16_t idx) {
+    avail->ring[len] = idx;  // used_event follows the avail ring
+    __sync_synchronize();    // fence w,r
+}
+
 static inline void virtio_enable_virtq(volatile struct virtio_mmio_regs* regs, int qid) {
     regs->queue_sel = qid;
     __sync_synchronize();  // fence o,o
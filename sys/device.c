@@ -14,14 +14,32 @@
 #include "error.h"
 #include "fsimpl.h"
 #include "heap.h"
+#include "intr.h"
+#include "memory.h"
 #include "misc.h"
 #include "string.h"
+#include "thread.h"
 #include "uio.h"
 #include "uioimpl.h"
 
 // INTERNAL MACRO DEFINITIONS
 //
 
+// Size and number of the pooled bounce buffers used by storage_read and
+// storage_write for the partial blocks of an unaligned range. A range that
+// spans at most STORAGE_RMW_BUFSZ bytes of whole blocks is one request. The
+// buffers are whole physical pages, they are too large for the heap.
+
+#ifndef STORAGE_RMW_BUFSZ
+#define STORAGE_RMW_BUFSZ PAGE_SIZE
+#endif
+
+#define RMW_BUF_PAGES (ROUND_UP(STORAGE_RMW_BUFSZ, PAGE_SIZE) / PAGE_SIZE)
+
+#ifndef STORAGE_RMW_NBUF
+#define STORAGE_RMW_NBUF 4
+#endif
+
 // INTERNAL TYPE DEFINITIONS
 //
 
@@ -58,7 +76,6 @@ struct storage_uio {
     struct uio base;
     struct storage *sto;
     unsigned long pos;
-    char *buffer;
 };
 
 // INTERNAL FUNCTION DECLARATIONS
@@ -85,9 +102,17 @@ static void storage_uio_close(struct uio *uio);
 static long storage_uio_read(struct uio *uio, void *buf, unsigned long bufsz);
 static long storage_uio_write(struct uio *uio, const void *buf, unsigned long buflen);
 static int storage_uio_cntl(struct uio *uio, int op, void *arg);
-
-long unaligned_fetch(struct storage_uio *suio, void *buf, unsigned long bufsz);
-long unaligned_store(struct storage_uio *suio, const void *buf, unsigned long buflen);
+static long storage_uio_fetch(struct uio *uio, unsigned long long pos, void *buf,
+                              unsigned long bufsz);
+static long storage_uio_store(struct uio *uio, unsigned long long pos, const void *buf,
+                              unsigned long buflen);
+
+static long storage_rmw(struct storage *sto, unsigned long long pos, void *buf, unsigned long len,
+                        int write);
+static long storage_rmw_block(struct storage *sto, unsigned long long blkpos, unsigned long off,
+                              void *buf, unsigned long len, int write, char *bounce);
+static char *rmw_buf_get(void);
+static void rmw_buf_put(char *buf);
 
 static int video_open_uio(struct video *vid, struct uio **uioptr);
 static void video_uio_close(struct uio *uio);
@@ -104,6 +129,11 @@ char devmgr_initialized = 0;
 
 static struct device_record *devlist;
 
+static char *rmw_free[STORAGE_RMW_NBUF];  // pooled bounce buffers not in use
+static int rmw_nfree;                     // number of entries in rmw_free
+static int rmw_nalloc;                    // bounce buffers allocated so far
+static struct condition rmw_cond;         // signalled when a buffer is returned
+
 static const struct filesystem devfs = {.open = &devfs_open};
 
 // Array of /uio_intf/ structures indexed by device type. The first entry,
@@ -126,7 +156,9 @@ static const struct uio_intf serial_uio_intf = {.close = &serial_uio_close,
 static const struct uio_intf storage_uio_intf = {.close = &storage_uio_close,
                                                  .read = &storage_uio_read,
                                                  .write = &storage_uio_write,
-                                                 .cntl = &storage_uio_cntl};
+                                                 .cntl = &storage_uio_cntl,
+                                                 .fetch = &storage_uio_fetch,
+                                                 .store = &storage_uio_store};
 
 /**
  * @brief UIO interface containing write/cntl/close functions for video devices.
@@ -144,6 +176,7 @@ static const struct uio_intf video_uio_intf __attribute__((unused)) = {
  */
 void devmgr_init(void) {
     trace("%s()", __func__);
+    condition_init(&rmw_cond, "rmw_buf");
     devmgr_initialized = 1;
 }
 
@@ -409,6 +442,46 @@ long storage_store(struct storage *sto, unsigned long long pos, const void *buf,
         return -ENOTSUP;
 }
 
+/**
+ * @brief Function to call the flush function of the inputted storage device
+ * @param sto pointer to storage device struct
+ * @return 0 once all completed stores are durable, error code if error
+ */
+int storage_flush(struct storage *sto) {
+    if (sto == NULL) return -EINVAL;
+    if (sto->intf->flush != NULL)
+        return sto->intf->flush(sto);
+    else
+        return -ENOTSUP;
+}
+
+/**
+ * @brief Reads an arbitrary byte range from a storage device. Unlike storage_fetch, pos and
+ * bufsz need not be multiples of the block size.
+ * @param sto pointer to storage device struct
+ * @param pos position on storage device
+ * @param buf buffer to read data into
+ * @param bufsz number of bytes to read
+ * @return number of bytes read, error code if error
+ */
+long storage_read(struct storage *sto, unsigned long long pos, void *buf, unsigned long bufsz) {
+    return storage_rmw(sto, pos, buf, bufsz, 0);
+}
+
+/**
+ * @brief Writes an arbitrary byte range to a storage device. Partial blocks at either end are
+ * read, modified and written back.
+ * @param sto pointer to storage device struct
+ * @param pos position on storage device
+ * @param buf buffer to write data from
+ * @param buflen number of bytes to write
+ * @return number of bytes written, error code if error
+ */
+long storage_write(struct storage *sto, unsigned long long pos, const void *buf,
+                   unsigned long buflen) {
+    return storage_rmw(sto, pos, (void *)buf, buflen, 1);
+}
+
 /**
  * @brief Function to call the control function of the inputted storage device
  * @param sto pointer to storage device struct
@@ -424,6 +497,17 @@ int storage_cntl(struct storage *sto, int op, void *arg) {
         return -ENOTSUP;
 }
 
+/**
+ * @brief Function to get the memory backing a memory-backed storage device. Unlike a cntl
+ * operation, this is never forwarded from a storage uio, so the pointer stays in the kernel.
+ * @param sto pointer to storage device struct
+ * @return backing memory, NULL if the device is not memory-backed
+ */
+void *storage_direct(struct storage *sto) {
+    if (sto == NULL || sto->intf->direct == NULL) return NULL;
+    return sto->intf->direct(sto);
+}
+
 /**
  * @brief Function to get the block size in bytes of a storage device
  * @param sto pointer to storage device struct
@@ -693,10 +777,6 @@ int storage_open_uio(struct storage *sto, struct uio **uioptr) {
 
     suio = kcalloc(1, sizeof(*suio));
 
-    // we also need to create an internal buffer
-    // to deal with unaligned reads and writes
-    suio->buffer = kcalloc(1, sto->intf->blksz);
-
     suio->sto = sto;
     suio->pos = 0;
     *uioptr = uio_init1(&suio->base, &storage_uio_intf);
@@ -710,8 +790,6 @@ int storage_open_uio(struct storage *sto, struct uio **uioptr) {
 void storage_uio_close(struct uio *uio) {
     struct storage_uio *suio = (struct storage_uio *)uio;
     storage_close(suio->sto);
-
-    kfree(suio->buffer);
     kfree(suio);
 }
 
@@ -724,151 +802,238 @@ void storage_uio_close(struct uio *uio) {
  */
 long storage_uio_read(struct uio *uio, void *buf, unsigned long bufsz) {
     struct storage_uio *suio = (struct storage_uio *)uio;
-    long bytes_read = 0;
-    long result;
-    unsigned int blksz = suio->sto->intf->blksz;
-
-    if (suio->pos % blksz != 0) {  // unaligned starting pos
-        bytes_read = unaligned_fetch(suio, buf, bufsz);
-        if (bytes_read <= 0) return bytes_read;
-        suio->pos += bytes_read;
-        bufsz -= bytes_read;
-    }
-
-    if (bufsz == 0) return bytes_read;
+    long result = storage_read(suio->sto, suio->pos, buf, bufsz);
 
-    result = storage_fetch(suio->sto, suio->pos, buf + bytes_read, ROUND_DOWN(bufsz, blksz));
-
-    if (result < 0) return (bytes_read > 0) ? bytes_read : result;
-
-    suio->pos += result;
+    if (result > 0) suio->pos += result;
+    return result;
+}
 
-    if (result < ROUND_DOWN(bufsz, blksz)) return bytes_read + result;
+/**
+ * @brief Writes data from a buffer to a storage device
+ * @param uio pointer to storage uio object
+ * @param buf pointer to buffer containing data to write
+ * @param buflen size of buffer in bytes
+ * @return number of bytes written, negative error code if error
+ */
+long storage_uio_write(struct uio *uio, const void *buf, unsigned long buflen) {
+    struct storage_uio *suio = (struct storage_uio *)uio;
+    long result = storage_write(suio->sto, suio->pos, buf, buflen);
 
-    bytes_read += result;
-    bufsz -= result;
+    if (result > 0) suio->pos += result;
+    return result;
+}
 
-    if (bufsz % blksz != 0) {  // unaligned bufsz
-        result = unaligned_fetch(suio, buf + bytes_read, bufsz);
-        if (result < 0) return bytes_read;
-        bytes_read += result;
-        suio->pos += result;
+/**
+ * @brief Performs a control operation on a storage device
+ * @param uio pointer to storage uio object
+ * @param op control operation code
+ * @param arg pointer to argument for control operation
+ * @return 0 if successful, negative error code if error
+ */
+int storage_uio_cntl(struct uio *uio, int op, void *arg) {
+    struct storage_uio *suio = (struct storage_uio *)uio;
+    if (op == FCNTL_SETPOS) {
+        size_t *pos = (size_t *)arg;
+        if (pos == NULL || *pos > suio->sto->capacity) return -EINVAL;
+        suio->pos = *pos;
+        return 0;
     }
-
-    return bytes_read;
+    if (op == FCNTL_GETPOS) {
+        size_t *pos = (size_t *)arg;
+        if (pos == NULL) return -EINVAL;
+        *pos = suio->pos;
+        return 0;
+    }
+    if (op == FCNTL_MSYNC) return storage_flush(suio->sto);  // mapped pages were just stored
+    // Kernel only: the filesystem's range argument is larger than what sysfcntl copies in
+    if (op == FCNTL_DISCARD || op == FCNTL_WRITE_ZEROES) return -ENOTSUP;
+    // Kernel only: a plug left in place would hold every store of the mounted filesystem
+    if (op == FCNTL_PLUG || op == FCNTL_UNPLUG) return -ENOTSUP;
+    return storage_cntl(suio->sto, op, arg);
 }
 
 /**
- * @brief Helper function for `storage_uio_read`.
- * Aligns reads for when pos or bufsz is unaligned.
- * @param suio pointer to storage_uio object
+ * @brief Reads data from a storage device at a position without moving the uio's pos. Lets a
+ * storage device be memory-mapped with FCNTL_MMAP.
+ * @param uio pointer to storage uio object
+ * @param pos position on storage device
  * @param buf pointer to buffer to read data into
  * @param bufsz size of buffer in bytes
  * @return number of bytes read, negative error code if error
  */
-long unaligned_fetch(struct storage_uio *suio, void *buf, unsigned long bufsz) {
-    unsigned int blksz = suio->sto->intf->blksz;
-    long bytes_read = storage_fetch(suio->sto, ROUND_DOWN(suio->pos, blksz), suio->buffer, blksz);
-
-    if (bytes_read < 0) return bytes_read;
-
-    bytes_read = MIN(blksz - suio->pos % blksz, bufsz);
-    memcpy(buf, suio->buffer + suio->pos % blksz, bytes_read);
-    return bytes_read;
+long storage_uio_fetch(struct uio *uio, unsigned long long pos, void *buf, unsigned long bufsz) {
+    struct storage_uio *suio = (struct storage_uio *)uio;
+    return storage_read(suio->sto, pos, buf, bufsz);
 }
 
 /**
- * @brief Writes data from a buffer to a storage device
+ * @brief Writes data to a storage device at a position without moving the uio's pos. Used to
+ * write back dirty pages of a memory-mapped storage device.
  * @param uio pointer to storage uio object
+ * @param pos position on storage device
  * @param buf pointer to buffer containing data to write
  * @param buflen size of buffer in bytes
  * @return number of bytes written, negative error code if error
  */
-long storage_uio_write(struct uio *uio, const void *buf, unsigned long buflen) {
+long storage_uio_store(struct uio *uio, unsigned long long pos, const void *buf,
+                       unsigned long buflen) {
     struct storage_uio *suio = (struct storage_uio *)uio;
-    long bytes_written = 0;
-    long result;
-    unsigned int blksz = suio->sto->intf->blksz;
-
-    if (suio->pos % blksz != 0) {  // unaligned starting pos
-        result = unaligned_store(suio, buf, buflen);
-        if (result < 0) return result;
-        bytes_written = result;
-        suio->pos += bytes_written;
-        buflen -= bytes_written;
+    return storage_write(suio->sto, pos, buf, buflen);
+}
+
+/**
+ * @brief Shared body of storage_read and storage_write. Whole blocks go straight to the driver.
+ * When the blocks covering the range fit in one pooled bounce buffer, the range is moved with a
+ * single request (a store reads the blocks first). Longer ranges send the aligned middle
+ * directly and only the partial head and tail blocks through the bounce buffer.
+ * @param sto pointer to storage device struct
+ * @param pos position on storage device
+ * @param buf caller's buffer
+ * @param len number of bytes to move
+ * @param write 1 to store, 0 to fetch
+ * @return number of bytes moved, error code if error
+ */
+long storage_rmw(struct storage *sto, unsigned long long pos, void *buf, unsigned long len,
+                 int write) {
+    unsigned long long start, end;
+    unsigned long head, mid, done;
+    unsigned int blksz;
+    char *bounce;
+    long result = 0;
+
+    if (sto == NULL || buf == NULL) return -EINVAL;
+
+    blksz = sto->intf->blksz;
+
+    if (pos >= sto->capacity) return 0;
+    len = MIN(len, sto->capacity - pos);
+    if (len == 0) return 0;
+
+    head = pos % blksz;
+
+    if (head == 0 && len % blksz == 0) {
+        if (write)
+            return storage_store(sto, pos, buf, len);
+        else
+            return storage_fetch(sto, pos, buf, len);
     }
 
-    if (buflen == 0) return bytes_written;
+    if (blksz > STORAGE_RMW_BUFSZ) return -ENOTSUP;
 
-    result = storage_store(suio->sto, suio->pos, buf + bytes_written, ROUND_DOWN(buflen, blksz));
+    start = pos - head;
+    end = ROUND_UP(pos + len, blksz);
+    bounce = rmw_buf_get();
+    if (bounce == NULL) return -ENOMEM;
 
-    if (result < 0) return (bytes_written > 0) ? bytes_written : result;
+    if (end - start <= STORAGE_RMW_BUFSZ) {
+        result = storage_rmw_block(sto, start, head, buf, len, write, bounce);
+        rmw_buf_put(bounce);
+        return result;
+    }
+
+    done = 0;
 
-    suio->pos += result;
+    if (head != 0) {  // partial head block
+        result = storage_rmw_block(sto, start, head, buf, blksz - head, write, bounce);
+        if (result <= 0) goto out;
+        done = result;
+    }
 
-    if (result < ROUND_DOWN(buflen, blksz)) return bytes_written + result;
+    mid = ROUND_DOWN(len - done, blksz);
 
-    bytes_written += result;
-    buflen -= result;
+    if (mid != 0) {  // whole blocks, no copy
+        if (write)
+            result = storage_store(sto, pos + done, buf + done, mid);
+        else
+            result = storage_fetch(sto, pos + done, buf + done, mid);
+        if (result <= 0) goto out;
+        done += result;
+        if ((unsigned long)result < mid) goto out;
+    }
 
-    if (buflen % blksz != 0) {  // unaligned buflen
-        result = unaligned_store(suio, buf + bytes_written, buflen);
-        if (result < 0) return bytes_written;
-        bytes_written += result;
-        suio->pos += result;
+    if (done < len) {  // partial tail block
+        result = storage_rmw_block(sto, pos + done, 0, buf + done, len - done, write, bounce);
+        if (result > 0) done += result;
     }
 
-    return bytes_written;
+out:
+    rmw_buf_put(bounce);
+    return (done > 0) ? (long)done : result;
 }
 
 /**
- * @brief Helper function for `storage_uio_write`.
- * Aligns writes for when pos or bufsz is unaligned.
- * @param suio pointer to storage_uio object
- * @param buf pointer to buffer to read data into
- * @param buflen size of buffer in bytes
- * @return number of bytes read, negative error code if error
+ * @brief Moves len bytes at offset off of the whole blocks starting at blkpos through the
+ * bounce buffer with one fetch (and one store when writing).
+ * @return number of bytes moved, error code if error
  */
-long unaligned_store(struct storage_uio *suio, const void *buf, unsigned long buflen) {
-    unsigned int blksz = suio->sto->intf->blksz;
-    long bytes_written = 0;
-    // fetch the original block of data
-    long result = storage_fetch(suio->sto, ROUND_DOWN(suio->pos, blksz), suio->buffer, blksz);
+long storage_rmw_block(struct storage *sto, unsigned long long blkpos, unsigned long off,
+                       void *buf, unsigned long len, int write, char *bounce) {
+    unsigned long span = ROUND_UP(off + len, sto->intf->blksz);
+    long result;
 
+    result = storage_fetch(sto, blkpos, bounce, span);
     if (result < 0) return result;
 
-    bytes_written = MIN(blksz - suio->pos % blksz, buflen);
-    // overwrite with new data and store in its place
-    memcpy(suio->buffer + suio->pos % blksz, buf, bytes_written);
-    result = storage_store(suio->sto, ROUND_DOWN(suio->pos, blksz), suio->buffer, blksz);
+    if (!write) {
+        if ((unsigned long)result <= off) return 0;
+        len = MIN(len, (unsigned long)result - off);
+        memcpy(buf, bounce + off, len);
+        return len;
+    }
+
+    if ((unsigned long)result < span) return -EIO;
 
+    memcpy(bounce + off, buf, len);
+    result = storage_store(sto, blkpos, bounce, span);
     if (result < 0) return result;
+    if ((unsigned long)result < span) return -EIO;
 
-    return bytes_written;
+    return len;
 }
 
 /**
- * @brief Performs a control operation on a storage device
- * @param uio pointer to storage uio object
- * @param op control operation code
- * @param arg pointer to argument for control operation
- * @return 0 if successful, negative error code if error
+ * @brief Takes a bounce buffer from the pool, allocating one while fewer than
+ * STORAGE_RMW_NBUF exist and sleeping otherwise.
+ * @return bounce buffer of STORAGE_RMW_BUFSZ bytes, or NULL if out of memory
  */
-int storage_uio_cntl(struct uio *uio, int op, void *arg) {
-    struct storage_uio *suio = (struct storage_uio *)uio;
-    if (op == FCNTL_SETPOS) {
-        size_t *pos = (size_t *)arg;
-        if (pos == NULL || *pos > suio->sto->capacity) return -EINVAL;
-        suio->pos = *pos;
-        return 0;
+char *rmw_buf_get(void) {
+    char *buf;
+    int pie;
+
+    pie = disable_interrupts();
+
+    while (rmw_nfree == 0 && rmw_nalloc == STORAGE_RMW_NBUF) condition_wait(&rmw_cond);
+
+    if (rmw_nfree > 0) {
+        buf = rmw_free[--rmw_nfree];
+        restore_interrupts(pie);
+        return buf;
     }
-    if (op == FCNTL_GETPOS) {
-        size_t *pos = (size_t *)arg;
-        if (pos == NULL) return -EINVAL;
-        *pos = suio->pos;
-        return 0;
+
+    rmw_nalloc += 1;
+    restore_interrupts(pie);
+
+    buf = alloc_phys_pages(RMW_BUF_PAGES);
+
+    if (buf == NULL) {  // give the slot back so a later call can try again
+        pie = disable_interrupts();
+        rmw_nalloc -= 1;
+        restore_interrupts(pie);
+        condition_broadcast(&rmw_cond);
     }
-    return storage_cntl(suio->sto, op, arg);
+
+    return buf;
+}
+
+/**
+ * @brief Returns a bounce buffer to the pool.
+ * @param buf buffer obtained from rmw_buf_get
+ */
+void rmw_buf_put(char *buf) {
+    int pie = disable_interrupts();
+    rmw_free[rmw_nfree++] = buf;
+    restore_interrupts(pie);
+    condition_broadcast(&rmw_cond);
 }
 
 int video_open_uio(struct video *vid, struct uio **uioptr) { return -ENOTSUP; }
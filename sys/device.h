@@ -14,6 +14,26 @@ enum device_type {
     DEV_VIDEO     // viogpu
 };
 
+// Storage-specific fcntl values (see also uio.h)
+
+#define FCNTL_PLUG 16     // arg is unused; hold stores until FCNTL_UNPLUG
+#define FCNTL_UNPLUG 17   // arg is unused; dispatch held stores and wait
+#define FCNTL_SETPOLL 18  // arg is unsigned long * (polled completion window in us, 0 = off)
+#define FCNTL_GETPOLL 19  // arg is unsigned long *
+#define FCNTL_DISCARD 20  // arg is const struct storage_range *; range contents become undefined
+#define FCNTL_WRITE_ZEROES 21  // arg is const struct storage_range *
+
+// FCNTL_PLUG, FCNTL_UNPLUG, FCNTL_DISCARD and FCNTL_WRITE_ZEROES are for storage_cntl()
+// callers in the kernel only; storage uios (user fcntl) reject them.
+
+// Byte range argument of FCNTL_DISCARD and FCNTL_WRITE_ZEROES. Both fields must be
+// multiples of the device block size.
+
+struct storage_range {
+    unsigned long long pos;  // first byte of the range
+    unsigned long long len;  // length of the range in bytes
+};
+
 struct serial;   // opaque decl.
 struct storage;  // opaque decl.
 struct video;    // opaque decl.
@@ -66,8 +86,18 @@ extern long storage_fetch(struct storage* sto, unsigned long long pos, void* buf
 extern long storage_store(struct storage* sto, unsigned long long pos, const void* buf,
                           unsigned long bytecnt);
 
+extern long storage_read(struct storage* sto, unsigned long long pos, void* buf,
+                         unsigned long bytecnt);
+
+extern long storage_write(struct storage* sto, unsigned long long pos, const void* buf,
+                          unsigned long bytecnt);
+
+extern int storage_flush(struct storage* sto);
+
 extern int storage_cntl(struct storage* sto, int op, void* arg);
 
+extern void* storage_direct(struct storage* sto);
+
 extern unsigned int storage_blksz(const struct storage* sto);
 
 extern unsigned long long storage_capacity(const struct storage* sto);
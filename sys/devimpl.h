@@ -136,6 +136,13 @@ struct storage_intf {
     long (*store)(struct storage* sto, unsigned long long pos, const void* buf,
                   unsigned long bytecnt);
 
+    /**
+     * @brief Makes every store completed so far durable (write barrier). May be NULL for
+     * devices without a volatile write cache.
+     * @param sto Pointer to storage device instance
+     */
+    int (*flush)(struct storage* sto);
+
     /**
      * @brief Control operation on device
      * @param sto Pointer to storage device instance
@@ -143,6 +150,13 @@ struct storage_intf {
      * @param arg Argument for operation
      */
     int (*cntl)(struct storage* sto, int op, void* arg);
+
+    /**
+     * @brief Returns the memory backing a memory-backed device, so a cache on top of it can use
+     * the blocks in place. May be NULL. Kernel only: storage uios never reach it.
+     * @param sto Pointer to storage device instance
+     */
+    void* (*direct)(struct storage* sto);
 };
 
 /**
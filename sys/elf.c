@@ -141,6 +141,58 @@ struct elf64_phdr {
 
 #define MAX_READ_SIZE (16 * 1024) // 16KB chunks
 
+/**
+ * \brief Allocates private pages for [start, end) of a segment and reads the
+ * segment's file bytes that fall in the range into them.
+ *
+ * \param[in] uio    ELF file
+ * \param[in] ph     Program header of the segment
+ * \param[in] start  Page-aligned start of the range
+ * \param[in] end    Page-aligned end of the range
+ * \param[in] flags  Mapping flags of the pages
+ *
+ * \return 0 on success, or a negative error code on failure.
+ */
+static int elf_load_private(struct uio *uio, const struct elf64_phdr *ph,
+                            uintptr_t start, uintptr_t end, int flags) {
+  if (start >= end) {
+    return 0;
+  }
+
+  if (alloc_and_map_range(start, end - start, flags) == NULL) {
+    return -ENOMEM;
+  }
+
+  // File bytes of the segment inside the range
+  uintptr_t from = MAX(start, (uintptr_t)ph->p_vaddr);
+  uintptr_t to = MIN(end, (uintptr_t)(ph->p_vaddr + ph->p_filesz));
+  if (from >= to) {
+    return 0;
+  }
+
+  // Seek to segment data
+  unsigned long long pos = ph->p_offset + (from - ph->p_vaddr);
+  if (uio_cntl(uio, FCNTL_SETPOS, &pos) != 0) {
+    return -EIO;
+  }
+
+  // Read segment data directly into memory, in chunks for very large segments
+  size_t remaining = to - from;
+  size_t offset = 0;
+
+  while (remaining > 0) {
+    size_t chunk = (remaining > MAX_READ_SIZE) ? MAX_READ_SIZE : remaining;
+    long bytes_read = uio_read(uio, (void *)(from + offset), chunk);
+    if (bytes_read < 0 || (size_t)bytes_read != chunk) {
+      return -EIO;
+    }
+    offset += chunk;
+    remaining -= chunk;
+  }
+
+  return 0;
+}
+
 int elf_load(struct uio *uio, void (**eptr)(void)) {
   if (uio == NULL || eptr == NULL) {
     return -EINVAL;
@@ -252,11 +304,10 @@ int elf_load(struct uio *uio, void (**eptr)(void)) {
       return -EBADFMT;
     }
 
-    // Stack is at UMEM_END_VMA - PAGE_SIZE
-    uintptr_t stack_start = UMEM_END_VMA - PAGE_SIZE;
-    if (ph->p_vaddr + ph->p_memsz > stack_start) {
+    // Heap and stack live from UHEAP_START_VMA up
+    if (ph->p_vaddr + ph->p_memsz > UHEAP_START_VMA) {
       kfree(phdrs);
-      return -EBADFMT; // Would clobber stack area
+      return -EBADFMT; // Would clobber heap or stack area
     }
 
     // For strict memory validation, check if it's a real executable
@@ -290,49 +341,63 @@ int elf_load(struct uio *uio, void (**eptr)(void)) {
       temp_map_flags |= PTE_X;
     }
 
-    /* allocate physical pages and map into active address space */
-    if (alloc_and_map_range(page_aligned_start, map_size, temp_map_flags) ==
-        NULL) {
-      kfree(phdrs);
-      return -ENOMEM;
+    /* Whole pages of a read-only segment that hold nothing but file bytes are
+       mapped straight from the file's page cache, so every process running the
+       program shares them. The partial pages at either end and writable
+       segments get private copies. */
+    uintptr_t file_end = ROUND_UP(seg_vstart + ph->p_filesz, PAGE_SIZE);
+    uintptr_t seg_end = page_aligned_start + map_size;
+    uintptr_t share_start = file_end;
+    uintptr_t share_end = file_end;
+
+    if (!(ph->p_flags & PF_W) &&
+        ph->p_offset % PAGE_SIZE == seg_vstart % PAGE_SIZE) {
+      share_start = ROUND_UP(seg_vstart, PAGE_SIZE);
+      share_end = MAX(share_start,
+                      ROUND_DOWN(seg_vstart + ph->p_filesz, PAGE_SIZE));
+    }
+
+    int share_flags = PTE_R | PTE_U;
+    if (ph->p_flags & PF_X) {
+      share_flags |= PTE_X;
+    }
+
+    for (uintptr_t va = share_start; va < share_end; va += PAGE_SIZE) {
+      void *pp;
+      if (uio_getpage(uio, ph->p_offset + (va - seg_vstart), &pp) != 0) {
+        share_end = va; // not cached (or not a file), copy the rest
+        break;
+      }
+      map_page(va, pp, share_flags); // the mapping owns the reference
+    }
+
+    rc = elf_load_private(uio, ph, page_aligned_start, share_start,
+                          temp_map_flags);
+    if (rc == 0) {
+      rc = elf_load_private(uio, ph, share_end, file_end, temp_map_flags);
     }
-    kprintf("[ELF] About to read %lu bytes to %p\n",
-            (unsigned long)ph->p_filesz, (void *)ph->p_vaddr);
-            
-    // Seek to segment data
-    pos = ph->p_offset;
-    rc = uio_cntl(uio, FCNTL_SETPOS, &pos);
     if (rc != 0) {
       kfree(phdrs);
-      return -EIO;
+      return rc;
     }
 
-    // Read segment data directly into memory
-    if (ph->p_filesz > 0) { 
-      // For very large segments, read in chunks
-      size_t remaining = ph->p_filesz;
-      size_t offset = 0;
-
-      while (remaining > 0) {
-        size_t chunk = (remaining > MAX_READ_SIZE) ? MAX_READ_SIZE : remaining;
-        bytes_read =
-            uio_read(uio, (void *)(uintptr_t)(ph->p_vaddr + offset), chunk);
-        if (bytes_read < 0 || (size_t)bytes_read != chunk) {
-          kfree(phdrs);
-          return -EIO;
-        }
-        offset += chunk;
-        remaining -= chunk;
+    /* The rest of the segment (.bss) is a lazy range that is zero-filled page
+       by page on first touch */
+    if (seg_end > file_end) {
+      rc = add_lazy_range(file_end, seg_end - file_end, temp_map_flags);
+      if (rc != 0) {
+        kfree(phdrs);
+        return rc;
       }
     }
 
     kprintf("[ELF] Mapped pages at %p, size %lu\n", (void *)page_aligned_start,
             map_size);
             
-    // Zero out remaining memory
+    // Zero out the rest of the last file page; lazy pages come zeroed
     if (ph->p_memsz > ph->p_filesz) {
       memset((void *)(uintptr_t)(ph->p_vaddr + ph->p_filesz), 0,
-             ph->p_memsz - ph->p_filesz);
+             MIN(ph->p_memsz, file_end - seg_vstart) - ph->p_filesz);
     }
   }
   // ADD THIS CHECK: Ensure we found at least one PT_LOAD segment
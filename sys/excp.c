@@ -34,6 +34,23 @@ extern void handle_umode_exception(unsigned int cause, struct trap_frame* tfr);
  */
 extern void handle_syscall(struct trap_frame* tfr);  // syscall.c
 
+/**
+ * @brief Entry of the exception fixup table, built by the EXTAB macro in ucopy.s
+ */
+struct extab_entry {
+  uintptr_t insn;   ///< Instruction that may fault on a user address
+  uintptr_t fixup;  ///< Where to resume if the fault cannot be resolved
+};
+
+// linker-provided (kernel.ld)
+extern const struct extab_entry _kimg_extab_start[];
+extern const struct extab_entry _kimg_extab_end[];
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static uintptr_t extab_fixup(uintptr_t pc);
+
 // INTERNAL GLOBAL VARIABLES
 //
 
@@ -70,6 +87,26 @@ void handle_smode_exception(unsigned int cause, struct trap_frame* tfr) {
           // csrr_stval());
   const char *name = NULL;
   char msgbuf[80];
+  uintptr_t fixup = extab_fixup((uintptr_t)tfr->sepc);
+
+  // A user access in ucopy.s faulted. Resolve it the way a U mode access would
+  // be (lazy page, copy-on-write page) and retry; otherwise make the routine
+  // return an error.
+  if (fixup != 0) {
+    switch (cause) {
+    case RISCV_SCAUSE_LOAD_PAGE_FAULT:
+    case RISCV_SCAUSE_STORE_PAGE_FAULT:
+      if (handle_umode_page_fault(tfr, csrr_stval()))
+        return;
+      // fall through
+    case RISCV_SCAUSE_LOAD_ACCESS_FAULT:
+    case RISCV_SCAUSE_STORE_ACCESS_FAULT:
+    case RISCV_SCAUSE_LOAD_ADDR_MISALIGNED:
+    case RISCV_SCAUSE_STORE_ADDR_MISALIGNED:
+      tfr->sepc = (void *)fixup;
+      return;
+    }
+  }
 
   if (0 <= cause && cause < sizeof(excp_names) / sizeof(excp_names[0]))
     name = excp_names[cause];
@@ -120,7 +157,7 @@ void handle_umode_exception(unsigned int cause, struct trap_frame* tfr) {
 
     if(x) { 
         int y = handle_umode_page_fault(tfr, bad_vaddr); // attempt resolve
-        if(y == 0) return; 
+        if(y != 0) return; // handled, restart the instruction
     }
 
     const char *name = NULL; // choose a label for the cause
@@ -161,3 +198,22 @@ void handle_umode_exception(unsigned int cause, struct trap_frame* tfr) {
     kprintf("%s\n", buf); // log and exit
     process_exit(); // kill the process
 }
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+/**
+ * @brief Looks up the fixup address of an instruction in the exception fixup table
+ * @param pc Address of the faulting instruction
+ * @return Fixup address, or 0 if the instruction is not in the table
+ */
+static uintptr_t extab_fixup(uintptr_t pc) {
+  const struct extab_entry *ent;
+
+  for (ent = _kimg_extab_start; ent < _kimg_extab_end; ent++) {
+    if (ent->insn == pc)
+      return ent->fixup;
+  }
+
+  return 0;
+}
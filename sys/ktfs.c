@@ -22,6 +22,7 @@
 #include "filesys.h"
 #include "fsimpl.h"
 #include "heap.h"
+#include "memory.h"
 #include "misc.h"
 #include "string.h"
 #include "thread.h"
@@ -29,13 +30,23 @@
 #include "uioimpl.h"
 #include <stdbool.h>
 
+#define KTFS_PAGE_BLKS (PAGE_SIZE / KTFS_BLKSZ) // file blocks per page cache page
+#define KTFS_PCACHE_MAX 256 // pages the page cache of a mount may hold (1 MiB)
+#define KTFS_PCACHE_BUCKETS 16 // hash buckets of cached pages per in-core inode
+#define KTFS_ZERO_OFFLOAD_MIN 8 // runs at least this many blocks long are zeroed by the device
+#define KTFS_ALLOC_NOZERO 2 // allocE value: new data blocks are left for the caller to zero (tables still are)
 
-
+struct ktfs_icore;
 
 struct ktfs_mount {
     struct filesystem fs; // filesystem ops table + identity for this mount
     struct cache* cache;  // backing block cache we read/write through
     struct lock mount_lock; //mount lock
+
+    struct ktfs_icore* icores; // in-core inodes of open or cached files
+    struct lock pcache_lock; // protects icores and their cached pages
+    unsigned int pcache_pages; // pages held by the page cache
+    unsigned int pcache_timer; // access clock for LRU eviction of cached pages
 };
 
 
@@ -56,6 +67,35 @@ struct ktfs_uio {
     struct ktfs_file file; // contains per-file info like size and position
     uint16_t inode_number; // inode identifier for the open file
     struct lock file_lock; //file lock
+    bool written; // set by ktfs_store, the file's writes are committed with one flush on close
+    struct ktfs_icore* icore; // in-core inode shared with other opens of the file
+};
+
+/// @brief A page of file data held by the page cache
+struct ktfs_cpage {
+    struct ktfs_cpage* next; // next cached page in the same hash bucket
+    uint32_t index; // page index within the file
+    unsigned int access_time; // page cache clock at last use
+    void* page; // physical page with the data, zeros past the end of the file
+};
+
+/// @brief In-core inode, shared by all opens of a file and kept while it has cached pages
+struct ktfs_icore {
+    struct ktfs_icore* next; // next in-core inode of the mount
+    uint16_t inode_number; // inode this entry stands for
+    unsigned int opens; // open files of the inode
+    unsigned int npages; // cached pages of the inode
+    struct ktfs_cpage* buckets[KTFS_PCACHE_BUCKETS]; // cached pages hashed by page index
+};
+
+struct ktfs_discard_run {
+    uint32_t start; // first absolute block of the run of freed blocks
+    uint32_t count; // number of blocks in the run, 0 if empty
+};
+
+struct ktfs_zero_run {
+    uint32_t start; // first absolute block of the run of blocks to zero
+    uint32_t count; // number of blocks in the run, 0 if empty
 };
 
 struct ktfs_listing_uio {
@@ -78,6 +118,8 @@ void ktfs_close(struct uio* uio);
 int ktfs_cntl(struct uio* uio, int cmd, void* arg);
 long ktfs_fetch(struct uio* uio, void* buf, unsigned long len);
 long ktfs_store(struct uio* uio, const void* buf, unsigned long len);
+long ktfs_fetch_at(struct uio* uio, unsigned long long pos, void* buf, unsigned long len);
+long ktfs_store_at(struct uio* uio, unsigned long long pos, const void* buf, unsigned long len);
 int ktfs_create(struct filesystem* fs, const char* name);
 int ktfs_delete(struct filesystem* fs, const char* name);
 void ktfs_flush(struct filesystem* fs);
@@ -117,12 +159,49 @@ static int ktfs_map_block_and_or_allocate(struct ktfs_mount* mount, const struct
 
 static int ktfs_alloc_zero_block(struct ktfs_mount* m, const struct ktfs_superblock* sb, uint32_t* out_abs);
 
+static int ktfs_alloc_raw_block(struct ktfs_mount* m, const struct ktfs_superblock* sb, uint32_t* out_abs);
+
+static int ktfs_alloc_data_block(struct ktfs_mount* m, const struct ktfs_superblock* sb, int allocE, uint32_t* out_abs);
+
+static int ktfs_zero_blocks(struct ktfs_mount* m, uint32_t abs_blk, uint32_t count);
+
+static int ktfs_zero_run_add(struct ktfs_mount* m, struct ktfs_zero_run* run, uint32_t abs_blk);
+
+static int ktfs_zero_run_issue(struct ktfs_mount* m, struct ktfs_zero_run* run);
+
+static int ktfs_free_data_block(struct ktfs_mount* m, const struct ktfs_superblock* sb, struct ktfs_discard_run* run, uint32_t abs_blk);
+
+static void ktfs_discard_run_issue(struct ktfs_mount* m, struct ktfs_discard_run* run);
+
+static long ktfs_read_locked(struct ktfs_uio* kuio, uint64_t pos, void* buf, unsigned long len);
+
+static long ktfs_write_locked(struct ktfs_uio* kuio, uint64_t pos, const void* buf, unsigned long len, bool grow);
+
+int ktfs_getpage(struct uio* uio, unsigned long long pos, void** pagep);
+
+static struct ktfs_icore* ktfs_icore_get(struct ktfs_mount* mount, uint16_t inode_number);
+
+static void ktfs_icore_put(struct ktfs_mount* mount, struct ktfs_icore* ic);
+
+static int ktfs_pcache_get(struct ktfs_uio* kuio, const struct ktfs_superblock* sb, const struct ktfs_inode* ino, uint32_t index, void** pagep);
+
+static int ktfs_pcache_fill(struct ktfs_mount* m, const struct ktfs_superblock* sb, const struct ktfs_inode* ino, uint32_t index, void* page);
+
+static void ktfs_pcache_evict(struct ktfs_mount* m);
+
+static void ktfs_pcache_update(struct ktfs_uio* kuio, uint64_t pos, const void* buf, unsigned long len);
+
+static void ktfs_pcache_drop(struct ktfs_mount* m, uint16_t inode_number);
+
 
 static const struct uio_intf ktfs_uio_intf = {
     .close= ktfs_close,
     .read= ktfs_fetch,
     .write = ktfs_store,      
-    .cntl = ktfs_cntl
+    .cntl = ktfs_cntl,
+    .fetch = ktfs_fetch_at, // positional access for mmap
+    .store = ktfs_store_at,
+    .getpage = ktfs_getpage // mmap maps cached pages directly
 };
 
 static const struct uio_intf ktfs_listing_uio_intf = {
@@ -153,6 +232,7 @@ int mount_ktfs(const char* name, struct cache* cache) {
     }
 
     lock_init(&mount->mount_lock);  //aquire mount_lock
+    lock_init(&mount->pcache_lock); // page cache starts out empty
 
     
 
@@ -322,6 +402,12 @@ int ktfs_open(struct filesystem* fs, const char* name, struct uio** uioptr) {
     ku->file.offset = 0; // no offset initially
     ku->inode_number= file_inode; // store inode id
 
+    ku->icore = ktfs_icore_get(mount, file_inode); // share cached pages with other opens
+    if(!ku->icore){
+        kfree(ku);
+        return -ENOMEM;
+    }
+
     *uioptr = uio_init1(&ku->base, &ktfs_uio_intf); // initialize and return uio
     return 0; // success
 }
@@ -333,6 +419,8 @@ int ktfs_open(struct filesystem* fs, const char* name, struct uio** uioptr) {
  */
 void ktfs_close(struct uio* uio) {
     struct ktfs_uio* x = (struct ktfs_uio*)uio;
+    if(x->written) ktfs_flush(&x->file.fs->fs); // writes sat in the cache, one barrier makes them all durable
+    ktfs_icore_put(x->file.fs, x->icore); // cached pages outlive the open for the next reader
     kfree(x); // free the allocated memory for this uio structure
 }
 
@@ -351,78 +439,32 @@ long ktfs_fetch(struct uio* uio, void* buf, unsigned long len) {
 
     lock_acquire(&kuio->file_lock); //acquire file_lock
 
-    struct ktfs_mount* mount = kuio->file.fs; // cached mount (cache + fs hooks)
-    struct ktfs_file file = kuio->file; // snapshot of per-open file state
-    uint64_t size = file.size; // initial size (will refresh from inode below)
-    // uint64_t offset = file.offset; // offset not used yet; kept for spec
-    uint64_t pos = file.position; // current file position
-    
-    struct ktfs_superblock superb;
-    int ret = ktfs_read_super(mount, &superb); // read superblock via cache
-    if(ret<0){ 
-        lock_release(&kuio->file_lock); 
-        return ret; 
-    }  
-
-    struct ktfs_inode inode;
-    ret = ktfs_inode_grab(mount, kuio->inode_number,  &superb, &inode); // fetch latest inode
-    if(ret<0) { 
-        lock_release(&kuio->file_lock); 
-        return ret;
-    }
-
-    size = inode.size; // refresh size from on-disk inode
-    kuio->file.size = inode.size;
-    if(pos>=size){
-        lock_release(&kuio->file_lock); 
-        return 0;// at or past EOF 
-    }
-
-
-    uint64_t read_size = MIN((uint64_t)len, size - pos); //clamp to remaining bytes in file
-
-    // uint32_t inode_bitmap_start= 0;
-    // uint32_t block_bitmap_start=0;
-    // uint32_t inode_start=0;
-    // uint32_t data_start=0;
-    // ktfs_compute_layout(superb, &inode_bitmap_start, &block_bitmap_start, &inode_start, &data_start);
-    
-    uint64_t copied = 0; // running total
-    uint32_t absblk=0; // physical (absolute) block number on disk
-    while(copied<read_size){
-        uint64_t lbn= (copied+pos)/KTFS_BLKSZ; // logical block index within file
-        uint64_t within_block_off = (copied+pos) % KTFS_BLKSZ; // offset into that block
-        uint64_t width = MIN(read_size-copied, KTFS_BLKSZ - within_block_off); // bytes from this block
-        ret = ktfs_map_block(mount, &superb, &inode, (uint32_t)lbn, &absblk); // map LBN→disk block
-
-        if(ret == -ENOENT){//handle sparse hole by zero-fill
-            memset((uint8_t*)buf + copied, 0, (size_t)width); // fill hole with zeros
-            copied += width;
-            continue; // move on to next region
-        }
-
-        if(ret<0){ lock_release(&kuio->file_lock); return ret; } // real error from mapper
-        void*block = NULL;
-        ret = cache_get_block(mount->cache, (unsigned long long)absblk * KTFS_BLKSZ, &block); // pull block into cache
-        if(ret<0) { 
-            lock_release(&kuio->file_lock); 
-            return ret; 
-        }
-        memcpy((uint8_t*)buf + copied, (uint8_t*)block + within_block_off, (size_t)width); // copy slice out
-        cache_release_block(mount->cache, block, 0); // release (clean) cache line
-
-        copied+=width; // advance progress
-        
-
-    }
+    long ret = ktfs_read_locked(kuio, kuio->file.position, buf, len); // read at the cursor
+    if(ret > 0) kuio->file.position += ret; // advance file pointer for this handle
 
-    kuio->file.position+=copied; // advance file pointer for this handle
     lock_release(&kuio->file_lock); //release lock;
 
-    return (long )copied; // bytes read
+    return ret; // bytes read
+}
 
+/**
+ * @brief Reads data at a position without moving the file position (uio _fetch_, used by mmap)
+ * @param uio uio of file to be read
+ * @param pos Byte position in the file to read from
+ * @param buf Buffer to be filled
+ * @param len Number of bytes to read
+ * @return Number of bytes read if successful, negative error code if error
+ */
+long ktfs_fetch_at(struct uio* uio, unsigned long long pos, void* buf, unsigned long len) {
+    if(len == 0) return 0; // nothing to do
+    if(buf == NULL) return -EINVAL; // must have a buffer
+    struct ktfs_uio *kuio = (struct ktfs_uio *)uio;
 
-    
+    lock_acquire(&kuio->file_lock);
+    long ret = ktfs_read_locked(kuio, pos, buf, len); // cursor stays where it is
+    lock_release(&kuio->file_lock);
+
+    return ret;
 }
 
 /**
@@ -451,127 +493,86 @@ long ktfs_store(struct uio* uio, const void* buf, unsigned long len) {
     lock_acquire(&mount->mount_lock);
     lock_acquire(&kuio->file_lock); // locks
 
-    struct ktfs_superblock superb;
-    int ret = ktfs_read_super(mount, &superb); // read super to know layout and limits
-    if(ret < 0){
-        lock_release(&kuio->file_lock);
-        lock_release(&mount->mount_lock);
-
-        return ret;
-    }
-
-    struct ktfs_inode inode;
-    ret = ktfs_inode_grab(mount, kuio->inode_number, &superb, &inode); // fetch in-memory inode copy
-    if(ret < 0){
-        lock_release(&kuio->file_lock);
-        lock_release(&mount->mount_lock);
-        return ret;
-    }
-
-    uint64_t pos = kuio->file.position;
-    uint64_t size = inode.size; // snapshot file size before write
-
-    if(pos >= KTFS_MAX_FILE_SIZE) {
-        lock_release(&kuio->file_lock);
-        lock_release(&mount->mount_lock);
-        return -EINVAL; // refuse writes that start past the max file size
+    long ret = ktfs_write_locked(kuio, kuio->file.position, buf, len, true); // write at the cursor, growing the file
+    if(ret > 0){
+        kuio->file.position += ret; // final position after write
     }
 
-    uint64_t max_writable = KTFS_MAX_FILE_SIZE - pos; // remaining headroom to the cap
-    uint64_t size_of_write = (uint64_t)len;
-
-    if(size_of_write > max_writable) {
-        size_of_write = max_writable; // clamp request to allowed window
-    }
-
-    if(size_of_write == 0) {
-        lock_release(&kuio->file_lock);
-        lock_release(&mount->mount_lock);
-        // return -EINVAL;
-        return 0; // nothing to do after clamp
-    }
-
-    uint64_t write_end = pos + size_of_write; // exclusive end offset of this write
-
-    if(write_end > size) {
-        uint64_t old_size = size;
-        uint64_t olderBlks;
-        if(old_size == 0) {
-
-            olderBlks = 0; // no previously allocated data blocks
-        } 
-        else{
-
-
-            olderBlks = (old_size + KTFS_BLKSZ - 1) / KTFS_BLKSZ; // number of blocks currently covering size
-        }
-
-        uint64_t new_blocks = (write_end + KTFS_BLKSZ - 1) / KTFS_BLKSZ; // blocks needed after growth
-
-        for(uint32_t x = (uint32_t)olderBlks; x < (uint32_t)new_blocks; x++) {
-            uint32_t absblk_tmp = 0;
-            ret = ktfs_map_block_and_or_allocate(mount, &superb, &inode, x, &absblk_tmp, 1); // allocate and map new lbn
-
-            if(ret < 0){
-                lock_release(&kuio->file_lock);
-                lock_release(&mount->mount_lock);
+    lock_release(&kuio->file_lock);
+    lock_release(&mount->mount_lock); // end critical section
+    return ret; // number of bytes actually written
+}
 
-                return ret;
-            }
-        }
-    }
-    uint64_t fOffset = pos; // running file offset during copy
+/**
+ * @brief Writes data at a position without moving the file position or growing the file (uio
+ * _store_, used to write back dirty mmap pages)
+ * @param uio The file to be written to
+ * @param pos Byte position in the file to write at
+ * @param buf The buffer to be read from
+ * @param len Number of bytes to write, clamped to the end of the file
+ * @return Number of bytes written if successful, negative error code if error
+ */
+long ktfs_store_at(struct uio* uio, unsigned long long pos, const void* buf, unsigned long len) {
+    if(len == 0) return 0; // nothing to do
+    if(buf == NULL) return -EINVAL; // must have a buffer
 
-    while(fOffset < write_end){
-        uint32_t lbn = (uint32_t)(fOffset / KTFS_BLKSZ);
-        uint32_t off_in_block = (uint32_t)(fOffset % KTFS_BLKSZ); // in-block start
+    struct ktfs_uio* kuio = (struct ktfs_uio*)uio;
+    struct ktfs_mount* mount = kuio->file.fs;
 
-        uint64_t what_remains = write_end - fOffset;
-        uint32_t chunk = (uint32_t)MIN(what_remains, (uint64_t)(KTFS_BLKSZ - off_in_block)); // bytes to write this round
+    lock_acquire(&mount->mount_lock);
+    lock_acquire(&kuio->file_lock);
+    long ret = ktfs_write_locked(kuio, pos, buf, len, false); // cursor and size stay as they are
+    lock_release(&kuio->file_lock);
+    lock_release(&mount->mount_lock);
 
-        uint32_t absblk = 0;
-        ret = ktfs_map_block_and_or_allocate(mount, &superb, &inode, lbn, &absblk, 1); // ensure mapping for target block
-        if(ret < 0){
-            lock_release(&kuio->file_lock);
-            lock_release(&mount->mount_lock);
-            return ret;
-        }
+    return ret;
+}
 
-        void* blk = NULL;
-        ret = cache_get_block(mount->cache, (unsigned long long)absblk * KTFS_BLKSZ, &blk); // pin cache line for the block
-        if(ret < 0) {
-            lock_release(&kuio->file_lock);
-            lock_release(&mount->mount_lock);
-            return ret;
-        }
+/**
+ * @brief Hands out the page cache page that holds a page of the file (uio _getpage_, used by
+ * mmap to map cached pages instead of copying them)
+ * @param uio uio of the file
+ * @param pos Byte position of the page in the file, aligned to PAGE_SIZE
+ * @param pagep Set to the cached page, which carries a reference for the caller
+ * @return 0 if successful, negative error code if error
+ */
+int ktfs_getpage(struct uio* uio, unsigned long long pos, void** pagep) {
+    if(!uio || !pagep) return -EINVAL;
+    if(pos % PAGE_SIZE != 0) return -EINVAL; // whole pages only
 
-        memcpy((uint8_t*)blk + off_in_block, (const uint8_t*)buf + (fOffset - pos), chunk); // write payload into cache
-        cache_release_block(mount->cache, blk, 1); // set dirty to schedule writeback
+    struct ktfs_uio* kuio = (struct ktfs_uio*)uio;
+    struct ktfs_mount* mount = kuio->file.fs;
 
-        fOffset += chunk; // advance cursor
-    }
+    lock_acquire(&kuio->file_lock);
 
-    uint64_t new_end = fOffset;
-    if(new_end > size){
-        inode.size = (uint32_t)new_end; // grow logical file size
+    struct ktfs_superblock superb;
+    int ret = ktfs_read_super(mount, &superb);
+    if(ret < 0){
+        lock_release(&kuio->file_lock);
+        return ret;
     }
 
-    ret = ktfs_write_to_ino(mount, kuio->inode_number, &superb, &inode); // persist updated inode to disk
+    struct ktfs_inode inode;
+    ret = ktfs_inode_grab(mount, kuio->inode_number, &superb, &inode); // size decides what the page holds
     if(ret < 0){
         lock_release(&kuio->file_lock);
-        lock_release(&mount->mount_lock);
         return ret;
     }
 
-    kuio->file.size = inode.size; // refresh in-memory file metadata
-    kuio->file.position = new_end; // final position after write
+    if(pos >= inode.size){
+        lock_release(&kuio->file_lock);
+        return -EINVAL; // no file data in this page
+    }
+
+    lock_acquire(&mount->pcache_lock);
+    ret = ktfs_pcache_get(kuio, &superb, &inode, (uint32_t)(pos / PAGE_SIZE), pagep);
+    if(ret == 0) page_get(*pagep); // the caller's reference, the cache keeps its own
+    lock_release(&mount->pcache_lock);
 
     lock_release(&kuio->file_lock);
-    lock_release(&mount->mount_lock); // end critical section
-    return (long)(new_end - pos); // number of bytes actually written
+    return ret;
 }
 
-
 /**
  * @brief Create a new file in the file system
  * @param fs The file system in which to create the file
@@ -849,6 +850,8 @@ int ktfs_delete(struct filesystem* fs, const char* name) {
         return ret;
     } // release direct indirect and dindirect data
 
+    ktfs_pcache_drop(mount, (uint16_t)victim_ino); // the inode number may be handed out again
+
     ret = ktfs_write_to_ino(mount, victim_ino, &superb, &victim);
     if(ret < 0) {
         lock_release(&mount->mount_lock);
@@ -922,7 +925,7 @@ int ktfs_delete(struct filesystem* fs, const char* name) {
  * through arg.
  * @param uio the uio object of the file to perform the control function
  * @param cmd the operation to execute. KTFS should support FCNTL_GETEND, FCNTL_SETEND (CP2),
- * FCNTL_GETPOS, FCNTL_SETPOS.
+ * FCNTL_GETPOS, FCNTL_SETPOS and FCNTL_MSYNC (FCNTL_MMAP itself is handled by uio_cntl).
  * @param arg the argument to pass in, may be different for different control functions
  * @return 0 if successful, negative error code if error
  */
@@ -1002,9 +1005,12 @@ int ktfs_cntl(struct uio* uio, int cmd, void* arg) {
         uint64_t startingBlock = (old_size == 0) ? 0 : ((old_size + KTFS_BLKSZ - 1) / KTFS_BLKSZ); // first LBN to ensure
         uint64_t endingBlocks = (newend + KTFS_BLKSZ - 1) / KTFS_BLKSZ; // one past last LBN
 
+        struct ktfs_zero_run run = { 0, 0 }; // new blocks are zeroed in contiguous runs
+
         for(uint32_t x = (uint32_t)startingBlock; x < (uint32_t)endingBlocks; ++x) { // allocate/map blocks up to new EOF
             uint32_t absblk = 0;
-            ret = ktfs_map_block_and_or_allocate(mount, &superb, &inode, x, &absblk, 1);
+            ret = ktfs_map_block_and_or_allocate(mount, &superb, &inode, x, &absblk, KTFS_ALLOC_NOZERO);
+            if(ret == 0) ret = ktfs_zero_run_add(mount, &run, absblk);
             if(ret < 0) {
                 lock_release(&kuio->file_lock);
                 lock_release(&mount->mount_lock);
@@ -1012,6 +1018,13 @@ int ktfs_cntl(struct uio* uio, int cmd, void* arg) {
             }
         }
 
+        ret = ktfs_zero_run_issue(mount, &run); // last run of new blocks
+        if(ret < 0) {
+            lock_release(&kuio->file_lock);
+            lock_release(&mount->mount_lock);
+            return ret;
+        }
+
         inode.size = (uint32_t)newend; // commit new logical size
         ret = ktfs_write_to_ino(mount, kuio->inode_number, &superb, &inode); // persist inode
         if(ret < 0) {
@@ -1039,6 +1052,12 @@ int ktfs_cntl(struct uio* uio, int cmd, void* arg) {
     }
 
 
+    else if(cmd == FCNTL_MSYNC){ // mapped pages were written into the cache, make them durable
+        if(kuio->written) ktfs_flush(&kuio->file.fs->fs);
+        return 0;
+    }
+
+
     else if(cmd==FCNTL_SETPOS){
         if(!arg) return -EINVAL; // must supply a new position
         lock_acquire(&kuio->file_lock);
@@ -1058,7 +1077,7 @@ int ktfs_cntl(struct uio* uio, int cmd, void* arg) {
 }
 
 /**
- * @brief Flushes the cache to the backing device
+ * @brief Flushes the cache to the backing device, ending with a single device barrier
  * @return 0 if flush successful, negative error code if error
  */
 void ktfs_flush(struct filesystem* fs) {
@@ -1575,6 +1594,7 @@ static int ktfs_inode_free_all_blocks(struct ktfs_mount* mount, const struct ktf
     ktfs_compute_layout(superb, &scratch, &scratch, &inode_start, &data_start); // compute region offsets
 
     int ret = 0; // sticky error
+    struct ktfs_discard_run run = { 0, 0 }; // freed blocks are discarded in contiguous runs
     uint32_t entries_per_block = KTFS_BLKSZ / sizeof(uint32_t); // pointers per indirection block
     uint32_t total_blocks = 0; // blocks covering file size
     if(ino->size > 0) {
@@ -1585,7 +1605,7 @@ static int ktfs_inode_free_all_blocks(struct ktfs_mount* mount, const struct ktf
         if((uint32_t)i < total_blocks) {
             uint32_t blk = ino->block[i]; // data index
             uint32_t phys_block = data_start + blk; // absolute block
-            ret = ktfs_bitmap_unmark(mount, superb, 1, phys_block); // clear data bit
+            ret = ktfs_free_data_block(mount, superb, &run, phys_block); // clear data bit
             if(ret < 0) {
                 return ret; // propagate error
             }
@@ -1623,7 +1643,7 @@ static int ktfs_inode_free_all_blocks(struct ktfs_mount* mount, const struct ktf
             if(n < used_indirect_blocks) {
                 uint32_t b = ptr[n]; // data idx
                 uint32_t phys = data_start + b; // abs data block
-                int e = ktfs_bitmap_unmark(mount, superb, 1, phys); // free data block
+                int e = ktfs_free_data_block(mount, superb, &run, phys); // free data block
                 if((e < 0) && (ret == 0)) {
                     ret = e; // keep first error
                     return ret;
@@ -1640,7 +1660,7 @@ static int ktfs_inode_free_all_blocks(struct ktfs_mount* mount, const struct ktf
             return ret; // bail if data free failed
         }
 
-        rc = ktfs_bitmap_unmark(mount, superb, 1, indirect_block); // free L1 block
+        rc = ktfs_free_data_block(mount, superb, &run, indirect_block); // free L1 block
         if(rc < 0) {
             return rc;
         }
@@ -1700,7 +1720,7 @@ static int ktfs_inode_free_all_blocks(struct ktfs_mount* mount, const struct ktf
                 if((uint32_t)k < under_this) {
                     uint32_t data_idx = level2[k]; // data idx
                     uint32_t phys_block = data_start + data_idx; // abs data block
-                    int e2 = ktfs_bitmap_unmark(mount, superb, 1, phys_block); // free data block
+                    int e2 = ktfs_free_data_block(mount, superb, &run, phys_block); // free data block
                     if(e2 < 0 && ret == 0) {
                         ret = e2; // keep first error
                     }
@@ -1713,7 +1733,7 @@ static int ktfs_inode_free_all_blocks(struct ktfs_mount* mount, const struct ktf
 
             cache_release_block(mount->cache, iblock, 1); // write back cleared L2
 
-            int e3 = ktfs_bitmap_unmark(mount, superb, 1, ind_block); // free L2 block
+            int e3 = ktfs_free_data_block(mount, superb, &run, ind_block); // free L2 block
             if(e3 < 0 && ret == 0) {
                 ret = e3;
             }
@@ -1727,13 +1747,14 @@ static int ktfs_inode_free_all_blocks(struct ktfs_mount* mount, const struct ktf
             return ret; // bail on first recorded error
         }
 
-        int e4 = ktfs_bitmap_unmark(mount, superb, 1, double_ind_block_no); // free L1 (dind) block
+        int e4 = ktfs_free_data_block(mount, superb, &run, double_ind_block_no); // free L1 (dind) block
         if(e4 < 0) return e4;
 
         ino->dindirect[i] = 0; // clear dind pointer
         remaining_blocks -= blocks_here; 
     }
 
+    ktfs_discard_run_issue(mount, &run); // last run of freed blocks
     ino->size = 0; // file now empty
     return 0; // success
 }
@@ -1762,7 +1783,7 @@ static int ktfs_map_block_and_or_allocate(struct ktfs_mount* m, const struct ktf
         uint32_t idx = ino->block[lbn]; // data index from direct slot
         if(idx == 0) {
             uint32_t calc_abs_no = 0;
-            int rc = ktfs_alloc_zero_block(m, sb, &calc_abs_no); // allocate zeroed block
+            int rc = ktfs_alloc_data_block(m, sb, allocE, &calc_abs_no); // allocate data block
             if(rc < 0) return rc;
             ino->block[lbn] = calc_abs_no - data_start; // store relative index
             *absblk = calc_abs_no; // return absolute block
@@ -1791,7 +1812,7 @@ static int ktfs_map_block_and_or_allocate(struct ktfs_mount* m, const struct ktf
 
         if(idx == 0) {
             uint32_t calc_abs_no = 0;
-            rc = ktfs_alloc_zero_block(m, sb, &calc_abs_no); // alloc data block
+            rc = ktfs_alloc_data_block(m, sb, allocE, &calc_abs_no); // alloc data block
             if(rc < 0) { 
                 cache_release_block(m->cache, p, 0); 
                 return rc; 
@@ -1854,7 +1875,7 @@ static int ktfs_map_block_and_or_allocate(struct ktfs_mount* m, const struct ktf
 
         if(data_idx == 0){
             uint32_t calc_abs_no = 0;
-            rc = ktfs_alloc_zero_block(m, sb, &calc_abs_no); // allocate data block
+            rc = ktfs_alloc_data_block(m, sb, allocE, &calc_abs_no); // allocate data block
             if(rc < 0) { 
                 cache_release_block(m->cache, p2, 0); 
                 return rc; 
@@ -1876,6 +1897,18 @@ static int ktfs_map_block_and_or_allocate(struct ktfs_mount* m, const struct ktf
 
 
 static int ktfs_alloc_zero_block(struct ktfs_mount* m,const struct ktfs_superblock* sb, uint32_t* out_abs){
+    uint32_t calc_abs_no = 0; // candidate absolute block
+    int ret = ktfs_alloc_raw_block(m, sb, &calc_abs_no); // claim a free block
+    if(ret < 0) return ret; // propagate error
+
+    ret = ktfs_zero_blocks(m, calc_abs_no, 1); // one block, zeroed in the cache
+    if(ret < 0) return ret; // propagate error
+
+    *out_abs = calc_abs_no; // return absolute block number
+    return 0; // success
+}
+
+static int ktfs_alloc_raw_block(struct ktfs_mount* m, const struct ktfs_superblock* sb, uint32_t* out_abs){
     if(!m || !sb || !out_abs) return -EINVAL; 
     uint32_t calc_abs_no = 0; // candidate absolute block
     int ret = ktfs_bitmap_free_bit_detect(m, sb, 1, &calc_abs_no); // find a free data block bit
@@ -1884,11 +1917,483 @@ static int ktfs_alloc_zero_block(struct ktfs_mount* m,const struct ktfs_superblo
     ret = ktfs_bitmap_mark(m, sb, 1, calc_abs_no); // mark block as allocated
     if(ret < 0) return ret; // propagate error
 
-    void* block = NULL; // cache-mapped block
-    cache_get_block(m->cache, (unsigned long long)calc_abs_no * KTFS_BLKSZ, &block); // map the block
-    memset(block, 0, KTFS_BLKSZ); // zero-fill the new block
-    cache_release_block(m->cache, block, 1); // release and mark dirty
-
-    *out_abs = calc_abs_no; // return absolute block number
+    *out_abs = calc_abs_no; // contents are whatever the device holds
     return 0; // success
-}
\ No newline at end of file
+}
+
+static int ktfs_alloc_data_block(struct ktfs_mount* m, const struct ktfs_superblock* sb, int allocE, uint32_t* out_abs){
+    if(allocE == KTFS_ALLOC_NOZERO) // caller zeroes (or overwrites) it, batched with its neighbours
+        return ktfs_alloc_raw_block(m, sb, out_abs);
+    return ktfs_alloc_zero_block(m, sb, out_abs);
+}
+
+static int ktfs_zero_blocks(struct ktfs_mount* m, uint32_t abs_blk, uint32_t count){
+    if(count >= KTFS_ZERO_OFFLOAD_MIN) // long run: device zeroes it, no data sent and nothing cached
+        return cache_zero_range(m->cache, (unsigned long long)abs_blk * KTFS_BLKSZ, (unsigned long long)count * KTFS_BLKSZ);
+
+    for(uint32_t i = 0; i < count; i++){ // short run: a round-trip and a re-read would cost more than a memset
+        void* block = NULL; // cache-mapped block
+        int ret = cache_get_block(m->cache, (unsigned long long)(abs_blk + i) * KTFS_BLKSZ, &block); // map the block
+        if(ret < 0) return ret;
+        memset(block, 0, KTFS_BLKSZ); // zero-fill the new block
+        cache_release_block(m->cache, block, 1); // release and mark dirty
+    }
+
+    return 0;
+}
+
+static int ktfs_zero_run_add(struct ktfs_mount* m, struct ktfs_zero_run* run, uint32_t abs_blk){
+    if(run->count != 0 && abs_blk == run->start + run->count){ // extends the current run
+        run->count += 1;
+        return 0;
+    }
+
+    int ret = ktfs_zero_run_issue(m, run); // not contiguous, zero the old run first
+    if(ret < 0) return ret;
+    run->start = abs_blk;
+    run->count = 1;
+    return 0;
+}
+
+static int ktfs_zero_run_issue(struct ktfs_mount* m, struct ktfs_zero_run* run){
+    if(run->count == 0) return 0;
+
+    int ret = ktfs_zero_blocks(m, run->start, run->count); // long runs go to the device in one request
+    run->count = 0;
+    return ret;
+}
+
+static int ktfs_free_data_block(struct ktfs_mount* m, const struct ktfs_superblock* sb, struct ktfs_discard_run* run, uint32_t abs_blk){
+    int ret = ktfs_bitmap_unmark(m, sb, 1, abs_blk); // clear data bit
+    if(ret < 0) return ret;
+
+    if(run->count != 0 && abs_blk == run->start + run->count){ // extends the current run
+        run->count += 1;
+        return 0;
+    }
+
+    ktfs_discard_run_issue(m, run); // not contiguous, send the old run first
+    run->start = abs_blk;
+    run->count = 1;
+    return 0;
+}
+
+static void ktfs_discard_run_issue(struct ktfs_mount* m, struct ktfs_discard_run* run){
+    if(run->count == 0) return;
+
+    // the blocks are already free, a failed discard only costs space on the device
+    cache_discard_range(m->cache, (unsigned long long)run->start * KTFS_BLKSZ, (unsigned long long)run->count * KTFS_BLKSZ);
+    run->count = 0;
+}
+
+/**
+ * @brief Reads file data at a position. Caller holds the file lock.
+ * @param kuio File to read
+ * @param pos Byte position in the file to read from
+ * @param buf Buffer to be filled
+ * @param len Number of bytes to read
+ * @return Number of bytes read if successful, negative error code if error
+ */
+static long ktfs_read_locked(struct ktfs_uio* kuio, uint64_t pos, void* buf, unsigned long len) {
+    struct ktfs_mount* mount = kuio->file.fs; // cached mount (cache + fs hooks)
+    uint64_t size = kuio->file.size; // initial size (will refresh from inode below)
+    
+    struct ktfs_superblock superb;
+    int ret = ktfs_read_super(mount, &superb); // read superblock via cache
+    if(ret<0) return ret;
+
+    struct ktfs_inode inode;
+    ret = ktfs_inode_grab(mount, kuio->inode_number,  &superb, &inode); // fetch latest inode
+    if(ret<0) return ret;
+
+    size = inode.size; // refresh size from on-disk inode
+    kuio->file.size = inode.size;
+    if(pos>=size) return 0;// at or past EOF
+
+
+    uint64_t read_size = MIN((uint64_t)len, size - pos); //clamp to remaining bytes in file
+
+    uint64_t copied = 0; // running total
+    while(copied<read_size){
+        uint32_t index = (uint32_t)((copied+pos)/PAGE_SIZE); // page of the file
+        uint64_t within_page_off = (copied+pos) % PAGE_SIZE; // offset into that page
+        uint64_t width = MIN(read_size-copied, PAGE_SIZE - within_page_off); // bytes from this page
+
+        void* page = NULL;
+        lock_acquire(&mount->pcache_lock);
+        ret = ktfs_pcache_get(kuio, &superb, &inode, index, &page); // cached, or read in 8 blocks at once
+        if(ret<0){
+            lock_release(&mount->pcache_lock);
+            return ret;
+        }
+        page_get(page); // keep it while we copy, eviction may drop the cache's reference
+        lock_release(&mount->pcache_lock);
+
+        memcpy((uint8_t*)buf + copied, (uint8_t*)page + within_page_off, (size_t)width); // copy slice out
+        page_put(page);
+
+        copied+=width; // advance progress
+    }
+
+    return (long )copied; // bytes read
+}
+
+/**
+ * @brief Writes file data at a position. Caller holds the mount lock and the file lock.
+ * @param kuio The file to be written to
+ * @param pos Byte position in the file to write at
+ * @param buf The buffer to be read from
+ * @param len Number of bytes to write
+ * @param grow Whether the write may extend the file, otherwise it stops at the end of the file
+ * @return Number of bytes written if successful, negative error code if error
+ */
+static long ktfs_write_locked(struct ktfs_uio* kuio, uint64_t pos, const void* buf, unsigned long len, bool grow) {
+    struct ktfs_mount* mount = kuio->file.fs; // pull mount from file handle
+
+    struct ktfs_superblock superb;
+    int ret = ktfs_read_super(mount, &superb); // read super to know layout and limits
+    if(ret < 0){
+        return ret;
+    }
+
+    struct ktfs_inode inode;
+    ret = ktfs_inode_grab(mount, kuio->inode_number, &superb, &inode); // fetch in-memory inode copy
+    if(ret < 0){
+        return ret;
+    }
+
+    uint64_t size = inode.size; // snapshot file size before write
+
+    if(pos >= KTFS_MAX_FILE_SIZE) {
+        return -EINVAL; // refuse writes that start past the max file size
+    }
+
+    uint64_t max_writable = grow ? KTFS_MAX_FILE_SIZE - pos : (pos < size ? size - pos : 0); // headroom to the cap, or to EOF
+    uint64_t size_of_write = (uint64_t)len;
+
+    if(size_of_write > max_writable) {
+        size_of_write = max_writable; // clamp request to allowed window
+    }
+
+    if(size_of_write == 0) {
+        // return -EINVAL;
+        return 0; // nothing to do after clamp
+    }
+
+    uint64_t write_end = pos + size_of_write; // exclusive end offset of this write
+
+    if(write_end > size) {
+        uint64_t old_size = size;
+        uint64_t olderBlks;
+        if(old_size == 0) {
+
+            olderBlks = 0; // no previously allocated data blocks
+        } 
+        else{
+
+
+            olderBlks = (old_size + KTFS_BLKSZ - 1) / KTFS_BLKSZ; // number of blocks currently covering size
+        }
+
+        uint64_t new_blocks = (write_end + KTFS_BLKSZ - 1) / KTFS_BLKSZ; // blocks needed after growth
+
+        struct ktfs_zero_run run = { 0, 0 }; // new blocks are zeroed in contiguous runs
+
+        for(uint32_t x = (uint32_t)olderBlks; x < (uint32_t)new_blocks; x++) {
+            uint32_t absblk_tmp = 0;
+            ret = ktfs_map_block_and_or_allocate(mount, &superb, &inode, x, &absblk_tmp, KTFS_ALLOC_NOZERO); // allocate and map new lbn
+
+            if(ret < 0){
+
+                return ret;
+            }
+
+            uint64_t blk_start = (uint64_t)x * KTFS_BLKSZ;
+            if(blk_start >= pos && blk_start + KTFS_BLKSZ <= write_end) continue; // fully overwritten below
+
+            ret = ktfs_zero_run_add(mount, &run, absblk_tmp); // hole before pos, or partly written
+            if(ret < 0){
+                return ret;
+            }
+        }
+
+        ret = ktfs_zero_run_issue(mount, &run); // last run of new blocks
+        if(ret < 0){
+            return ret;
+        }
+    }
+    uint64_t fOffset = pos; // running file offset during copy
+
+    while(fOffset < write_end){
+        uint32_t lbn = (uint32_t)(fOffset / KTFS_BLKSZ);
+        uint32_t off_in_block = (uint32_t)(fOffset % KTFS_BLKSZ); // in-block start
+
+        uint64_t what_remains = write_end - fOffset;
+        uint32_t chunk = (uint32_t)MIN(what_remains, (uint64_t)(KTFS_BLKSZ - off_in_block)); // bytes to write this round
+
+        uint32_t absblk = 0;
+        ret = ktfs_map_block_and_or_allocate(mount, &superb, &inode, lbn, &absblk, 1); // ensure mapping for target block
+        if(ret < 0){
+            return ret;
+        }
+
+        void* blk = NULL;
+        ret = cache_get_block(mount->cache, (unsigned long long)absblk * KTFS_BLKSZ, &blk); // pin cache line for the block
+        if(ret < 0) {
+            return ret;
+        }
+
+        memcpy((uint8_t*)blk + off_in_block, (const uint8_t*)buf + (fOffset - pos), chunk); // write payload into cache
+        cache_release_block(mount->cache, blk, 1); // set dirty to schedule writeback
+        ktfs_pcache_update(kuio, fOffset, (const uint8_t*)buf + (fOffset - pos), chunk); // cached page sees it too
+
+        fOffset += chunk; // advance cursor
+    }
+
+    uint64_t new_end = fOffset;
+    if(new_end > size){
+        inode.size = (uint32_t)new_end; // grow logical file size
+    }
+
+    ret = ktfs_write_to_ino(mount, kuio->inode_number, &superb, &inode); // persist updated inode to disk
+    if(ret < 0){
+        return ret;
+    }
+
+    kuio->file.size = inode.size; // refresh in-memory file metadata
+    kuio->written = true; // flushed on close
+
+    return (long)(new_end - pos); // number of bytes actually written
+}
+
+/**
+ * @brief Finds the in-core inode of a file, creating it on first open, and counts one more open
+ * @param mount Mount the file belongs to
+ * @param inode_number Inode of the file
+ * @return In-core inode, or NULL if out of memory
+ */
+static struct ktfs_icore* ktfs_icore_get(struct ktfs_mount* mount, uint16_t inode_number) {
+    lock_acquire(&mount->pcache_lock);
+
+    struct ktfs_icore* ic = mount->icores;
+    while(ic && ic->inode_number != inode_number) ic = ic->next; // already in core?
+
+    if(!ic){
+        ic = kcalloc(1, sizeof(*ic)); // first open since its pages were dropped
+        if(!ic){
+            lock_release(&mount->pcache_lock);
+            return NULL;
+        }
+        ic->inode_number = inode_number;
+        ic->next = mount->icores;
+        mount->icores = ic;
+    }
+
+    ic->opens++;
+    lock_release(&mount->pcache_lock);
+    return ic;
+}
+
+/**
+ * @brief Counts one open less. An in-core inode without opens stays around as long as it has
+ * cached pages, so a file that is read or run again finds them.
+ * @param mount Mount the file belongs to
+ * @param ic In-core inode of the file
+ */
+static void ktfs_icore_put(struct ktfs_mount* mount, struct ktfs_icore* ic) {
+    lock_acquire(&mount->pcache_lock);
+
+    ic->opens--;
+    if(ic->opens == 0 && ic->npages == 0){ // nothing left worth keeping
+        struct ktfs_icore** link = &mount->icores;
+        while(*link != ic) link = &(*link)->next;
+        *link = ic->next;
+        kfree(ic);
+    }
+
+    lock_release(&mount->pcache_lock);
+}
+
+/**
+ * @brief Looks up a page of a file in the page cache, reading it in on a miss. Caller holds the
+ * page cache lock; the page stays valid only while it does, unless it takes a reference.
+ * @param kuio The file
+ * @param sb Superblock of the mount
+ * @param ino Current inode of the file
+ * @param index Page index within the file
+ * @param pagep Set to the cached page
+ * @return 0 if successful, negative error code if error
+ */
+static int ktfs_pcache_get(struct ktfs_uio* kuio, const struct ktfs_superblock* sb, const struct ktfs_inode* ino, uint32_t index, void** pagep) {
+    struct ktfs_mount* m = kuio->file.fs;
+    struct ktfs_icore* ic = kuio->icore;
+    struct ktfs_cpage** bucket = &ic->buckets[index % KTFS_PCACHE_BUCKETS];
+
+    for(struct ktfs_cpage* cp = *bucket; cp; cp = cp->next){ // hit
+        if(cp->index == index){
+            cp->access_time = ++m->pcache_timer;
+            *pagep = cp->page;
+            return 0;
+        }
+    }
+
+    struct ktfs_cpage* cp = kcalloc(1, sizeof(*cp));
+    if(!cp) return -ENOMEM;
+
+    if(m->pcache_pages >= KTFS_PCACHE_MAX) ktfs_pcache_evict(m); // make room first
+
+    cp->page = alloc_phys_page();
+    int ret = ktfs_pcache_fill(m, sb, ino, index, cp->page);
+    if(ret < 0){
+        page_put(cp->page);
+        kfree(cp);
+        return ret;
+    }
+
+    cp->index = index;
+    cp->access_time = ++m->pcache_timer;
+    cp->next = *bucket;
+    *bucket = cp;
+    ic->npages++;
+    m->pcache_pages++;
+
+    *pagep = cp->page;
+    return 0;
+}
+
+/**
+ * @brief Reads a page of a file. Blocks that are consecutive on disk are read with one request,
+ * so an unfragmented page takes a single read of KTFS_PAGE_BLKS blocks.
+ * @param m Mount the file belongs to
+ * @param sb Superblock of the mount
+ * @param ino Current inode of the file
+ * @param index Page index within the file
+ * @param page Page to fill, zeros past the end of the file
+ * @return 0 if successful, negative error code if error
+ */
+static int ktfs_pcache_fill(struct ktfs_mount* m, const struct ktfs_superblock* sb, const struct ktfs_inode* ino, uint32_t index, void* page) {
+    uint32_t first = index * KTFS_PAGE_BLKS; // first block of the page
+    uint32_t nblks = 0; // blocks of the page that hold file data
+
+    if((uint64_t)first * KTFS_BLKSZ < ino->size)
+        nblks = (uint32_t)MIN((uint64_t)KTFS_PAGE_BLKS, (ino->size + KTFS_BLKSZ - 1) / KTFS_BLKSZ - first);
+
+    memset((uint8_t*)page + nblks * KTFS_BLKSZ, 0, PAGE_SIZE - nblks * KTFS_BLKSZ); // past the end of the file
+
+    uint32_t i = 0;
+    while(i < nblks){
+        uint32_t start = 0;
+        int ret = ktfs_map_block(m, sb, ino, first + i, &start);
+        if(ret < 0) return ret;
+
+        uint32_t run = 1; // extend the run while the next block follows on disk
+        while(i + run < nblks){
+            uint32_t next = 0;
+            ret = ktfs_map_block(m, sb, ino, first + i + run, &next);
+            if(ret < 0) return ret;
+            if(next != start + run) break;
+            run++;
+        }
+
+        ret = cache_read_range(m->cache, (unsigned long long)start * KTFS_BLKSZ, (uint8_t*)page + i * KTFS_BLKSZ, run * KTFS_BLKSZ);
+        if(ret < 0) return ret;
+
+        i += run;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Drops the least recently used page of the page cache. Caller holds the page cache lock.
+ * Mappings of the page keep their own reference, so it is only freed once they are gone.
+ * @param m Mount whose page cache is full
+ */
+static void ktfs_pcache_evict(struct ktfs_mount* m) {
+    struct ktfs_cpage** victim = NULL;
+    struct ktfs_icore* victim_ic = NULL;
+
+    for(struct ktfs_icore* ic = m->icores; ic; ic = ic->next){
+        for(int b = 0; b < KTFS_PCACHE_BUCKETS; b++){
+            for(struct ktfs_cpage** link = &ic->buckets[b]; *link; link = &(*link)->next){
+                if(!victim || (*link)->access_time < (*victim)->access_time){ // pick least recently used
+                    victim = link;
+                    victim_ic = ic;
+                }
+            }
+        }
+    }
+
+    if(!victim) return;
+
+    struct ktfs_cpage* cp = *victim;
+    *victim = cp->next;
+    page_put(cp->page);
+    kfree(cp);
+    victim_ic->npages--;
+    m->pcache_pages--;
+
+    if(victim_ic->opens == 0 && victim_ic->npages == 0){ // closed file lost its last page
+        struct ktfs_icore** link = &m->icores;
+        while(*link != victim_ic) link = &(*link)->next;
+        *link = victim_ic->next;
+        kfree(victim_ic);
+    }
+}
+
+/**
+ * @brief Copies data just written to the block cache into the cached page that covers it, if
+ * any, so cached pages never go stale and are never dirty.
+ * @param kuio The file that was written
+ * @param pos Byte position of the data in the file
+ * @param buf The data
+ * @param len Number of bytes, within a single page
+ */
+static void ktfs_pcache_update(struct ktfs_uio* kuio, uint64_t pos, const void* buf, unsigned long len) {
+    struct ktfs_mount* m = kuio->file.fs;
+    uint32_t index = (uint32_t)(pos / PAGE_SIZE);
+
+    lock_acquire(&m->pcache_lock);
+
+    for(struct ktfs_cpage* cp = kuio->icore->buckets[index % KTFS_PCACHE_BUCKETS]; cp; cp = cp->next){
+        if(cp->index == index){
+            memcpy((uint8_t*)cp->page + pos % PAGE_SIZE, buf, len);
+            break;
+        }
+    }
+
+    lock_release(&m->pcache_lock);
+}
+
+/**
+ * @brief Drops all cached pages of a deleted file. Pages still mapped by a process stay with it.
+ * @param m Mount the file belonged to
+ * @param inode_number Inode of the file
+ */
+static void ktfs_pcache_drop(struct ktfs_mount* m, uint16_t inode_number) {
+    lock_acquire(&m->pcache_lock);
+
+    struct ktfs_icore** link = &m->icores;
+    while(*link && (*link)->inode_number != inode_number) link = &(*link)->next;
+
+    struct ktfs_icore* ic = *link;
+    if(ic){
+        for(int b = 0; b < KTFS_PCACHE_BUCKETS; b++){
+            while(ic->buckets[b]){
+                struct ktfs_cpage* cp = ic->buckets[b];
+                ic->buckets[b] = cp->next;
+                page_put(cp->page);
+                kfree(cp);
+                m->pcache_pages--;
+            }
+        }
+        ic->npages = 0;
+
+        if(ic->opens == 0){
+            *link = ic->next;
+            kfree(ic);
+        }
+    }
+
+    lock_release(&m->pcache_lock);
+}
@@ -3,9 +3,13 @@
  *  @copyright Copyright (c) 2024-2025 University of Illinois
  */
 
+#include "blkq.h"
 #include "cache.h"
 #include "conf.h"
 #include "console.h"
+#include "dev/nullblk.h"
+#include "dev/raid.h"
+#include "dev/ramdisk.h"
 #include "dev/rtc.h"
 #include "dev/uart.h"
 #include "dev/virtio.h"
@@ -25,8 +29,14 @@
 #define INITEXE   "shell"  // initial user program
 #define CMNTNAME  "c"
 #define DEVMNTNAME "dev"
+
+#ifndef CDEVNAME  // "ramdisk" mounts the blob linked into the kernel, in RAM
 #define CDEVNAME  "vioblk"
+#endif
+
+#ifndef CDEVINST
 #define CDEVINST  0
+#endif
 
 #ifndef NUART  // number of UARTs
 #define NUART 2
@@ -36,7 +46,32 @@
 #define NVIODEV 8
 #endif
 
+// Build with -DRAID_LEVEL=RAID_STRIPE (or RAID_MIRROR) -DCDEVNAME=\"raid\" to put
+// the C drive on all vioblk devices at once
+
+#ifndef RAID_CHUNK  // stripe unit in bytes
+#define RAID_CHUNK 4096
+#endif
+
+#ifndef RAID_NDEV  // most vioblk devices combined
+#define RAID_NDEV 4
+#endif
+
+// Build with -DNULLBLK_SIZE=<bytes> to also register nullblk0, a device with no media for
+// measuring the cost of the block stack itself. By default it starts out with the linked-in
+// KTFS image and keeps what is stored, so -DCDEVNAME=\"nullblk\" mounts the C drive on it;
+// -DNULLBLK_FLAGS=NULLBLK_F_PATTERN drops stores instead, for the raw, blkq and cache paths.
+
+#ifndef NULLBLK_LATENCY_US  // synthetic latency of every nullblk request
+#define NULLBLK_LATENCY_US 0
+#endif
+
+#ifndef NULLBLK_FLAGS  // NULLBLK_F_* flags
+#define NULLBLK_FLAGS (NULLBLK_F_IMAGE | NULLBLK_F_ZERO)
+#endif
+
 static void attach_devices(void);
+static void attach_raid(void);
 static void mount_cdrive(void);  // mount primary storage device ("C drive")
 static void run_init(void);
 
@@ -76,6 +111,15 @@ void attach_devices(void)
         attach_virtio((void *)VIRTIO_MMIO_BASE(i), VIRTIO0_INTR_SRCNO + i);
     }
 
+    ramdisk_attach();  // only if a blob was linked in
+    attach_raid();
+
+#ifdef NULLBLK_SIZE
+    result = nullblk_attach(NULLBLK_SIZE, NULLBLK_LATENCY_US, NULLBLK_FLAGS);
+    if (result < 0)
+        kprintf("nullblk_attach failed: %s\n", error_name(result));
+#endif
+
     result = mount_devfs(DEVMNTNAME);
     if (result != 0) {
         kprintf("mount_devfs(%s) failed: %s\n", CDEVNAME, error_name(result));
@@ -83,9 +127,28 @@ void attach_devices(void)
     }
 }
 
+void attach_raid(void)
+{
+#ifdef RAID_LEVEL
+    struct storage *members[RAID_NDEV];
+    int n;
+    int result;
+
+    for (n = 0; n < RAID_NDEV; n++) {
+        members[n] = find_storage("vioblk", n);
+        if (members[n] == NULL) break;
+    }
+
+    result = raid_attach(RAID_LEVEL, members, n, RAID_CHUNK);
+    if (result < 0)
+        kprintf("raid_attach over %d vioblk devices failed: %s\n", n, error_name(result));
+#endif
+}
+
 void mount_cdrive(void)
 {
     struct storage *hd;
+    struct blkq    *queue;
     struct cache   *cache;
     int             result;
 
@@ -102,7 +165,14 @@ void mount_cdrive(void)
         halt_failure();
     }
 
-    result = create_cache(hd, &cache);
+    result = create_blkq(hd, &queue);
+    if (result != 0) {
+        kprintf("create_blkq(%s%d) failed: %s\n",
+                CDEVNAME, CDEVINST, error_name(result));
+        halt_failure();
+    }
+
+    result = create_cache(blkq_storage(queue), &cache);
     if (result != 0) {
         kprintf("create_cache(%s%d) failed: %s\n",
                 CDEVNAME, CDEVINST, error_name(result));
@@ -22,11 +22,13 @@
 #include "console.h"
 #include "error.h"
 #include "heap.h"
+#include "intr.h"
 #include "misc.h"
 #include "process.h"
 #include "riscv.h"
 #include "string.h"
 #include "thread.h"
+#include "uio.h"
 
 // COMPILE-TIME CONFIGURATION
 //
@@ -46,6 +48,11 @@
 #define PTE_ORDER 3
 #define PTE_CNT (1U << (PAGE_ORDER - PTE_ORDER))
 
+// Size in bytes and in 4K pages of a leaf at page table level lvl
+
+#define LEVEL_SIZE(lvl) (PAGE_SIZE << ((lvl) * (PAGE_ORDER - PTE_ORDER)))
+#define LEVEL_PAGES(lvl) (1UL << ((lvl) * (PAGE_ORDER - PTE_ORDER)))
+
 #ifndef PAGING_MODE
 #define PAGING_MODE RISCV_SATP_MODE_Sv39
 #endif
@@ -54,6 +61,34 @@
 #define ROOT_LEVEL 2
 #endif
 
+// Largest buddy block is 2^PAGE_MAX_ORDER pages
+
+#ifndef PAGE_MAX_ORDER
+#define PAGE_MAX_ORDER 16
+#endif
+
+#define RAM_PAGE_CNT (RAM_SIZE >> PAGE_ORDER)
+
+// Past this many pages, one flush of the whole address space is cheaper than flushing each page
+
+#ifndef TLB_BATCH_MAX
+#define TLB_BATCH_MAX 16
+#endif
+
+// Zeroed pages kept ready for alloc_zeroed_page(), refilled by memory_idle()
+
+#ifndef ZERO_POOL_MAX
+#define ZERO_POOL_MAX 64
+#endif
+
+// The kernel identity-maps all of RAM with global leaves, so RAM must end where user
+// memory begins. (RAM_SIZE has a cast in it, so conf.h can not check this with #if.)
+
+_Static_assert(RAM_END_PMA <= UMEM_START_VMA, "RAM overlaps the user memory range");
+
+#define ASID_MASK ((1UL << RISCV_SATP_ASID_nbits) - 1)
+#define MTAG_ASID(mtag) (((mtag) >> RISCV_SATP_ASID_shift) & ASID_MASK)
+
 // IMPORTED GLOBAL SYMBOLS
 //
 
@@ -67,6 +102,11 @@ extern char _kimg_data_start[];
 extern char _kimg_data_end[];
 extern char _kimg_end[];
 
+// user access routines with fault recovery (ucopy.s)
+extern long _ucopy(void *dst, const void *src, size_t n);
+extern long _ucopystr(char *dst, const char *src, size_t n);
+extern long _uprobe(const void *addr, int write);
+
 // EXPORTED GLOBAL VARIABLES
 //
 
@@ -75,19 +115,36 @@ char memory_initialized = 0;
 // INTERNAL TYPE DEFINITIONS
 //
 
-// We keep free physical pages in a linked list of _chunks_, where each chunk
-// consists of several consecutive pages of memory. Initially, all free pages
-// are in a single large chunk. To allocate a block of pages, we break up the
-// smallest chunk on the list.
+// We keep free physical pages with a binary buddy allocator. A free block of
+// order k is 2^k pages whose page number (counted from RAM_START) is a multiple
+// of 2^k. Its buddy is the other half of the order k+1 block containing it, and
+// the two are merged back whenever both are free.
 
 /**
- * @brief Section of consecutive physical pages. We keep free physical pages in a
- * linked list of chunks. Initially, all free pages are in a single large chunk. To
- * allocate a block of pages, we break up the smallest chunk in the list
+ * @brief Free block of 2^k consecutive physical pages. The list node lives in the
+ * first page of the block itself, one doubly linked list per order.
  */
-struct page_chunk {
-    struct page_chunk *next;  ///< Next page in list
-    unsigned long pagecnt;    ///< Number of pages in chunk
+struct free_block {
+    struct free_block *next;  ///< Next free block of the same order
+    struct free_block *prev;  ///< Previous free block of the same order
+};
+
+/**
+ * @brief Page parked on the zeroed pool or the dead page-table list. The link lives in
+ * the first word of the page itself and is cleared when the page is handed out.
+ */
+struct page_link {
+    struct page_link *next;  ///< Next parked page
+};
+
+/**
+ * @brief Pages of the active memory space whose translation changed and still need a fence
+ */
+struct tlb_batch {
+    uintptr_t vma[TLB_BATCH_MAX];  ///< Changed pages
+    unsigned int cnt;              ///< Number of changed pages, may exceed TLB_BATCH_MAX
+    int global;                    ///< A global mapping changed
+    int pruned;                    ///< A page table was freed, cached non-leaf entries must go too
 };
 
 /**
@@ -117,31 +174,49 @@ struct pte {
 #define PTE_GLOBAL(pte) (((pte).flags & PTE_G) != 0)
 #define PTE_LEAF(pte) (((pte).flags & (PTE_R | PTE_W | PTE_X)) != 0)
 
+// Copy-on-write: bit 0 of the RSW field marks a leaf that is logically writable but whose
+// page is shared with another memory space, so W stays clear until the first store.
+
+#define PTE_RSW_COW 0x1
+#define PTE_COW(pte) (((pte).rsw & PTE_RSW_COW) != 0)
+
 #define PT_INDEX(lvl, vpn) \
     (((vpn) & (0x1FF << (lvl * (PAGE_ORDER - PTE_ORDER)))) >> (lvl * (PAGE_ORDER - PTE_ORDER)))
 // INTERNAL FUNCTION DECLARATIONS
 //
 
-static void ptab_reset(struct pte *ptab  // page table to reset
+static void ptab_reset(struct pte *ptab,  // page table to reset
+                       int level          // level of ptab in the tree
 );
 
-static struct pte *ptab_clone(struct pte *ptab  // page table to clone
+static struct pte *ptab_clone(struct pte *ptab,  // page table to clone
+                              int level          // level of ptab in the tree
 );
 
-static void ptab_discard(struct pte *ptab  // page table to discard
+static void ptab_discard(struct pte *ptab,  // page table to discard
+                         int level          // level of ptab in the tree
 );
 
 static void ptab_insert(struct pte *ptab,   // page table to modify
                         unsigned long vpn,  // virtual page number to insert
                         void *pp,           // pointer to physical page to insert
-                        int rwxug_flags     // flags for inserted mapping
+                        int rwxug_flags,    // flags for inserted mapping
+                        int level           // level of the leaf (0 for 4K, 1 for 2M, 2 for 1G)
 );
 
-static void *ptab_remove(struct pte *ptab, unsigned long vpn);
+static void *ptab_remove(struct pte *ptab, unsigned long vpn, int level, int *pruned);
 
 static void ptab_adjust(struct pte *ptab, unsigned long vpn, int rwxug_flags);
 
 struct pte *ptab_fetch(struct pte *ptab, unsigned long vpn);
+static struct pte *ptab_fetch_level(struct pte *ptab, unsigned long vpn, int *level);
+static struct pte *ptab_fetch_page(struct pte *ptab, unsigned long vpn);
+static struct pte *ptab_split(struct pte *pte, int level);
+static void leaf_get(const struct pte *leaf, int level);
+static void leaf_put(const struct pte *leaf, int level);
+static struct pte *ptab_alloc(void);
+static void ptab_free(struct pte *ptab);
+static int zero_pool_drain(void);
 
 static inline mtag_t active_space_mtag(void);
 static inline mtag_t ptab_to_mtag(struct pte *root, unsigned int asid);
@@ -151,11 +226,31 @@ static inline struct pte *active_space_ptab(void);
 static inline void *pageptr(uintptr_t n);
 static inline uintptr_t pagenum(const void *p);
 static inline int wellformed(uintptr_t vma);
+static inline int user_range(const void *vp, size_t len);
 
 static inline struct pte leaf_pte(const void *pp, uint_fast8_t rwxug_flags);
 static inline struct pte ptab_pte(const struct pte *pt, uint_fast8_t g_flag);
 static inline struct pte null_pte(void);
 
+static void pte_cow_break(struct pte *pte);
+
+static void page_frame_mark_user(const void *pp);
+static unsigned int mspace_asid(struct pte *root);
+static void flush_active_mspace(void);
+static void tlb_flush_page(uintptr_t vma, int global);
+static void tlb_batch_add(struct tlb_batch *batch, uintptr_t vma, int global);
+static void tlb_batch_flush(struct tlb_batch *batch);
+static inline uintptr_t page_index(const void *pp);
+static inline void *page_addr(uintptr_t idx);
+static void free_list_push(uintptr_t idx, unsigned int order);
+static void free_list_remove(uintptr_t idx, unsigned int order);
+static int page_in_free_block(uintptr_t idx);
+
+static struct mregion *mregion_find(uintptr_t vma);
+static int mregion_populate(uintptr_t vma);
+static int mregion_store_ok(uintptr_t vma);
+static struct pte *demand_fetch(struct pte *ptab, uintptr_t vma);
+
 // INTERNAL GLOBAL VARIABLES
 //
 
@@ -169,12 +264,36 @@ static struct pte main_pt1_0x80000[PTE_CNT]
 static struct pte main_pt0_0x80000[PTE_CNT]
     __attribute__((section(".bss.pagetable"), aligned(4096)));
 
-static struct page_chunk *free_chunk_list;
+// Free lists of the buddy allocator, one per order, and the number of free pages on all of them
+//
+static struct free_block *free_lists[PAGE_MAX_ORDER + 1];
+static unsigned long free_page_total;
 
 // Global variable for the start of the free region in the chunk
 //
 static void * free_base_addr;
 
+// Frame database, one struct page per page of RAM, indexed by page_index()
+//
+static struct page * page_frames;
+
+// ASIDs are handed out in generations: every memory space gets the next free ASID of the
+// current generation, and when they run out the TLB is flushed once and a new generation
+// starts. ASID 0 belongs to the main memory space. asid_max is 0 if the hart has no ASIDs.
+//
+static unsigned long asid_max;
+static unsigned long asid_next = 1;
+static uint16_t asid_generation = 1;
+
+// Pages that must start out zero (page tables, anonymous and stack pages) come from a pool
+// the idle thread zeroes ahead of time. Torn-down page tables go on the dead list as they
+// are; the idle thread zeroes them onto the pool (or frees them once the pool is full) and
+// tops the pool up from free memory.
+//
+static struct page_link *zero_pool;
+static unsigned int zero_pool_cnt;
+static struct page_link *ptab_dead;
+
 // EXPORTED FUNCTION DECLARATIONS
 //
 
@@ -215,7 +334,8 @@ void memory_init(void) {
     //         0 to RAM_START:           RW gigapages (MMIO region)
     // RAM_START to _kimg_end:           RX/R/RW pages based on kernel image
     // _kimg_end to RAM_START+MEGA_SIZE: RW pages (heap and free page pool)
-    // RAM_START+MEGA_SIZE to RAM_END:   RW megapages (free page pool)
+    // RAM_START+MEGA_SIZE to RAM_END:   RW megapages (free page pool) in the
+    //                                   first gigarange, RW gigapages past it
     //
     // RAM_START = 0x80000000
     // MEGA_SIZE = 2 MB
@@ -248,7 +368,9 @@ void memory_init(void) {
         main_pt0_0x80000[VPN0((uintptr_t)pp)] = leaf_pte(pp, PTE_R | PTE_W | PTE_G);
     }
 
-    // Remaining RAM mapped in 2MB megapages
+    // Remaining RAM mapped in 2MB megapages. RAM ends below UMEM_START_VMA (checked at
+    // compile time above), so it all lies in the third gigarange and nothing global is
+    // ever mapped into the user range.
 
     for (pp = RAM_START + MEGA_SIZE; pp < RAM_END; pp += MEGA_SIZE) {
         main_pt1_0x80000[VPN1((uintptr_t)pp)] = leaf_pte(pp, PTE_R | PTE_W | PTE_G);
@@ -259,6 +381,12 @@ void memory_init(void) {
     main_mtag = ptab_to_mtag(main_pt2, 0);
     csrw_satp(main_mtag);
 
+    // Find out how many ASID bits the hart implements by writing all ones and reading back
+    csrw_satp(main_mtag | (ASID_MASK << RISCV_SATP_ASID_shift));
+    asid_max = MTAG_ASID(csrr_satp());
+    csrw_satp(main_mtag);
+    sfence_vma();
+
     // Give the memory between the end of the kernel image and the next page
     // boundary to the heap allocator, but make sure it is at least
     // HEAP_INIT_MIN bytes.
@@ -292,39 +420,26 @@ void memory_init(void) {
     // The free unused RAM ends at the end of the RAM given to us already
     void * free_end = RAM_END;
 
-    // Create the conditional statement that checks that there is free space to use
-    if(free_end > free_start){
-
-        // Compute how many pages fit in the free space
-        // Compute byte count first
-        unsigned long bytecnt = ((uintptr_t) free_end - (uintptr_t) free_start);
-
-        // Divide the number of bytes by the page size
-        // Do this right shifting by the page order which is 12 as there are 2^12 bytes in a page
-        unsigned long pagecnt = bytecnt >> PAGE_ORDER;
+    // Carve the frame database out of the front of the free space, one entry per RAM page
+    page_frames = (struct page *) free_start;
+    memset(page_frames, 0, RAM_PAGE_CNT * sizeof(struct page));
+    free_start = (void *) ROUND_UP((uintptr_t) (page_frames + RAM_PAGE_CNT), PAGE_SIZE);
 
-        // Place the first chunk struct at free_start instead of on the heap
-        struct page_chunk * chunk_node = (struct page_chunk *) free_start;
+    // Remeber the physical starting base address of the pool, nothing below it is ever freed
+    free_base_addr = free_start;
 
-        // If properly initialized, record how many pages this chunk represents
-        chunk_node->pagecnt = pagecnt;
+    // Everything below the pool (kernel image, initial heap, the database itself) is in use for good
+    for(uintptr_t idx = 0; idx < page_index(free_start); ++idx){
 
-        // This is the only chunk initially so set the next to null
-        chunk_node->next = NULL;
-
-        // Remeber the physical starting base address of thsi chunk so that can reference where this specific chunk starts
-        free_base_addr = free_start;
-
-        // Make this chunk nod the head of the free list as this is the only chunk so far
-        free_chunk_list = chunk_node;
-        
+        page_frames[idx].refcnt = 1;
+        page_frames[idx].flags = PAGE_F_RESERVED;
     }
 
-    // Condition where there is no free space and free_start > free_end
-    else{
+    // Create the conditional statement that checks that there is free space to use
+    // Hand the whole pool to the buddy allocator, which splits it into the largest aligned blocks
+    if(free_end > free_start){
 
-        // Start with an empty list
-        free_chunk_list = NULL;
+        free_phys_pages(free_start, ((uintptr_t) free_end - (uintptr_t) free_start) >> PAGE_ORDER);
     }
 
     // Allow supervisor to access user memory. We could be more precise by only
@@ -341,9 +456,19 @@ mtag_t active_mspace(void) { return active_space_mtag(); }
 
 mtag_t switch_mspace(mtag_t mtag) {
     mtag_t prev;
+    struct pte * root = mtag_to_ptab(mtag);
+    unsigned int asid = (root == main_pt2) ? 0 : mspace_asid(root);
+
+    // The ASID in the tag may be from an older generation, use the current one
+    prev = csrrw_satp(ptab_to_mtag(root, asid));
+
+    // The main memory space (and every space when there are no ASIDs) shares ASID 0, so its
+    // translations may belong to whoever used it last. Other spaces keep their own TLB entries.
+    if(asid == 0){
+
+        sfence_vma();
+    }
 
-    prev = csrrw_satp(mtag);
-    sfence_vma();
     return prev;
 }
 
@@ -355,10 +480,13 @@ mtag_t clone_active_mspace(void) {
     struct pte * curr_root_table = active_space_ptab();
 
     // Now use the clone helper
-    struct pte * new_root_table = ptab_clone(curr_root_table);
+    struct pte * new_root_table = ptab_clone(curr_root_table, ROOT_LEVEL);
+
+    // The clone write-protected the pages it now shares, so drop the stale writable translations
+    flush_active_mspace();
 
-    // Not using multiple ASIDs so pass 0 through and takes the phys addr of the new root table and returns the mtag version of it
-    return ptab_to_mtag(new_root_table, 0);
+    // Give the new memory space its own ASID and return the tag of the new root table
+    return ptab_to_mtag(new_root_table, mspace_asid(new_root_table));
 }
 
 // Unmaps and frees all non-global pages from the active memory space.
@@ -369,10 +497,10 @@ void reset_active_mspace(void) {
     struct pte * root_table = active_space_ptab();
 
     // Use the helper to clear, unmap and free the non-global pages
-    ptab_reset(root_table);
+    ptab_reset(root_table, ROOT_LEVEL);
 
-    // Use the given sfence_vma to flush the TLB to get rid odd of old entries in the hardware
-    sfence_vma();
+    // Flush the old entries of this memory space
+    flush_active_mspace();
 }
 
 // Switches memory spaces to main, unmaps and frees all non-global pages from the previously active memory space.
@@ -390,7 +518,7 @@ mtag_t discard_active_mspace(void) {
     if(root_table != main_pt2){
 
         // Use the helper
-        ptab_discard(root_table);
+        ptab_discard(root_table, ROOT_LEVEL);
     }
 
     // Now swictch to the main page table as we deleted the root one
@@ -408,10 +536,13 @@ mtag_t discard_active_mspace(void) {
 // pages into the active address space. Note that map_page() is a special case
 // of map_range(), so it can be implemented by calling map_range(). Or
 // map_range() can be implemented by calling map_page() for each page in the
-// range. The current implementation does the latter.
+// range. The current implementation walks the range one leaf at a time.
 
-// We currently map 4K pages only. At some point it may be disirable to support
-// mapping megapages and gigapages.
+// map_range() uses a 2M megapage or 1G gigapage leaf wherever the virtual and
+// physical addresses are both aligned to it and the rest of the range covers it.
+// Every leaf holds one reference on each 4K frame it maps, so large leaves can
+// be split back into pages (to unmap, protect or copy-on-write part of them)
+// without changing any counts.
 
 void *map_page(uintptr_t vma, void *pp, int rwxug_flags) {
     // FIXME
@@ -445,7 +576,10 @@ void *map_page(uintptr_t vma, void *pp, int rwxug_flags) {
 
     // Now use the ptab_insert helper whicb actualy inserts the mapping
     // This helper does all the page table walking
-    ptab_insert(root_table, vpn, pp, rwxug_flags);
+    ptab_insert(root_table, vpn, pp, rwxug_flags, 0);
+
+    // Fence just this page so no old or invalid translation of it stays cached
+    tlb_flush_page(vma, rwxug_flags & PTE_G);
 
     // Return the virtual address just mapped
     return (void *) vma;
@@ -493,8 +627,12 @@ void *map_range(uintptr_t vma, size_t size, void *pp, int rwxug_flags) {
     // ceiling of a/b is (a + b - 1)/b and >> 12 divides by page size
     size_t num_pages = (size + PAGE_SIZE - 1) >> PAGE_ORDER;
 
-    // Now we walk tbrough each page to map the PTE
-    for(size_t i = 0; i < num_pages; ++i){
+    // Root table of the active space and the pages whose translation we change
+    struct pte * root_table = active_space_ptab();
+    struct tlb_batch batch = {};
+
+    // Now we walk tbrough the range to map the PTEs, one leaf at a time
+    for(size_t i = 0; i < num_pages; ){
 
         // Find the vma for each page
         uintptr_t page_vma = vma + (i << PAGE_ORDER);
@@ -502,10 +640,33 @@ void *map_range(uintptr_t vma, size_t size, void *pp, int rwxug_flags) {
         // Same thing but this time find the pp for each page
         void * page_pp = (void *)((uintptr_t)pp + (i << PAGE_ORDER));
 
-        // Now map each page using the map_page function
-        map_page(page_vma, page_pp, rwxug_flags);
+        // Pick the largest leaf both addresses are aligned to that still fits in what is left
+        int level = ROOT_LEVEL;
+
+        while(level > 0 && ((page_vma | (uintptr_t) page_pp) & (LEVEL_SIZE(level) - 1) ||
+                            num_pages - i < LEVEL_PAGES(level))){
+
+            --level;
+        }
+
+        // A large leaf may replace a whole subtable of small ones that one page fence would miss,
+        // so count it as a full batch and the fence at the end covers the whole space
+        if(level > 0){
+
+            batch.cnt = TLB_BATCH_MAX;
+        }
+
+        // Now map the leaf, remembering it for the fence at the end
+        ptab_insert(root_table, VPN(page_vma), page_pp, rwxug_flags, level);
+        tlb_batch_add(&batch, page_vma, rwxug_flags & PTE_G);
+
+        // Move past everything the leaf covers
+        i += LEVEL_PAGES(level);
     }
 
+    // One fence pass for the whole range
+    tlb_batch_flush(&batch);
+
     // Return the starting vma of the mapped region
     return (void *) vma;
 }
@@ -611,16 +772,39 @@ void set_range_flags(const void *vp, size_t size, int rwxug_flags) {
     // We also need to get the root table of the address space as we did for map page
     struct pte * root_table = active_space_ptab();
 
-    // Now we walk tbrough each page to adjust the flags
-    for(size_t i = 0; i < num_pages; ++i){
+    // Pages whose translation we change
+    struct tlb_batch batch = {};
+
+    // Now we walk tbrough each leaf to adjust the flags
+    for(size_t i = 0; i < num_pages; ){
 
-        // Advance the vpn by exactly one at each setp so that when used by the adjust, its adjusting the correct flags
+        // Advance the vpn past each leaf so that when used by the adjust, its adjusting the correct flags
         unsigned long vpn = starting_vpn + i;
 
+        // The old translation may have been global even if the new one is not
+        int level = 0;
+        struct pte * pte = ptab_fetch_level(root_table, vpn, &level);
+        int global = (rwxug_flags & PTE_G) || (pte != NULL && PTE_GLOBAL(* pte));
+
+        // A large leaf that sticks out of the range is split until the part inside can change on its own
+        while(pte != NULL && level > 0 &&
+              ((vpn & (LEVEL_PAGES(level) - 1)) != 0 || num_pages - i < LEVEL_PAGES(level))){
+
+            ptab_split(pte, level);
+            pte = ptab_fetch_level(root_table, vpn, &level);
+        }
+
         // Now use the helper function ptab_adjust to do the heavy work for us as we implement it
         ptab_adjust(root_table, vpn, rwxug_flags);
+        tlb_batch_add(&batch, vpn << PAGE_ORDER, global);
+
+        // Move past everything the leaf covers, or just the page if nothing is mapped
+        i += (pte != NULL) ? LEVEL_PAGES(level) : 1;
     }
 
+    // One fence pass for the whole range
+    tlb_batch_flush(&batch);
+
 }
 
 // Unmaps a range of pages starting at provided virtual memory address and frees the pages. 
@@ -677,23 +861,289 @@ void unmap_and_free_range(void *vp, size_t size) {
     // We also need to get the root table of the address space as we did for map page
     struct pte * root_table = active_space_ptab();
 
+    // Pages whose translation we remove
+    struct tlb_batch batch = {};
+
     // Now we crate the loop, which will loop through each region and then remove the mapping
     // After removing the mapping, it will call free phys page to free from memory
-    for(size_t i = 0; i < num_pages; ++i){
+    // The kernel does not touch these addresses before the fence below, so the pages can go right away
+    for(size_t i = 0; i < num_pages; ){
 
-        // Advance the vpn by exactly one at each setp so that when used by the adjust, its adjusting the correct flags
+        // Advance the vpn past each leaf so that when used by the remove, its removing the correct mapping
         unsigned long vpn = starting_vpn + i;
 
-        // To actually remove the mapping, call the ptab_remove helper that unmaps the page
+        // Remember the page for the fence, global if the mapping being removed is
+        int level = 0;
+        struct pte * pte = ptab_fetch_level(root_table, vpn, &level);
+        tlb_batch_add(&batch, vpn << PAGE_ORDER, pte != NULL && PTE_GLOBAL(* pte));
+
+        // A large leaf goes in one piece if the range covers all of it, otherwise it is split
+        // and only the page at vpn is removed
+        if(pte == NULL || (vpn & (LEVEL_PAGES(level) - 1)) != 0 || num_pages - i < LEVEL_PAGES(level)){
+
+            level = 0;
+        }
+
+        // To actually remove the mapping, call the ptab_remove helper that unmaps the leaf
         // The ptab_remove function returns the physical pointer that was mapped there
-        void * pp = ptab_remove(root_table, vpn);
+        void * pp = ptab_remove(root_table, vpn, level, &batch.pruned);
 
-        // Now free the pages using free phys pages using pp
+        // Now drop our reference to every page of the leaf, which frees them unless another memory space shares them
         // This only occurs if pp is not NUll
         if(pp != NULL){
 
-            free_phys_page(pp);
+            struct pte old = leaf_pte(pp, 0);
+
+            leaf_put(&old, level);
+        }
+
+        // Move past everything the leaf covered
+        i += LEVEL_PAGES(level);
+    }
+
+    // One fence pass for the whole range
+    tlb_batch_flush(&batch);
+}
+
+// Declares a range of the current process as valid without backing it with pages yet
+// The page fault handler allocates, zeroes and maps each page on the first access
+int add_lazy_range(uintptr_t vma, size_t size, int rwxug_flags) {
+
+    // The region list hangs off the process, so there has to be one
+    struct process * proc = current_process();
+
+    // Nothing to do for an empty range
+    if(size == 0){
+
+        return 0;
+    }
+
+    // Same alignment and wellformed checks as the mapping functions
+    if((vma & (PAGE_SIZE - 1)) != 0 || !wellformed(vma) || !wellformed(vma + size - 1)){
+
+        return -EINVAL;
+    }
+
+    // Make sure the range does not wrap around
+    if(vma + size < vma){
+
+        return -EINVAL;
+    }
+
+    // Without a process nobody would ever look at the region
+    if(proc == NULL){
+
+        return -EINVAL;
+    }
+
+    // A range that continues an existing one with the same flags just extends it
+    // This keeps the list short for a heap that grows a little at a time
+    for(struct mregion * rgn = proc->mregions; rgn != NULL; rgn = rgn->next){
+
+        if(rgn->end == vma && rgn->rwxug_flags == rwxug_flags && rgn->uio == NULL){
+
+            rgn->end = vma + ROUND_UP(size, PAGE_SIZE);
+            return 0;
+        }
+    }
+
+    // Allocate the region descriptor on the kernel heap
+    struct mregion * rgn = kmalloc(sizeof(struct mregion));
+
+    // Check that the allocation worked
+    if(rgn == NULL){
+
+        return -ENOMEM;
+    }
+
+    // Fill in the range, rounding the end up to a whole page
+    rgn->start = vma;
+    rgn->end = vma + ROUND_UP(size, PAGE_SIZE);
+    rgn->rwxug_flags = rwxug_flags;
+
+    // Anonymous memory, nothing backs it
+    rgn->uio = NULL;
+    rgn->uio_len = 0;
+
+    // Push it on the front of the process's list
+    rgn->next = proc->mregions;
+    proc->mregions = rgn;
+
+    // Success
+    return 0;
+}
+
+// Maps an endpoint into the current process above every mapping it already has
+// The pages are read in by the page fault handler when first touched
+int map_uio_range(struct uio * uio, unsigned long long len, int rwxug_flags, void ** vpp) {
+
+    // The region list hangs off the process, so there has to be one
+    struct process * proc = current_process();
+
+    // Without a process nobody would ever look at the region, and there must be something to map
+    if(proc == NULL || len == 0){
+
+        return -EINVAL;
+    }
+
+    // Mappings are never removed, so the next one goes right after the highest one in the window
+    uintptr_t vma = UMMAP_START_VMA;
+
+    for(struct mregion * rgn = proc->mregions; rgn != NULL; rgn = rgn->next){
+
+        if(rgn->start >= UMMAP_START_VMA && rgn->start < UMMAP_END_VMA && rgn->end > vma){
+
+            vma = rgn->end;
+        }
+    }
+
+    // Make sure the whole endpoint fits in what is left of the window
+    if(len > UMMAP_END_VMA - vma){
+
+        return -ENOMEM;
+    }
+
+    // Allocate the region descriptor on the kernel heap
+    struct mregion * rgn = kmalloc(sizeof(struct mregion));
+
+    // Check that the allocation worked
+    if(rgn == NULL){
+
+        return -ENOMEM;
+    }
+
+    // Fill in the range, rounding the end up to a whole page
+    rgn->start = vma;
+    rgn->end = vma + ROUND_UP(len, PAGE_SIZE);
+    rgn->rwxug_flags = rwxug_flags;
+
+    // The mapping keeps the endpoint open until the process lets go of it
+    rgn->uio = uio;
+    rgn->uio_len = len;
+    uio_addref(uio);
+
+    // Push it on the front of the process's list
+    rgn->next = proc->mregions;
+    proc->mregions = rgn;
+
+    // Hand back where the endpoint is mapped
+    * vpp = (void *) vma;
+    return 0;
+}
+
+// Writes the dirty pages of mappings in list back and write-protects them again
+// Pages that were never touched or only read are skipped
+int sync_mregions(const struct mregion * list, const struct uio * uio) {
+
+    // Root table of the active space and the pages whose translation we change
+    struct pte * root_table = active_space_ptab();
+    struct tlb_batch batch = {};
+
+    // First error seen, the remaining pages are still written
+    int result = 0;
+
+    for(const struct mregion * rgn = list; rgn != NULL; rgn = rgn->next){
+
+        // Anonymous memory has nowhere to go, and other endpoints were not asked for
+        if(rgn->uio == NULL || (uio != NULL && rgn->uio != uio)){
+
+            continue;
+        }
+
+        // Walk the pages of the mapping that hold endpoint bytes
+        for(unsigned long long off = 0; off < rgn->uio_len; off += PAGE_SIZE){
+
+            // Look up the page, stores made it writable
+            struct pte * pte = ptab_fetch(root_table, VPN(rgn->start + off));
+
+            // Never touched or still clean
+            if(pte == NULL || !PTE_LEAF(* pte) || !(pte->flags & PTE_W)){
+
+                continue;
+            }
+
+            // Write the page back, stopping at the end of the endpoint
+            long cnt = uio_store(rgn->uio, off, pageptr(pte->ppn), MIN(PAGE_SIZE, rgn->uio_len - off));
+
+            // Keep it dirty if the write failed so a later sync tries again
+            if(cnt < 0){
+
+                if(result == 0){
+
+                    result = (int) cnt;
+                }
+
+                continue;
+            }
+
+            // Clean again, the next store marks it dirty
+            pte->flags &= ~PTE_W;
+            tlb_batch_add(&batch, rgn->start + off, 0);
+        }
+    }
+
+    // One fence pass for all pages made read-only
+    tlb_batch_flush(&batch);
+
+    return result;
+}
+
+// Copies a region list for a forked child
+// Either the whole list is copied or nothing is
+int clone_mregions(const struct mregion * list, struct mregion ** out) {
+
+    // Head of the new list and the link to fill in next, which keeps the original order
+    struct mregion * head = NULL;
+    struct mregion ** link = &head;
+
+    // Copy every region of the original list
+    for(const struct mregion * rgn = list; rgn != NULL; rgn = rgn->next){
+
+        // Allocate the copy
+        struct mregion * copy = kmalloc(sizeof(struct mregion));
+
+        // Out of memory, undo what was copied so far
+        if(copy == NULL){
+
+            free_mregions(head);
+            return -ENOMEM;
+        }
+
+        // Same range and flags, appended at the end of the new list
+        * copy = * rgn;
+        copy->next = NULL;
+
+        // The child's mapping holds its own reference to the endpoint
+        if(copy->uio != NULL){
+
+            uio_addref(copy->uio);
+        }
+
+        * link = copy;
+        link = &copy->next;
+    }
+
+    // Hand back the new list
+    * out = head;
+    return 0;
+}
+
+// Frees every region of a region list
+void free_mregions(struct mregion * list) {
+
+    // Walk the list, saving the next pointer before freeing each region
+    while(list != NULL){
+
+        struct mregion * next = list->next;
+
+        // Let go of a mapped endpoint, closing it if this was the last reference
+        if(list->uio != NULL){
+
+            uio_close(list->uio);
         }
+
+        kfree(list);
+        list = next;
     }
 }
 
@@ -757,7 +1207,8 @@ int validate_vptr(const void *vp, size_t len, int rwxu_flags) {
     for(unsigned long i = vpn_start; i <= vpn_end; ++i){
 
         // Use the ptab_adjust to find the pte slot fot the VPN
-        struct pte * pte = ptab_fetch(root_table, i);
+        // Pages of a lazy range that were never touched get faulted in here
+        struct pte * pte = demand_fetch(root_table, i << PAGE_ORDER);
 
         // Check if its unmapped,  if it is the range is not correct or safe, so reject by returning -EACCESS
         if(pte == NULL){
@@ -777,6 +1228,17 @@ int validate_vptr(const void *vp, size_t len, int rwxu_flags) {
             return -EACCESS;
         }
 
+        // The kernel is about to store into a page that is still shared copy-on-write
+        // Give this memory space its own copy now, since a store from S mode would not be resolved
+        // The same goes for a clean page of a writable memory mapping, which becomes dirty
+        if((rwxu_flags & PTE_W) && (PTE_COW(* pte) ||
+           (!(pte->flags & PTE_W) && mregion_store_ok(i << PAGE_ORDER)))){
+
+            pte = ptab_fetch_page(root_table, i);
+            pte_cow_break(pte);
+            tlb_flush_page(i << PAGE_ORDER, 0);
+        }
+
         // Last check would be to check all the flags are present
         // Compare the PTE's flags with rwxu_flags and if anything differs, reject
         // Do this by masking the ptes flags and mask them withbt he caller ones and checking for different bits
@@ -836,11 +1298,9 @@ int validate_vstr(const char *vs, int rug_flags) {
         }
 
         // Similar process from the vptr validation
-        // Translate the address into the VPN using the macro
-        unsigned long vpn = VPN(addr);
-
         // Use the ptab_adjust to find the pte slot fot the VPN
-        struct pte * pte = ptab_fetch(root_table, vpn);
+        // Pages of a lazy range that were never touched get faulted in here
+        struct pte * pte = demand_fetch(root_table, addr);
 
         // Same process for the vstr function compared to vptr, only difference is caller flags
         // Check if its unmapped,  if it is the range is not correct or safe, so reject by returning -EACCESS
@@ -886,182 +1346,225 @@ int validate_vstr(const char *vs, int rug_flags) {
     return 0;
 }
 
-// Allocates a single new page using alloc_phys_pages().
-void *alloc_phys_page(void) {
-    // FIXME
+// Copies n bytes from user memory at usrc to kernel memory at kdst
+// The page table is not walked: the copy routine recovers from faults through the fixup table
+int copyin(void *kdst, const void *usrc, size_t n) {
 
-    // One line of code, just use the alloc_phys_pages and have count be 1
-    return alloc_phys_pages(1);
-}
+    // The whole source range has to lie in user space, the routine itself can reach kernel memory too
+    if(!user_range(usrc, n)){
 
-void free_phys_page(void *pp) {
-    // FIXME
-    
-    // One line of code, just use the free_phys_pages and have count be 1
-    free_phys_pages(pp, 1);
+        return -EACCESS;
+    }
+
+    return _ucopy(kdst, usrc, n);
 }
 
-// Allocates the passed number of physical pages from the free chunk list
-// Finds smallest chunk that fits the requested number of pages. 
-// If chunk exactly matches the number of pages requested, 
-// removes chunk from free chunk list, otherwise breaks off the component 
-// of chunk that matches requested number of pages. 
-// Panics if no chunk can be found that satisfies the request.
-void *alloc_phys_pages(unsigned int cnt) {
-    // FIXME
+// Copies n bytes from kernel memory at ksrc to user memory at udst
+int copyout(void *udst, const void *ksrc, size_t n) {
 
-    // Define 4 variables pointing to the struct page_chunk
-    // -> curr, prev, best, and best_prev
-    // curr and prev are iteration pointers when traversing the free chunk list
-    // best and best_prev are initialized to track the best chunk to fit the given cnt
-    // Result will hold the pointer to the allocated pages
-    struct page_chunk * curr;
-    struct page_chunk * prev;
-    struct page_chunk * best;
-    struct page_chunk * best_prev;
-    void * result;
+    // Same check as copyin, for the destination this time
+    if(!user_range(udst, n)){
 
-    // We dont need base_addr and pages_before as we know each struct page_chunk lives at the physical start address of the free chunk it describes
+        return -EACCESS;
+    }
 
-    // Define a variable to holld the computed base address of the chunk that is the best fit for the pages
-    // uintptr_t base_addr;
+    return _ucopy(udst, ksrc, n);
+}
 
-    // pages_before holds the number of free pages in all chunks befre best to compute the bae address
-    // unsigned long pages_before;
+// Copies the user string at usrc into the n byte kernel buffer kdst, one pass instead of a
+// walk followed by a copy
+long copyinstr(char *kdst, const char *usrc, size_t n) {
 
-    // Check if cnt is 0, if it is then return NULL as there are no pages to allocate
-    if(cnt == 0){
+    // Need room for at least the terminator
+    if(n == 0){
 
-        return NULL;
+        return -EINVAL;
     }
-    
-    // Check that the chunk list actually has chunks to allocate pages for
-    // Check that there is a chunk to allocate. If the list is NULL, panic as there are no free chunks
-    if(free_chunk_list == NULL){
 
-        panic("alloc_phys_pages: no free chunks available -> free_chunk_list ==  NULL");
+    // The string has to start in user space, -EINVAL is kept for a string that does not fit
+    if(!user_range(usrc, 1)){
+
+        return -EACCESS;
     }
 
-    // Documnetation says that we need to find the smallest chunk that fits the requested number of pages
-    // So we need to walk the list from the had and find the smallest chunk in general for now
-    // Set prev to null and the curr to the head of the list to walk the list
-    prev = NULL;
-    curr = free_chunk_list;
+    // Do not let the copy run past the end of user space
+    size_t room = MIN(n, (size_t)(UMEM_END_VMA - (uintptr_t)usrc));
 
-    // Inititalize boht best and best_prev
-    best = NULL;
-    best_prev = NULL;
+    long ret = _ucopystr(kdst, usrc, room);
 
-    // Create a while loop condition for curr to see if there are nodes still left
-    while(curr != NULL){
+    // Cut off by the end of user space rather than by the buffer, the string is not all there
+    if(ret == -EINVAL && room < n){
 
-        // Only look through chunks that have a page count large enough to the support the cnt given in the parameter
-        if(curr->pagecnt >= cnt){
+        return -EACCESS;
+    }
 
-            // Now check if the current node is the best fit for the count and the chunks available
-            // best == NULL checks if this is the first iteration and curr->pagecnt < best->pagecnt compares for the best fit
-            if(best == NULL || curr->pagecnt < best->pagecnt){
+    return ret;
+}
 
-                // If this condition passes through, then curr is a better fit as it is smaller
-                best = curr;
-                
-                // Set the best_prev to prev to remeber the previous node of best
-                best_prev = prev;
-            }
-        }
+// Touches one byte of every page in the range so that the kernel can then access it directly
+// The pages are faulted in (or copied, for a store to a copy-on-write page) as a user access would
+int probe_vptr(const void *vp, size_t len, int rwxu_flags) {
 
-        // Now advance to check the next node in the list, set prev to the curr and curr to the curr next
-        prev = curr;
-        curr = curr->next;
+    // Empty range, nothing to touch
+    if(len == 0){
 
+        return 0;
     }
-    
-    // After the loop, check and make sure best holds a node that would fit. If not, then panic
-    if(best == NULL){
 
-        panic("alloc_phys_pages: not enough pages for cnt");
+    // The range has to lie in user space
+    if(!user_range(vp, len)){
+
+        return -EACCESS;
     }
 
-    // This is where the code changes, we dont need the pages_before or the starting addr
-    // We are going to compute the addresses based urely on the chunk pointer
-    // So start with the chunk struct addr, beginning of the chunk in bytes
-    uintptr_t start = (uintptr_t) best;
+    uintptr_t addr = (uintptr_t) vp;
+    uintptr_t end = addr + len;
 
-    // Compute how many bytes are in the chunk
-    // best->pagecnt is the number of pages and then left shifted byt PAGE_ORDER is the same as multiplyiny by PAGE_SIZE
-    uintptr_t chunk_bytes = ((uintptr_t) best->pagecnt << PAGE_ORDER);
+    // One probe per page, the first one at the start of the range
+    while(addr < end){
 
-    // Now we need to compute how many bytes to allocate
-    // cnt is the number of pages requested and leftshifted basically multiplying by 12
-    uintptr_t alloc_bytes = ((uintptr_t) cnt << PAGE_ORDER);
+        if(_uprobe((const void *) addr, rwxu_flags & PTE_W) != 0){
 
-    // Make sure the chunk is big enough for the bytes needed for allocation
-    assert(chunk_bytes >= alloc_bytes);
+            return -EACCESS;
+        }
 
-    // Now handle the case where chunks page count exacltly fits the requested page count
-    if(best->pagecnt == cnt){
+        addr = ROUND_DOWN(addr, PAGE_SIZE) + PAGE_SIZE;
+    }
 
-        // result would hold the chunks start address as the allocation starts at start
-        result = (void *) start;
+    return 0;
+}
 
-        // Now we should remove the chunk fromm the free list
-        if(best_prev == NULL){
+// Allocates a single new page using alloc_phys_pages().
+void *alloc_phys_page(void) {
+    // FIXME
 
-            // If best_prev was null, that means that the best was the head
-            // So the header of the free list should be the next
-            free_chunk_list = best->next;
-        }
+    // One line of code, just use the alloc_phys_pages and have count be 1
+    return alloc_phys_pages(1);
+}
 
-        // Otherwise, we just have to skip over
-        else{
+void free_phys_page(void *pp) {
+    // FIXME
+    
+    // One line of code, just use the free_phys_pages and have count be 1
+    free_phys_pages(pp, 1);
+}
 
-            // Just skipping over
-            best_prev->next = best->next;
-        }
+// Allocates a single page filled with zeros. Takes one the idle thread already zeroed when
+// the pool has one, so the memset is off the critical path, and zeroes a new page otherwise.
+void *alloc_zeroed_page(void) {
 
-    }
+    // Pop the first zeroed page, the idle thread may be pushing onto the pool at the same time
+    long pie = disable_interrupts();
+    struct page_link * link = zero_pool;
 
-    // We do not use kfree as I did before as we need to free it all logically
-    // Now we need to take care of the partial allocation case
-    // The free region for this chunk is start to start + chunk_bytes and we need to update it with alloc_bytes
-    // Allocate from the end of the chunk
-    else{
+    if(link != NULL){
+
+        zero_pool = link->next;
+        --zero_pool_cnt;
+    }
 
-        // Store the starting address of the allocated end regiom
-        uintptr_t result_addr = start + (chunk_bytes - alloc_bytes);
+    restore_interrupts(pie);
 
-        // Set the result to the result_addr
-        result = (void *) result_addr;
+    // The pool ran dry, allocate and zero the page here
+    if(link == NULL){
 
-        // Now update the pagecnt as it now represnets a smaller chunk
-        best->pagecnt -= cnt;
+        void * pp = alloc_phys_page();
+        memset(pp, 0, PAGE_SIZE);
+        return pp;
     }
 
-    // Now return the void pointer that holds the starting address of the allocated block
-    return result;
+    // A pooled page is zero except for the link in its first word
+    link->next = NULL;
+
+    // It may have been a page table before, start its frame over like alloc_phys_page() does
+    * page_frame(link) = (struct page){ .refcnt = 1 };
 
-    // Deleted the old code, used base_addr which caused overlap
+    return link;
 }
 
-// Adds chunk consisting of passed count of pages at passed pointer back to free chunk list.
-// Parameters
-// -> pp	Physical address of memory region to add back to free chunk list
-// -> cnt	Number of pages being freed
-void free_phys_pages(void *pp, unsigned int cnt) {
-    // FIXME
+// Allocates the passed number of physical pages with the buddy allocator
+// Takes the smallest free block of at least cnt pages, splitting larger blocks as needed,
+// and gives back the pages past cnt so nothing is wasted.
+// Panics if no block can be found that satisfies the request.
+void *alloc_phys_pages(unsigned int cnt) {
+
+    // Check if cnt is 0, if it is then return NULL as there are no pages to allocate
+    if(cnt == 0){
+
+        return NULL;
+    }
+
+    // Smallest order whose blocks hold cnt pages
+    unsigned int order = 0;
+
+    while((1UL << order) < cnt){
+
+        ++order;
+    }
 
-    // We are going to need to traverse the list so a similar setup to alloc without best
-    // Inititalize prev to be NULL as we are going to set curr to be the head of the list
-    struct page_chunk * prev = NULL;
+    // Larger than any block the allocator keeps
+    if(order > PAGE_MAX_ORDER){
 
-    // Set curr to be the head
-    struct page_chunk * curr = free_chunk_list;
+        panic("alloc_phys_pages: request larger than the largest block");
+    }
+
+    // Find the smallest order at or above the one we want that has a free block
+    unsigned int k = order;
 
-    // Create a new chunk pointer that will hold the newly freed region, not the actual data, basically just a label to it
-    // struct page_chunk * new_chunk;
+    while(k <= PAGE_MAX_ORDER && free_lists[k] == NULL){
+
+        ++k;
+    }
 
-    // Track the number of pages before curr just as alloc
-    // unsigned long pages_before = 0;
+    // Nothing big enough is free
+    if(k > PAGE_MAX_ORDER){
+
+        // Parked pages are only a cache, give them back and try again
+        if(zero_pool_drain() != 0){
+
+            return alloc_phys_pages(cnt);
+        }
+
+        panic("alloc_phys_pages: out of physical memory");
+    }
+
+    // Take the block off its list
+    uintptr_t idx = page_index(free_lists[k]);
+    free_list_remove(idx, k);
+
+    // Split it down to the order we want, putting the upper half back each time
+    while(k > order){
+
+        --k;
+        free_list_push(idx + (1UL << k), k);
+    }
+
+    // The block may be larger than cnt, give back the tail so it is not wasted
+    // Those pages count as free again, so only the ones we keep come off the total
+    free_page_total -= 1UL << order;
+
+    if((1UL << order) > cnt){
+
+        free_phys_pages(page_addr(idx + cnt), (1U << order) - cnt);
+    }
+
+    // Each page we keep starts with one reference, held by the caller
+    for(uintptr_t i = idx; i < idx + cnt; ++i){
+
+        page_frames[i] = (struct page){ .refcnt = 1 };
+    }
+
+    // Return the address of the first page of the block
+    return page_addr(idx);
+}
+
+// Returns a range of pages to the buddy allocator
+// The range is cut into the largest aligned blocks it holds, and each block is merged with
+// its buddy for as long as the buddy is free too.
+// Parameters
+// -> pp	Physical address of memory region to free
+// -> cnt	Number of pages being freed
+void free_phys_pages(void *pp, unsigned int cnt) {
 
     // Chefck that there cnt is not 0 or that the address is not NULL to make sure there are pages to free
     if(cnt == 0 || pp == NULL){
@@ -1074,120 +1577,142 @@ void free_phys_pages(void *pp, unsigned int cnt) {
     uintptr_t start_addr = (uintptr_t) pp;
 
     // Make sure that the start addr is page aligned
-    // In order for it to be page aligined, it must start exactly on a page boundary, lower 12 bits must always be 0
-    // So create a bitmask for just those 12 bits
-    // Then AND the actual 12 bits with thsi bitmask of just 1s and if they do not come out as 0, then you know one of those bits is not 0
-    // This means its unaligned
     assert((start_addr & ((uintptr_t) PAGE_SIZE - 1)) == 0);
 
     // Verify that the address being freed is not below the start of the memory
     assert(start_addr >= (uintptr_t) free_base_addr);
 
-    // Compute the end address of the freed region
-    // Connvert the pages into bytes as we did above
-    uintptr_t end_addr = start_addr + ((uintptr_t) cnt << PAGE_ORDER);
-
     // Verify that the freed region is at or beloe the boundary for the end of the RAM memory
-    assert(end_addr <= (uintptr_t) RAM_END);
+    assert(start_addr + ((uintptr_t) cnt << PAGE_ORDER) <= (uintptr_t) RAM_END);
+
+    // Page number of the first page, counted from RAM_START
+    uintptr_t idx = page_index(pp);
 
-    // Find the page index as we are going to be switching from byte address
-    // Do this as the allocator granulity is pages and we will need to free exacr numbers of pages, not bytes
-    // So find the starting page index by subtracting tha start to the base to get it in bbytes before righ shifting by 12
-    //unsigned long free_start_pg_idx = (start_addr - (uintptr_t) free_base_addr) >> PAGE_ORDER;
+    // Check every page before touching any frame: a page that is already free or still
+    // shared means a double free, and clearing its frame would corrupt the free lists
+    for(uintptr_t i = idx; i < idx + cnt; ++i){
 
-    // Now find the end index by adding the paramter cnt to the start
-    //unsigned long free_end_pg_idx = free_start_pg_idx + cnt;
+        if(page_frames[i].refcnt > 1 || page_in_free_block(i)){
 
-    // FIX: we do need the indicies as we know where the chunk starts
+            panic("free_phys_pages: overlapping pages");
+        }
+    }
+
+    // Count the pages as free once, up front, and clear their frame entries
+    free_page_total += cnt;
 
-    // Now we need to traverse the list until we find the rigt spot in the list to insert this newly freed region
-    // Walk the list which is sorted by the start address to find the new interval
-    while(curr != NULL){
+    for(uintptr_t i = idx; i < idx + cnt; ++i){
 
-        // Start with the address of the struct page_chunk and store it in curr_start
-        uintptr_t curr_start = (uintptr_t) curr;
+        page_frames[i] = (struct page){};
+    }
 
-        // Now also find the end by adding the size of the bytes
-        uintptr_t curr_end = curr_start + ((uintptr_t) curr->pagecnt << PAGE_ORDER);
+    // Free the range as a run of aligned blocks, each as large as alignment and what is left allow
+    while(cnt > 0){
 
-        // Now lets take a look at the first case where the new region is strictly before this chunk
-        // What this means is that we have reached the first existing chunk that starts after the new one ends
-        // This means the new chunk should be inserted right before curr
-        // So now that we know where, we break the loop
-        if(curr_start >= end_addr){
+        // Largest order that idx is aligned to and that still fits in cnt
+        unsigned int k = 0;
 
-            break;
+        while(k < PAGE_MAX_ORDER && (idx & (1UL << k)) == 0 && (2UL << k) <= cnt){
+
+            ++k;
         }
 
-        // The second case is that the new region is stricly after the chunk
-        // In that case we have still not found the right spot to insert so we continue walking throught the code
-        if(start_addr >= curr_end){
+        // Merge with the buddy while it is a free block of the same order
+        uintptr_t blk = idx;
+        unsigned int ord = k;
 
-            // Now we need to update to keep moving through the list
-            prev = curr;
+        while(ord < PAGE_MAX_ORDER){
 
-            // Move to the next chunk
-            curr = curr->next;
+            // The buddy is the other half of the block one order up
+            uintptr_t buddy = blk ^ (1UL << ord);
 
-            // Move forward
-            continue;
+            // Stop if the buddy runs past RAM or is not a free block of this order
+            if(buddy + (1UL << ord) > RAM_PAGE_CNT || page_frames[buddy].free_order != ord + 1){
+
+                break;
+            }
+
+            // Take the buddy off its list and continue with the merged block
+            free_list_remove(buddy, ord);
+            blk = MIN(blk, buddy);
+            ++ord;
         }
-    
-        // Third case is that the freed region overlaps in the current chunk
-        // If this is the case, then that means that there are two frees for the same region
-        // Or it could be that the cnt is invalid, either way its invalid
-        panic("free_phys_pages: overlapping pages");
+
+        // Put the (possibly merged) block on its list
+        free_list_push(blk, ord);
+
+        // Move on past the block we just freed
+        idx += 1UL << k;
+        cnt -= 1U << k;
     }
+}
+
+// Counts the number of pages remaining in the free lists.
+// The allocator keeps a running total, so this is O(1).
+unsigned long free_phys_page_count(void) {
 
-    // Insert a new chunk thats struct lives at the start of the free region
-    struct page_chunk * new_freed_chunk = (struct page_chunk *) start_addr;
+    // Return the total number of pages left in the free lists
+    return free_page_total;
+}
 
-    // This chink describes cnt pages so update it
-    new_freed_chunk->pagecnt = cnt;
+// Does one page of background work for the idle thread: zeroes a dead page-table page onto
+// the zeroed pool (or frees it if the pool is full), or else tops the pool up with a fresh
+// page while memory is plentiful. Returns 1 if it did something, 0 if there is nothing to do.
+int memory_idle(void){
 
-    // Now we need to maintain the list, make sure that the list remains sorted
-    // Do this by the physical addresses
-    // If there is no prev chunk, then the new freed region should be put before the current head
-    if(prev == NULL){
+    // The idle thread may get to run before the allocator is set up
+    if(!memory_initialized){
 
-        // Set the new chunk to be in the head location and for it to be the head
-        new_freed_chunk->next = free_chunk_list;
-        free_chunk_list = new_freed_chunk;
+        return 0;
     }
-    
-    // Else, but the new chunk in between prev and curr
-    else{
 
-        // Put it right in between, where it should be
-        new_freed_chunk->next = curr;
-        prev->next = new_freed_chunk;
+    // Take the next dead page-table page, if any
+    long pie = disable_interrupts();
+    struct page_link * link = ptab_dead;
+
+    if(link != NULL){
+
+        ptab_dead = link->next;
     }
-}
 
-// Counts the number of pages remaining in the free chunk list.
-unsigned long free_phys_page_count(void) {
-    // FIXME
+    restore_interrupts(pie);
+
+    // Nothing dead, refill the pool unless it is full or memory is getting short
+    if(link == NULL){
+
+        if(zero_pool_cnt >= ZERO_POOL_MAX || free_page_total <= 4 * ZERO_POOL_MAX){
+
+            return 0;
+        }
+
+        link = alloc_phys_page();
+    }
+
+    // Zero it outside the critical section, nobody else can see it now
+    memset(link, 0, PAGE_SIZE);
 
-    // Struct page chunk pointer that is initialized to the head of the free list
-    struct page_chunk * chunk = free_chunk_list;
+    // Put it on the zeroed pool if there is room
+    pie = disable_interrupts();
+    int pooled = (zero_pool_cnt < ZERO_POOL_MAX);
 
-    // Running tottal taht will hold the number of free pages as we go through the loop
-    unsigned long total = 0;
+    if(pooled){
+
+        link->next = zero_pool;
+        zero_pool = link;
+        ++zero_pool_cnt;
+    }
 
-    // Walk the free chunk list and sum all of the page count fields to total
-    // The condition being that chunk, which points to the head, is not null, therefore there are still chunks to traverse
-    while(chunk != NULL){
+    restore_interrupts(pie);
 
-        // Add to the running total
-        total += chunk->pagecnt;
+    // The pool is full, the page goes back to the buddy allocator
+    if(!pooled){
 
-        // Go to the next chunk
-        chunk = chunk->next;
+        free_phys_page(link);
     }
 
-    // Return the total number of pages left in the list
-    return total;
+    return 1;
 }
+
 // Called by handle_umode_exception() in excp.c to handle U mode load and store page faults. 
 // It returns 1 to indicate the fault has been handled (the instruction should be restarted) and 
 // 0 to indicate that the page fault is fatal and the process should be terminated.
@@ -1197,9 +1722,39 @@ unsigned long free_phys_page_count(void) {
 int handle_umode_page_fault(struct trap_frame *tfr, uintptr_t vma) {
     // FIXME
 
-    // Tnhis function does not use the parametners so to not get a compiler, cast
+    // The trap frame is not needed, only the faulting address
     (void) tfr;
-    (void) vma;
+
+    // A store to a copy-on-write page or to a clean page of a writable mapping is a fault we can resolve
+    // Anything that is not a valid user leaf of that kind is fatal, unless it lies in a lazy range
+    if(wellformed(vma)){
+
+        // Look up the leaf that maps the faulting address
+        struct pte * pte = ptab_fetch(active_space_ptab(), VPN(vma));
+
+        // Only user pages that are shared copy-on-write or clean mapped pages qualify
+        if(pte != NULL && PTE_LEAF(* pte) && (pte->flags & PTE_U) &&
+           (PTE_COW(* pte) || (!(pte->flags & PTE_W) && mregion_store_ok(vma)))){
+
+            // Copy the page (or take it over if nobody else shares it anymore) and make it writable
+            // A shared megapage is split first so only the page that was stored to gets copied
+            pte = ptab_fetch_page(active_space_ptab(), VPN(vma));
+            pte_cow_break(pte);
+
+            // Drop the read-only translation so the restarted store sees the new one
+            tlb_flush_page(vma, 0);
+
+            // Handled, restart the instruction
+            return 1;
+        }
+
+        // Nothing mapped yet, but the address may be inside a lazy range of the process
+        if(pte == NULL && mregion_populate(vma)){
+
+            // Handled, restart the instruction
+            return 1;
+        }
+    }
 
     // Now we create the conditional debugging logic
     // If MEMORY_DEBUG is defines, then the compiler sees the debug line
@@ -1270,6 +1825,17 @@ static inline int wellformed(uintptr_t vma) {
     return (!bits || !(bits + 1));
 }
 
+/**
+ * @brief Checks that a range lies entirely in user space
+ * @param vp Start of the range
+ * @param len Length of the range in bytes
+ * @return 1 if [vp, vp + len) is within [UMEM_START_VMA, UMEM_END_VMA), 0 otherwise
+ */
+static inline int user_range(const void *vp, size_t len) {
+    uintptr_t const va = (uintptr_t)vp;
+    return (UMEM_START_VMA <= va && va <= UMEM_END_VMA && len <= UMEM_END_VMA - va);
+}
+
 /**
  * @brief Constructs a page table entry corresponding to a leaf
  * @details For our purposes, a leaf PTE has the A, D, and V flags set
@@ -1313,7 +1879,7 @@ static inline struct pte * pte_child(const struct pte * entry){
 
 // Ptab_reset will recursively unmap and free all the non-gloval pages from this page table
 // It wont dree the actual page table, that is for discard
-static void ptab_reset(struct pte * ptab){
+static void ptab_reset(struct pte * ptab, int level){
 
     // For each valid non-global, leaf entry, it will free the phys page and clear the PTE
     // for the non-leage entries, it will recursively go throughn the child table, and do the same thing
@@ -1341,11 +1907,8 @@ static void ptab_reset(struct pte * ptab){
         // If it its a leaf table, we know its non-global and valid so we can unmap adn free the pages
         if(PTE_LEAF(curr)){
 
-            // Free by storing the phyciscal page number by using the helper that converts ppn to ptr addr
-            void * pp = pageptr(curr.ppn);
-
-            // Free using free_phys_page
-            free_phys_page(pp);
+            // Drop our reference to every page the leaf covers, which frees them unless they are shared copy-on-write
+            leaf_put(&curr, level);
 
             // Set the current page table entry to null
             ptab[i] = null_pte();
@@ -1358,10 +1921,10 @@ static void ptab_reset(struct pte * ptab){
             struct pte * child = pte_child(&curr);
 
             // Reset the child table recursively
-            ptab_reset(child);
+            ptab_reset(child, level - 1);
 
-            // Now that the child table has been emptied, free the child page
-            free_phys_page(child);
+            // Now that the child table has been emptied, park it on the dead list for the idle thread
+            ptab_free(child);
 
             // Set the current table to null
             ptab[i] = null_pte();
@@ -1371,7 +1934,7 @@ static void ptab_reset(struct pte * ptab){
 
 // Ptab_discard will recursively discard rhe address space at ptab
 // Frees all non global mappings and page tables and then also frees ptab as well
-static void ptab_discard(struct pte * ptab){
+static void ptab_discard(struct pte * ptab, int level){
 
     // Similar process just as ptab_reset
 
@@ -1401,11 +1964,8 @@ static void ptab_discard(struct pte * ptab){
         // If it its a leaf table, we know its non-global and valid so we can unmap adn free the pages
         if(PTE_LEAF(curr)){
 
-            // Free by storing the phyciscal page number by using the helper that converts ppn to ptr addr
-            void * pp = pageptr(curr.ppn);
-
-            // Free using free_phys_page
-            free_phys_page(pp);
+            // Drop our reference to every page the leaf covers, which frees them unless they are shared copy-on-write
+            leaf_put(&curr, level);
 
             // Set the current page table entry to null
             ptab[i] = null_pte();
@@ -1417,40 +1977,31 @@ static void ptab_discard(struct pte * ptab){
             // Get the child table pointer
             struct pte * child = pte_child(&curr);
 
-            // Reset the child table recursively
-            ptab_discard(child);
+            // Discard the child table recursively, which also parks it on the dead list
+            ptab_discard(child, level - 1);
 
             // Set the current table to null
             ptab[i] = null_pte();
         }
     }
 
-    // Free the page table itself unless it is the main root table
+    // Park the page table itself on the dead list unless it is the main root table
     if(ptab != main_pt2){
 
-        free_phys_page(ptab);
+        ptab_free(ptab);
     }
 }
 
 // Ptab_clone makes a new copy of the address space including all the different levels
 // The cloned copy will sahre mappings and address space
 // For global entries, reuses the same PTE
-// For non-global leaf entries, allocated a physucal page, copies the contents and create sa new leaf PTE
+// For non-global leaf entries, shares the physical page and counts the extra sharer
+// Writable ones lose W in both tables and are marked COW, the copy happens on the first store
 // For non-global non-leaf, recursivelly call clone to cllone the child table and create a PTE in the new table to point to the child table
-static struct pte * ptab_clone(struct pte * ptab){
-
-    // Allocate a new page to become to hold the cloned table
-    // Use the alloc phys page function
-    void * ptab_page = alloc_phys_page();
-
-    // Check that the allocation was valid
-    assert(ptab_page != NULL);
+static struct pte * ptab_clone(struct pte * ptab, int level){
 
-    // Cast the void page pointer to a struct pte pointer which treats the page as an array of emtries
-    struct pte * new_ptab = (struct pte *) ptab_page;
-
-    // Now zero it in memoery so that it is currently seen as unmapped
-    memset(new_ptab, 0, PAGE_SIZE);
+    // Take an already zeroed page for the cloned table, so it is currently seen as unmapped
+    struct pte * new_ptab = ptab_alloc();
 
     // Nowwe can iterate over all of the entries in the original table so that we can copy it over
     for(unsigned int i = 0; i < PTE_CNT; ++i){
@@ -1477,25 +2028,21 @@ static struct pte * ptab_clone(struct pte * ptab){
         // Case for a non global leaf page
         if(PTE_LEAF(curr)){
 
-            // We need to first start by cloingin the physical page
-            // Convert the ppn into a pointer to the page using the helper
-            void * old_page = pageptr(curr.ppn);
-
-            // Create the new cloned page by allocating a page for it
-            void * new_page = alloc_phys_page();
+            // The page is shared instead of copied, the copy is deferred to the first store
+            // Writable pages become read-only in both spaces and are marked COW so the store fault knows to copy
+            if(curr.flags & PTE_W){
 
-            // Now check that it was allocated properly
-            assert(new_page != NULL);
-
-            // Now use memcpy to make a full page copy of old page into new page
-            memcpy(new_page, old_page, PAGE_SIZE);
+                // Clear W and set the COW marker, then write it back into the parent as well
+                curr.flags &= ~PTE_W;
+                curr.rsw |= PTE_RSW_COW;
+                ptab[i] = curr;
+            }
 
-            // Now we need to preserve the relevant flag bits so that we can set it to the new cloned page
-            // The relevant flags are R, W, X, U, G, thats all we need so do a bitwise ANd with the current flag to get just them
-            uint_fast8_t rwxug = (uint_fast8_t)(curr.flags & (PTE_R | PTE_W | PTE_X | PTE_U | PTE_G));
+            // One more memory space now maps every page of this leaf
+            leaf_get(&curr, level);
 
-            // Use the leaf pte helper to make the same page with the same permission bits
-            new_ptab[i] = leaf_pte(new_page, rwxug);
+            // The child gets the exact same leaf
+            new_ptab[i] = curr;
         }
 
         // If a non-leaf, non-global, then we clone the child table and keep the permissions for a gild one
@@ -1505,7 +2052,7 @@ static struct pte * ptab_clone(struct pte * ptab){
             void * old_child = pageptr(curr.ppn);
 
             // Create the new cloned page by recursively calling
-            void * new_child = ptab_clone(old_child);
+            void * new_child = ptab_clone(old_child, level - 1);
 
             // Keep only the G bit as its the only one we need
             uint_fast8_t g_flag = (uint_fast8_t)(curr.flags & PTE_G);
@@ -1525,6 +2072,16 @@ static struct pte * ptab_clone(struct pte * ptab){
 // Otherwise walk through till the leaf
 struct pte * ptab_fetch(struct pte * ptab, unsigned long vpn){
 
+    // Same walk, the caller does not care how large the leaf is
+    int level;
+
+    return ptab_fetch_level(ptab, vpn, &level);
+}
+
+// Ptab_fetch_level is ptab_fetch that also reports the level the walk stopped at
+// A leaf at level 1 maps a 2M megapage and a leaf at level 2 a 1G gigapage
+static struct pte * ptab_fetch_level(struct pte * ptab, unsigned long vpn, int * level){
+
     // First we have to initialize a pointer for where we are currently on the table
     // Set to ptab initially
     struct pte * curr_pg = ptab;
@@ -1548,6 +2105,9 @@ struct pte * ptab_fetch(struct pte * ptab, unsigned long vpn){
         // If it is either a leaf PTE or if its a level 0 PTE, then return
         if(PTE_LEAF(* curr_addr) || i == 0){
 
+            // Tell the caller how much the leaf covers
+            * level = i;
+
             return curr_addr;
         }
 
@@ -1559,18 +2119,69 @@ struct pte * ptab_fetch(struct pte * ptab, unsigned long vpn){
     return NULL;
 }
 
+// Ptab_fetch_page returns the level 0 leaf for vpn, splitting any megapage or gigapage
+// that covers it first. Used where a single 4K page has to change on its own.
+static struct pte * ptab_fetch_page(struct pte * ptab, unsigned long vpn){
+
+    // Level of the leaf we found
+    int level;
+
+    // Look up the current mapping
+    struct pte * pte = ptab_fetch_level(ptab, vpn, &level);
+
+    // Break large leaves down one level at a time until the page has a leaf of its own
+    while(pte != NULL && level > 0){
+
+        // The split leaves the same translation, just in smaller pieces
+        ptab_split(pte, level);
+        pte = ptab_fetch_level(ptab, vpn, &level);
+    }
+
+    return pte;
+}
+
+// Ptab_split replaces the megapage or gigapage leaf pte at level with a subtable of 512 leaves
+// one level down that map the same physical range with the same flags. Every 4K frame keeps the
+// reference the large leaf held on it, so no counts change. Returns the new subtable.
+static struct pte * ptab_split(struct pte * pte, int level){
+
+    // Only large leaves can be split
+    assert(level > 0 && PTE_LEAF(* pte));
+
+    // Take the page that becomes the subtable
+    struct pte * child = ptab_alloc();
+
+    // Fill in every smaller leaf before the subtable goes live, so a walk never sees a half-built table
+    for(unsigned int i = 0; i < PTE_CNT; ++i){
+
+        // Same flags and COW marker, just the next slice of the physical range
+        child[i] = * pte;
+        child[i].ppn = pte->ppn + i * LEVEL_PAGES(level - 1);
+    }
+
+    // Now point the entry at the subtable, global if the large leaf was
+    * pte = ptab_pte(child, (uint_fast8_t)(pte->flags & PTE_G));
+
+    return child;
+}
+
 // Ptab_insert takes in the root pahe table, the virtual page number, the physical page pointer and the flags
-// It makes sire that the page table ahs a path down to level 0 for the specific vpn
+// It makes sire that the page table ahs a path down to the requested level for the specific vpn
 // Inserts a mapping for vpn to pp given the flags and make sures the path table architecure is correct
-static void ptab_insert(struct pte * ptab, unsigned long vpn, void * pp, int rwxug_flags){
+// Level 0 installs a 4K page, level 1 a 2M megapage and level 2 a 1G gigapage
+static void ptab_insert(struct pte * ptab, unsigned long vpn, void * pp, int rwxug_flags, int level){
 
     // Start with the current page table page as we traverse the pt tree
     struct pte * curr_pg = ptab;
 
+    // A large leaf has to start on its own size in both address spaces
+    assert((vpn & (LEVEL_PAGES(level) - 1)) == 0);
+    assert((pagenum(pp) & (LEVEL_PAGES(level) - 1)) == 0);
+
     // Similar to above, we walk from the root level down to loop over the levels
-    // This time we stop at level 1, not all the way to level 0
-    // At level 0 we  install the leaf mapping
-    for(int i = ROOT_LEVEL; i > 0; --i){
+    // This time we stop one level above the leaf, not all the way to level 0
+    // At the requested level we install the leaf mapping
+    for(int i = ROOT_LEVEL; i > level; --i){
 
         // Now we need to compute the index at this level
         // Use PT_INDEX to get the 9 bit VPN component
@@ -1582,17 +2193,8 @@ static void ptab_insert(struct pte * ptab, unsigned long vpn, void * pp, int rwx
         // If the PTE at the curr addr is not valid, then we need to allocate a new sub table
         if(!PTE_VALID(* curr_addr)){
 
-            // Allocate a sub page table using the alloc phys page function
-            void * sub_ptab = alloc_phys_page();
-
-            // Make sure the allocation was proper
-            assert(sub_ptab != NULL);
-
-            // Cast the physical page to a PTE as that page will store an array of PTEs
-            struct pte * child = (struct pte *) sub_ptab;
-
-            // Now zero out the new table as there are no mappings yet
-            memset(child, 0, PAGE_SIZE);
+            // Take a sub page table, it comes zeroed as there are no mappings yet
+            struct pte * child = ptab_alloc();
 
             // Now install the PTE into the parent
             // The page at the curr_addr is a valid non-leaf PTE pointing to the child tab;e
@@ -1602,54 +2204,68 @@ static void ptab_insert(struct pte * ptab, unsigned long vpn, void * pp, int rwx
             curr_pg = child;
         }
 
-        // If the current page is valid
-        else{
+        // A larger leaf covers the address, break it up so the rest of it stays mapped
+        else if(PTE_LEAF(* curr_addr)){
 
-            // Expecting a subtable, if it is a leaf then panic
-            if(PTE_LEAF(* curr_addr)){
+            curr_pg = ptab_split(curr_addr, i);
+        }
 
-                panic("ptab_insert: leaf PTE found instead of subtable");
-            }
+        // Otherwise, we know it is a child page table so continute walking
+        else{
 
-            // Otherwise, we know it is a child page table so continute walking
             curr_pg = pte_child(curr_addr);
         }
 
     }
 
-    // Now at level 0, we nede to install or in some cases replace the leaf mapping
-    // curr_pg now points to the lvl 0 table so compute the index of it
+    // Now at the leaf level, we nede to install or in some cases replace the leaf mapping
+    // curr_pg now points to the table at that level so compute the index of it
     // Use PT_INDEX to get the 9 bit VPN component
-    unsigned int idx_0 = PT_INDEX(0, vpn);
+    unsigned int idx_leaf = PT_INDEX(level, vpn);
 
     // Define the PTE that will be the leaf where the actual mapping will go
-    struct pte * leaf = &curr_pg[idx_0];
+    struct pte * leaf = &curr_pg[idx_leaf];
     
     // Now we need to do the valid leaf global checks
-    // If there is an existing non-global leaf mapping, then we need to free the old pp
+    // If there is an existing non-global leaf mapping, then we need to free the old pages
     if(PTE_VALID(* leaf) && PTE_LEAF(* leaf) && !PTE_GLOBAL(* leaf)){
 
-        // Define the old pp by using the current leafs ppn
-        void * old_pp = pageptr(leaf->ppn);
-
-        // Free the old pp by using the free phys page funciton
-        free_phys_page(old_pp);
+        // Drop the references to the old pages, which frees them unless they are shared copy-on-write
+        leaf_put(leaf, level);
     }
 
-    // Now chcek the error case that it is valid but its not a leaf
+    // Now chcek the case that it is valid but its not a leaf
     if(PTE_VALID(* leaf) && !PTE_LEAF(* leaf)){
 
-        // Panic
-        panic("ptab_insert: non-leaf PTE at lvl 0, panic");
+        // Level 0 entries are always leaves, and kernel subtables are never replaced
+        if(level == 0 || PTE_GLOBAL(* leaf)){
+
+            // Panic
+            panic("ptab_insert: non-leaf PTE in the way of the leaf, panic");
+        }
+
+        // A large leaf replaces the smaller mappings below it, free them with their tables
+        ptab_discard(pte_child(leaf), level - 1);
     }
 
     // Now to actually create the new PTE, call upon the leaf_pte helper that builds it from the pp and the flags
     * leaf = leaf_pte(pp, (uint_fast8_t) rwxug_flags);
+
+    // User pages are charged to the process that maps them first
+    if(rwxug_flags & PTE_U){
+
+        for(unsigned long i = 0; i < LEVEL_PAGES(level); ++i){
+
+            page_frame_mark_user((char *) pp + i * PAGE_SIZE);
+        }
+    }
 }
 
 // For this helper it will return 0 if there is no mapping removed in the subtree, 1 if there was a mappring removed
 // 1 also says there are still other valid entries, 2 says removed and there is nothing left in the table
-static int ptab_remove_recursive_helper(struct pte * ptab, int level, unsigned long vpn, void **pp_out){
+// The leaf removed is the one at stop, larger leaves on the way there are split first
+// Pruned is set when an emptied table is freed
+static int ptab_remove_recursive_helper(struct pte * ptab, int level, int stop, unsigned long vpn, void **pp_out, int * pruned){
 
     // First thing we need to do is index into the table as we have done multiple times before
     // Use PT_INDEX to get the 9 bit VPN component
@@ -1664,8 +2280,14 @@ static int ptab_remove_recursive_helper(struct pte * ptab, int level, unsigned l
         return 0;
     }
 
-    // If it is a leaf mapping or at level 0, the curr pte defines the mapping to remove
-    if(PTE_LEAF(* curr_pte) || level == 0){
+    // A larger leaf than the one asked for, break it up so only the requested part goes away
+    if(PTE_LEAF(* curr_pte) && level > stop){
+
+        ptab_split(curr_pte, level);
+    }
+
+    // If it is a leaf mapping or at the stop level, the curr pte defines the mapping to remove
+    else if(PTE_LEAF(* curr_pte) || level == stop){
 
         // In case its level 0 but not a leaf which means there is no actual mapping here.
         if(!PTE_LEAF(* curr_pte)){
@@ -1704,7 +2326,7 @@ static int ptab_remove_recursive_helper(struct pte * ptab, int level, unsigned l
     struct pte * child = pte_child(curr_pte);
 
     // Make the recurve call to the helper functon that tells it to go one down and store the returned resilt into a var to check with
-    int result = ptab_remove_recursive_helper(child, level - 1, vpn, pp_out);
+    int result = ptab_remove_recursive_helper(child, level - 1, stop, vpn, pp_out, pruned);
 
     // Now if the helper returns 0, then we know there is nothing more to do in the child
     if(result == 0){
@@ -1715,8 +2337,11 @@ static int ptab_remove_recursive_helper(struct pte * ptab, int level, unsigned l
     // Now if the helper returns 2, that means it is empty which means we need to free and clear it
     if(result == 2){
 
-        // free the child table page
-        free_phys_page(child);
+        // Park the child table page on the dead list
+        ptab_free(child);
+
+        // The walker may still cache the entry that pointed at it
+        * pruned = 1;
 
         // Clear the pte
         * curr_pte = null_pte();
@@ -1742,14 +2367,15 @@ static int ptab_remove_recursive_helper(struct pte * ptab, int level, unsigned l
 // Ptab_remove does pretty much the opposite of remove so the thge code is going to be very similar
 // This one wont need the pp or the flags because we are removing the mapping
 // We also are going to free and clean up the page tables that become empty as a result
-static void * ptab_remove(struct pte * ptab, unsigned long vpn){
+// Level says how large the leaf to remove is, a larger leaf covering vpn is split first
+static void * ptab_remove(struct pte * ptab, unsigned long vpn, int level, int * pruned){
 
     // Call on the recusrive function for this
     // Set the page pointer to NULL as it nothing gets removed it stays NULL but gets set if it set
     void * pp = NULL;
 
     // Call on the recursive helper
-    (void) ptab_remove_recursive_helper(ptab, ROOT_LEVEL, vpn, &pp);
+    (void) ptab_remove_recursive_helper(ptab, ROOT_LEVEL, level, vpn, &pp, pruned);
 
     // Return the physical page pointer
     return pp;
@@ -1783,4 +2409,533 @@ static void ptab_adjust(struct pte * ptab, unsigned long vpn, int rwxug_flags){
 
     // Now that we have the non important bits, we can bitwise or with the flags to set the flags to the update one
     curr_pte->flags = non_flag_bits | (uint8_t) rwxug_flags;
+
+    // A page still shared with another memory space must not become writable here
+    // Keep it read-only and mark it COW so the first store copies it
+    struct page * frame = page_frame(pageptr(curr_pte->ppn));
+
+    if((rwxug_flags & PTE_W) && frame != NULL && frame->refcnt > 1){
+
+        curr_pte->flags &= ~PTE_W;
+        curr_pte->rsw |= PTE_RSW_COW;
+    }
+
+    // Otherwise the new flags say it all
+    else{
+
+        curr_pte->rsw &= ~PTE_RSW_COW;
+    }
+}
+
+// Leaf_get takes one more reference to every 4K frame a leaf at level maps
+static void leaf_get(const struct pte * leaf, int level){
+
+    for(unsigned long i = 0; i < LEVEL_PAGES(level); ++i){
+
+        page_get(pageptr(leaf->ppn + i));
+    }
+}
+
+// Leaf_put drops the reference a leaf at level holds on each 4K frame it maps
+// Frames whose last reference goes away return to the free lists
+static void leaf_put(const struct pte * leaf, int level){
+
+    for(unsigned long i = 0; i < LEVEL_PAGES(level); ++i){
+
+        page_put(pageptr(leaf->ppn + i));
+    }
+}
+
+// Ptab_alloc returns a zeroed page for a page table
+static struct pte * ptab_alloc(void){
+
+    // Zeroed pages come with a fresh frame entry, so a recycled root does not keep its old ASID
+    struct pte * ptab = alloc_zeroed_page();
+
+    // Record in the frame database that this page holds a page table
+    page_frame(ptab)->flags |= PAGE_F_PTAB;
+
+    return ptab;
+}
+
+// Ptab_free parks a page-table page that is no longer linked into any table on the dead
+// list. Its entries are left as they are, memory_idle() zeroes it later.
+static void ptab_free(struct pte * ptab){
+
+    // Page tables are never shared, we hold the only reference
+    assert(page_frame(ptab)->refcnt == 1);
+
+    struct page_link * link = (struct page_link *) ptab;
+
+    long pie = disable_interrupts();
+    link->next = ptab_dead;
+    ptab_dead = link;
+    restore_interrupts(pie);
+}
+
+// Zero_pool_drain gives every zeroed page and every dead page-table page back to the buddy
+// allocator and returns how many there were. Used when physical memory runs out.
+static int zero_pool_drain(void){
+
+    // Take both lists whole
+    long pie = disable_interrupts();
+    struct page_link * lists[2] = { zero_pool, ptab_dead };
+    zero_pool = NULL;
+    zero_pool_cnt = 0;
+    ptab_dead = NULL;
+    restore_interrupts(pie);
+
+    int cnt = 0;
+
+    for(int i = 0; i < 2; ++i){
+
+        while(lists[i] != NULL){
+
+            struct page_link * link = lists[i];
+            lists[i] = link->next;
+            free_phys_page(link);
+            ++cnt;
+        }
+    }
+
+    return cnt;
+}
+
+// Page_frame_mark_user flags a page as mapped into user space and charges it to the current
+// process unless another process mapped it first
+static void page_frame_mark_user(const void * pp){
+
+    // Look up the frame, pages outside RAM have none
+    struct page * frame = page_frame(pp);
+
+    if(frame == NULL){
+
+        return;
+    }
+
+    frame->flags |= PAGE_F_USER;
+
+    if(frame->owner == NULL){
+
+        frame->owner = current_process();
+    }
+}
+
+// Page_index is the page number of a physical address, counted from RAM_START
+static inline uintptr_t page_index(const void * pp){
+
+    return ((uintptr_t) pp - RAM_START_PMA) >> PAGE_ORDER;
+}
+
+// Page_addr is the physical address of a page number counted from RAM_START
+static inline void * page_addr(uintptr_t idx){
+
+    return (void *) (RAM_START_PMA + (idx << PAGE_ORDER));
+}
+
+// Free_list_push puts the block of 2^order pages starting at page idx on its free list
+static void free_list_push(uintptr_t idx, unsigned int order){
+
+    // The list node lives in the first page of the block
+    struct free_block * blk = page_addr(idx);
+
+    // Link it in at the head
+    blk->prev = NULL;
+    blk->next = free_lists[order];
+
+    if(blk->next != NULL){
+
+        blk->next->prev = blk;
+    }
+
+    free_lists[order] = blk;
+
+    // Record that this page starts a free block of this order so its buddy can find it
+    page_frames[idx].free_order = order + 1;
+}
+
+// Page_in_free_block tells whether page idx lies in a block on one of the free lists
+// Only the first page of a free block records its order, so look for a block of each
+// order that would contain idx
+static int page_in_free_block(uintptr_t idx){
+
+    for(unsigned int k = 0; k <= PAGE_MAX_ORDER; ++k){
+
+        // First page of the order k block holding idx
+        uintptr_t blk = idx & ~((1UL << k) - 1);
+
+        if(page_frames[blk].free_order == k + 1){
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Free_list_remove takes the block of 2^order pages starting at page idx off its free list
+static void free_list_remove(uintptr_t idx, unsigned int order){
+
+    // The list node lives in the first page of the block
+    struct free_block * blk = page_addr(idx);
+
+    // Unlink it from its neighbours, or from the head if it is first
+    if(blk->prev != NULL){
+
+        blk->prev->next = blk->next;
+    }
+
+    else{
+
+        free_lists[order] = blk->next;
+    }
+
+    if(blk->next != NULL){
+
+        blk->next->prev = blk->prev;
+    }
+
+    // The page no longer starts a free block
+    page_frames[idx].free_order = 0;
+}
+
+// Mspace_asid returns the ASID of the memory space rooted at root, handing out a new one if
+// the space has none in the current generation
+static unsigned int mspace_asid(struct pte * root){
+
+    // No ASIDs on this hart, everything runs as ASID 0
+    if(asid_max == 0){
+
+        return 0;
+    }
+
+    // The ASID is kept in the frame database entry of the root page table
+    struct page * frame = page_frame(root);
+
+    // Still valid in this generation
+    if(frame->asid_gen == asid_generation){
+
+        return frame->asid;
+    }
+
+    // Out of ASIDs, start a new generation
+    // Flushing the whole TLB once makes every ASID of the old generation safe to hand out again
+    if(asid_next > asid_max){
+
+        asid_next = 1;
+
+        // Generation 0 means never assigned, so when the counter wraps clear every root's
+        // generation or one idle for 65535 rollovers would look current
+        if(++asid_generation == 0){
+
+            for(unsigned long i = 0; i < RAM_PAGE_CNT; ++i){
+
+                page_frames[i].asid_gen = 0;
+            }
+
+            asid_generation = 1;
+        }
+
+        sfence_vma();
+    }
+
+    // Take the next ASID of this generation
+    frame->asid = asid_next++;
+    frame->asid_gen = asid_generation;
+
+    return frame->asid;
+}
+
+// Flush_active_mspace drops the TLB entries of the active memory space only
+// With ASID 0 there is nothing to tell spaces apart, so the whole TLB goes
+static void flush_active_mspace(void){
+
+    unsigned long asid = MTAG_ASID(active_space_mtag());
+
+    if(asid != 0){
+
+        sfence_vma_asid(asid);
+    }
+
+    else{
+
+        sfence_vma();
+    }
+}
+
+// Tlb_flush_page fences one page of the active memory space
+// Global mappings live in every address space, so those are fenced without an ASID
+static void tlb_flush_page(uintptr_t vma, int global){
+
+    unsigned long asid = MTAG_ASID(active_space_mtag());
+
+    if(global){
+
+        sfence_vma_addr(vma);
+    }
+
+    else{
+
+        sfence_vma_addr_asid(vma, asid);
+    }
+}
+
+// Tlb_batch_add records a page of the active memory space whose translation changed
+static void tlb_batch_add(struct tlb_batch * batch, uintptr_t vma, int global){
+
+    // Only the first TLB_BATCH_MAX pages are kept, past that the whole space is flushed anyway
+    if(batch->cnt < TLB_BATCH_MAX){
+
+        batch->vma[batch->cnt] = vma;
+    }
+
+    ++batch->cnt;
+    batch->global |= global;
+}
+
+// Tlb_batch_flush fences the pages of a batch, one by one while there are few of them
+// and with a single flush of the address space (or the whole TLB for global ones) past that
+// A freed page table always takes the full flush: a fence for one address need not drop
+// cached non-leaf entries, and the table page may come back as someone's data page
+static void tlb_batch_flush(struct tlb_batch * batch){
+
+    // Too many for per-page fences, or a page table went away
+    if(batch->cnt > TLB_BATCH_MAX || batch->pruned){
+
+        if(batch->global){
+
+            sfence_vma();
+        }
+
+        else{
+
+            flush_active_mspace();
+        }
+    }
+
+    // Fence each changed page
+    else{
+
+        for(unsigned int i = 0; i < batch->cnt; ++i){
+
+            tlb_flush_page(batch->vma[i], batch->global);
+        }
+    }
+
+    // Start over empty
+    batch->cnt = 0;
+    batch->global = 0;
+    batch->pruned = 0;
+}
+
+// Returns the frame database entry of the page holding physical address pp
+struct page * page_frame(const void * pp){
+
+    // Addresses outside RAM have no entry
+    if((uintptr_t) pp < RAM_START_PMA || (uintptr_t) pp >= RAM_END_PMA){
+
+        return NULL;
+    }
+
+    return &page_frames[page_index(pp)];
+}
+
+// Takes one more reference to an allocated page
+void page_get(void * pp){
+
+    // Look up the frame for this page
+    struct page * frame = page_frame(pp);
+
+    // Only allocated pages can gain references
+    assert(frame != NULL && frame->refcnt != 0);
+
+    // Another process may be dropping its reference from a preempted context, so keep the update whole
+    long pie = disable_interrupts();
+
+    // Make sure the count does not wrap
+    if(frame->refcnt == UINT16_MAX){
+
+        panic("page_get: too many references");
+    }
+
+    ++frame->refcnt;
+    restore_interrupts(pie);
+}
+
+// Drops one reference to a page and frees it when that was the last one
+void page_put(void * pp){
+
+    // Look up the frame for this page
+    struct page * frame = page_frame(pp);
+
+    // Reserved pages below the pool are never freed, and a free page has no references to drop
+    assert(frame != NULL && frame->refcnt != 0 && !(frame->flags & PAGE_F_RESERVED));
+
+    // Decide whether we were the last user with interrupts off, so two exiting sharers cannot both free it
+    long pie = disable_interrupts();
+    int last = (--frame->refcnt == 0);
+    restore_interrupts(pie);
+
+    // Last reference gone, return the page to the free lists
+    if(last){
+
+        free_phys_page(pp);
+    }
+}
+
+// Mregion_find returns the region of the current process that covers vma, or NULL
+static struct mregion * mregion_find(uintptr_t vma){
+
+    // The region list hangs off the process
+    struct process * proc = current_process();
+
+    // Kernel threads have no regions
+    if(proc == NULL){
+
+        return NULL;
+    }
+
+    // Look for the region that covers the address
+    for(struct mregion * rgn = proc->mregions; rgn != NULL; rgn = rgn->next){
+
+        if(vma >= rgn->start && vma < rgn->end){
+
+            return rgn;
+        }
+    }
+
+    // Not in any region
+    return NULL;
+}
+
+// Mregion_populate backs the page holding vma with a zero-filled page if vma lies in a
+// lazy range of the current process, or with the contents of the endpoint if the range
+// is a memory mapping. Returns 1 if a page was mapped, 0 otherwise.
+static int mregion_populate(uintptr_t vma){
+
+    // Find the region the address belongs to
+    struct mregion * rgn = mregion_find(vma);
+
+    // Not in any region
+    if(rgn == NULL){
+
+        return 0;
+    }
+
+    // The page holding vma and its offset in the region
+    uintptr_t page_vma = ROUND_DOWN(vma, PAGE_SIZE);
+    unsigned long long off = page_vma - rgn->start;
+
+    // Page that will back the address
+    void * pp;
+
+    // A whole page of a mapping can be the endpoint's cached page itself instead of a copy
+    // It is mapped read-only, and since the cache holds a reference too, the first store
+    // copies it through the COW break
+    if(rgn->uio != NULL && off + PAGE_SIZE <= rgn->uio_len && uio_getpage(rgn->uio, off, &pp) == 0){
+
+        map_page(page_vma, pp, rgn->rwxug_flags & ~PTE_W);
+        return 1;
+    }
+
+    // Anonymous memory always starts out as zeros, and so does the tail past the end of a mapping
+    pp = alloc_zeroed_page();
+
+    // Anonymous memory is mapped with the region's flags right away
+    int flags = rgn->rwxug_flags;
+
+    // A mapped page is read from the endpoint
+    if(rgn->uio != NULL && off < rgn->uio_len){
+
+        long cnt = uio_fetch(rgn->uio, off, pp, MIN(PAGE_SIZE, rgn->uio_len - off));
+
+        // The endpoint failed, the access can not be satisfied
+        if(cnt < 0){
+
+            free_phys_page(pp);
+            return 0;
+        }
+    }
+
+    // Mapped pages start out clean and read-only, the first store makes them writable
+    // and marks them dirty for write-back
+    if(rgn->uio != NULL){
+
+        flags &= ~PTE_W;
+    }
+
+    // Map it at the page holding vma
+    map_page(page_vma, pp, flags);
+
+    // A page was mapped
+    return 1;
+}
+
+// Mregion_store_ok tells whether a store to the clean page of a writable memory mapping
+// at vma may make it dirty
+static int mregion_store_ok(uintptr_t vma){
+
+    // Find the region the address belongs to
+    struct mregion * rgn = mregion_find(vma);
+
+    // Only writable mappings have clean pages that turn writable on a store
+    return rgn != NULL && rgn->uio != NULL && (rgn->rwxug_flags & PTE_W);
+}
+
+// Demand_fetch is ptab_fetch for a user address that faults the page in first if it
+// belongs to a lazy range and was never touched
+static struct pte * demand_fetch(struct pte * ptab, uintptr_t vma){
+
+    // Look up the current mapping first
+    struct pte * pte = ptab_fetch(ptab, VPN(vma));
+
+    // Not mapped yet, try to fault it in and look again
+    if(pte == NULL && mregion_populate(vma)){
+
+        pte = ptab_fetch(ptab, VPN(vma));
+    }
+
+    return pte;
+}
+
+// Pte_cow_break gives the memory space of pte its own writable copy of a COW page
+// If the other sharers already let go of the page, it is simply made writable in place
+static void pte_cow_break(struct pte * pte){
+
+    // The page that is currently shared
+    void * old_page = pageptr(pte->ppn);
+
+    // Look up the frame for this page
+    struct page * frame = page_frame(old_page);
+
+    // Allocate the copy first so interrupts are only off for the check and the copy
+    void * new_page = alloc_phys_page();
+
+    // Now check that it was allocated properly
+    assert(new_page != NULL);
+
+    // Check and copy in one go so the other sharer can not free the page while we copy it
+    long pie = disable_interrupts();
+
+    // Still shared, copy the contents and let go of the original
+    if(frame != NULL && frame->refcnt > 1){
+
+        memcpy(new_page, old_page, PAGE_SIZE);
+        --frame->refcnt;
+        pte->ppn = pagenum(new_page);
+        page_frame_mark_user(new_page);
+        new_page = NULL;
+    }
+
+    restore_interrupts(pie);
+
+    // We were the only one left, the spare page is not needed
+    if(new_page != NULL){
+
+        free_phys_page(new_page);
+    }
+
+    // The page belongs to this memory space alone now
+    pte->flags |= PTE_W | PTE_A | PTE_D;
+    pte->rsw &= ~PTE_RSW_COW;
 }
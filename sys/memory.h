@@ -33,13 +33,48 @@
 #define PTE_A (1 << 6)  // internal use only
 #define PTE_D (1 << 7)  // internal use only
 
+// Flags of struct page
+
+#define PAGE_F_RESERVED (1 << 0)  // kernel image, initial heap or frame database; never freed
+#define PAGE_F_PTAB (1 << 1)      // holds a page table
+#define PAGE_F_USER (1 << 2)      // mapped into a user memory space
+
 // EXPORTED TYPE DEFINITIONS
 //
 
+struct process;  // forward declaration
+struct uio;      // forward declaration
+
+/**
+ * @brief Frame database entry. memory_init() sets up one for every physical page of RAM.
+ */
+struct page {
+    uint16_t refcnt;        ///< References (mappings and kernel holders), 0 when free
+    uint8_t flags;          ///< PAGE_F_* flags
+    uint8_t free_order;     ///< Order + 1 if the page starts a free buddy block, else 0
+    uint16_t asid;          ///< ASID of a root page table, valid while asid_gen is current
+    uint16_t asid_gen;      ///< ASID generation the root page table's ASID belongs to
+    struct process* owner;  ///< Process that first mapped the page into user space
+};
+
 // We refer to a memory space using an opaque memory space tag
 
 typedef unsigned long mtag_t;
 
+/**
+ * @brief Range of user memory that is valid but only backed by a page once it is
+ * touched. Pages are zero-filled on the first fault, and filled from uio if the
+ * range is a memory mapping (FCNTL_MMAP).
+ */
+struct mregion {
+    struct mregion* next;        ///< Next region of the same process
+    uintptr_t start;             ///< First address (page aligned)
+    uintptr_t end;               ///< One past the last address (page aligned)
+    int rwxug_flags;             ///< Flags of pages faulted in
+    struct uio* uio;             ///< Mapped endpoint (holds a reference), NULL for anonymous memory
+    unsigned long long uio_len;  ///< Bytes of uio mapped at start
+};
+
 // EXPORTED FUNCTION DECLARATIONS
 //
 
@@ -59,15 +94,17 @@ extern void memory_init(void);
 extern mtag_t active_mspace(void);
 
 /**
- * @brief Switches the active memory space by writing the satp register
- * @param mtag Tag to write into satp
+ * @brief Switches the active memory space by writing the satp register. Each
+ * memory space keeps its own ASID, so only switching to the main memory space
+ * (ASID 0) flushes the TLB.
+ * @param mtag Tag of the memory space to switch to
  * @return Tag that was in satp prior
  */
 extern mtag_t switch_mspace(mtag_t mtag);
 
 /**
- * @brief Copies all pages and page tables from the active memory space into
- * newly allocated memory
+ * @brief Copies the page tables of the active memory space into newly allocated
+ * memory. User pages are shared copy-on-write instead of copied.
  * @return Tag corresponding to newly allocated memory
  */
 extern mtag_t clone_active_mspace(void);
@@ -96,7 +133,8 @@ extern void* map_page(uintptr_t vma, void* pp, int rwxug_flags);
 
 /**
  * @brief Adds a range of contiguous pages with provided virtual memory address, size, and flags to
- * page table
+ * page table. Uses 2 MB megapage and 1 GB gigapage leaves where vma, pp and the remaining size
+ * allow it.
  * @param vma Virtual memory address for page (must be a PAGE_SIZE increment)
  * @param size Number of bytes to be mapped as pages
  * @param pp Pointer to the first page to be added to page table
@@ -115,6 +153,56 @@ extern void* map_range(uintptr_t vma, size_t size, void* pp, int rwxug_flags);
  */
 extern void* alloc_and_map_range(uintptr_t vma, size_t size, int rwxug_flags);
 
+/**
+ * @brief Declares a range of the current process's memory as valid without backing it.
+ * Pages are allocated, zeroed and mapped with the given flags when first touched, either
+ * by the process (page fault) or by the kernel (validate_vptr() and validate_vstr()).
+ * Rounds up size to be a multiple of PAGE_SIZE.
+ * @param vma Virtual memory address of the range (must be a multiple of PAGE_SIZE)
+ * @param size Size (in bytes) of range
+ * @param rwxug_flags Flags of the pages once faulted in
+ * @return 0 on success, negative error code on failure
+ */
+extern int add_lazy_range(uintptr_t vma, size_t size, int rwxug_flags);
+
+/**
+ * @brief Maps a uio endpoint into the current process at a free address of the mapping
+ * window [UMMAP_START_VMA, UMMAP_END_VMA). Nothing is read until a page is touched; pages
+ * are then filled through the endpoint's _fetch_ operation. A writable mapping maps each page
+ * read-only until the first store, so only pages that were stored to are written back.
+ * @param uio Endpoint to map, must support _fetch_ (and _store_ if rwxug_flags has PTE_W)
+ * @param len Number of bytes of the endpoint to map, starting at position 0
+ * @param rwxug_flags Flags of the mapped pages
+ * @param vpp Where to store the address of the mapping
+ * @return 0 on success, negative error code on failure
+ */
+extern int map_uio_range(struct uio* uio, unsigned long long len, int rwxug_flags, void** vpp);
+
+/**
+ * @brief Writes dirty pages of the memory mappings in a region list of the active memory
+ * space back to their endpoints and makes them clean (read-only) again.
+ * @param list Region list of the active memory space
+ * @param uio Only write back mappings of this endpoint, or all mappings if NULL
+ * @return 0 on success, negative error code of the first failed write otherwise
+ */
+extern int sync_mregions(const struct mregion* list, const struct uio* uio);
+
+/**
+ * @brief Copies a region list, for a forked child
+ * @param list Region list to copy
+ * @param out Where to store the copy
+ * @return 0 on success, -ENOMEM if out of memory (nothing is allocated then)
+ */
+extern int clone_mregions(const struct mregion* list, struct mregion** out);
+
+/**
+ * @brief Frees every region of a region list, closing mapped endpoints. Dirty mapped pages
+ * are not written back, call sync_mregions() first.
+ * @param list Region list to free
+ * @return None
+ */
+extern void free_mregions(struct mregion* list);
+
 /**
  * @brief Sets passed flags for pages in range. Rounds up size to be a multiple of PAGE_SIZE.
  * @param vp Virtual memory address to begin setting flags at (must be a multiple of PAGE_SIZE)
@@ -154,6 +242,47 @@ extern int validate_vptr(const void* vp, size_t len, int rwxu_flags);
  */
 extern int validate_vstr(const char* vs, int ug_flags);
 
+/**
+ * @brief Copies from user memory into the kernel. Faults are recovered from through the
+ * exception fixup table instead of walking the page table first.
+ * @param kdst Kernel destination
+ * @param usrc User source
+ * @param n Number of bytes to copy
+ * @return 0 on success; -EACCESS if the range is not in user space or not readable
+ */
+extern int copyin(void* kdst, const void* usrc, size_t n);
+
+/**
+ * @brief Copies from the kernel into user memory, faulting in lazy pages and breaking
+ * copy-on-write sharing as a user store would.
+ * @param udst User destination
+ * @param ksrc Kernel source
+ * @param n Number of bytes to copy
+ * @return 0 on success; -EACCESS if the range is not in user space or not writable
+ */
+extern int copyout(void* udst, const void* ksrc, size_t n);
+
+/**
+ * @brief Copies a string from user memory into a kernel buffer, which is always terminated.
+ * @param kdst Kernel buffer
+ * @param usrc User string
+ * @param n Size of the kernel buffer
+ * @return Length of the string; -EINVAL if it does not fit in the buffer (or n is 0),
+ * -EACCESS if it does not start in user space or is not readable
+ */
+extern long copyinstr(char* kdst, const char* usrc, size_t n);
+
+/**
+ * @brief Touches every page of a user range so the kernel can access it directly afterwards,
+ * without a software page table walk. Lazy pages are faulted in and, if PTE_W is requested,
+ * copy-on-write pages are copied.
+ * @param vp Start of the range
+ * @param len Size (in bytes) of range
+ * @param rwxu_flags PTE_W to probe for write access, read access otherwise
+ * @return 0 on success; -EACCESS if the range is not in user space or a page is not accessible
+ */
+extern int probe_vptr(const void* vp, size_t len, int rwxu_flags);
+
 /**
  * @brief Allocates a single new page using alloc_phys_pages().
  * @return Address of the allocated page
@@ -168,34 +297,72 @@ extern void* alloc_phys_page(void);
 extern void free_phys_page(void* pp);
 
 /**
- * @brief Allocates the passed number of physical pages from the free chunk list
- * @details Finds smallest chunk that fits the requested number of pages. If chunk
- * exactly matches the number of pages requested, removes chunk from free chunk list,
- * otherwise breaks off the component of chunk that matches requested number of pages.
- * Panics if no chunk can be found that satisfies the request.
+ * @brief Allocates a single page filled with zeros, taken from the pool the idle thread
+ * zeroes ahead of time when it has one
+ * @return Address of the allocated page
+ */
+extern void* alloc_zeroed_page(void);
+
+/**
+ * @brief Allocates the passed number of contiguous physical pages
+ * @details Buddy allocator: takes the smallest free power-of-two block that fits,
+ * splitting larger blocks as needed, and frees the pages past cnt again. O(log n).
+ * Panics if no block can be found that satisfies the request.
  * @param cnt Number of pages to allocate
  * @return Pointer to allocated pages
  */
 extern void* alloc_phys_pages(unsigned int cnt);
 
 /**
- * @brief Adds chunk consisting of passed count of pages at passed pointer back to
- * free chunk list.
- * @param pp Physical address of memory region to add back to free chunk list
+ * @brief Returns the passed count of pages at passed pointer to the allocator,
+ * merging each block with its buddy while the buddy is free. O(log n) per block.
+ * @param pp Physical address of memory region to free
  * @param cnt Number of pages being freed
  * @return None
  */
 extern void free_phys_pages(void* pp, unsigned int cnt);
 
 /**
- * @brief Counts the number of pages remaining in the free chunk list.
- * @return Number of pages remaining in the free chunk list
+ * @brief Looks up the frame database entry of a physical page
+ * @param pp Physical address anywhere in the page
+ * @return Frame database entry, or NULL if pp is not in RAM
+ */
+extern struct page* page_frame(const void* pp);
+
+/**
+ * @brief Takes one more reference to an allocated page. Pages come from
+ * alloc_phys_pages() with one reference each.
+ * @param pp Physical address of the page
+ * @return None
+ */
+extern void page_get(void* pp);
+
+/**
+ * @brief Drops one reference to a page and frees it when that was the last one
+ * @param pp Physical address of the page
+ * @return None
+ */
+extern void page_put(void* pp);
+
+/**
+ * @brief Counts the number of free physical pages. O(1).
+ * @return Number of free physical pages
  */
 extern unsigned long free_phys_page_count(void);
 
+/**
+ * @brief Does one step of background memory work: zeroes a page-table page for reuse or
+ * refills the zeroed page pool. Called by the idle thread, which keeps calling while it
+ * returns nonzero.
+ * @return 1 if work was done, 0 if there is nothing left to do
+ */
+extern int memory_idle(void);
+
 /**
  * @brief Called by handle_umode_exception() in excp.c to
- * handle U mode load and store page faults. It returns 1 to indicate the fault
+ * handle U mode load and store page faults. Stores to pages shared copy-on-write
+ * are resolved by copying the page, and faults inside a lazy range of the process
+ * by mapping a zero-filled page. It returns 1 to indicate the fault
  * has been handled (the instruction should be restarted) and 0 to indicate that
  * the page fault is fatal and the process should be terminated.
  * @param tfr Trap frame for page fault (unused)
@@ -92,44 +92,77 @@ int process_exec(struct uio *exefile, int argc, char **argv) {
 
   kprintf("process_exec: starting\n");
   
-  if (!procmgr_initialized || exefile == NULL || argc < 0)
+  /* We own the caller's reference to exefile and release it on every return */
+  if (!procmgr_initialized || exefile == NULL || argc < 0) {
+    if (exefile != NULL)
+      uio_close(exefile);
     return -EINVAL;
+  }
   
   /* Step 1: Copy argv strings to kernel heap */
   char **kargv = kmalloc((argc + 1) * sizeof(char *));
-  if (!kargv)
+  if (!kargv) {
+    uio_close(exefile);
     return -ENOMEM;
+  }
 
   int from_kernel = ((uintptr_t)argv >= RAM_START_PMA);
+  char *argbuf = kmalloc(HEAP_ALLOC_MAX); // one user string at a time
+  if (!argbuf) {
+    kfree(kargv);
+    uio_close(exefile);
+    return -ENOMEM;
+  }
 
   for (i = 0; i < argc; i++) {
-    if (!from_kernel) {
-      if (validate_vptr(&argv[i], sizeof(char *), PTE_U | PTE_R) != 0 ||
-          validate_vstr(argv[i], PTE_U | PTE_R) != 0) {
+    const char *arg;
+    long len;
+
+    if (from_kernel) {
+      arg = argv[i];
+      len = strlen(arg);
+    } else {
+      /* User pointers and strings are copied in with fault recovery */
+      len = copyin(&arg, &argv[i], sizeof(char *));
+      if (len == 0)
+        len = copyinstr(argbuf, arg, HEAP_ALLOC_MAX);
+      if (len < 0) {
         while (--i >= 0)
           kfree(kargv[i]);
         kfree(kargv);
-        return -EINVAL;
+        kfree(argbuf);
+        uio_close(exefile);
+        return len;
       }
+      arg = argbuf;
     }
-      size_t len = strlen(argv[i]) + 1;
-      kargv[i] = kmalloc(len);
-      if (!kargv[i]) {
-        while (--i >= 0)
-          kfree(kargv[i]);
-        kfree(kargv);
-        return -ENOMEM;
-      }
-      memcpy(kargv[i], argv[i], len);
+
+    kargv[i] = kmalloc(len + 1);
+    if (!kargv[i]) {
+      while (--i >= 0)
+        kfree(kargv[i]);
+      kfree(kargv);
+      kfree(argbuf);
+      uio_close(exefile);
+      return -ENOMEM;
     }
+    memcpy(kargv[i], arg, len + 1);
+  }
+  kfree(argbuf);
   kargv[argc] = NULL;
 
   kprintf("process_exec: copied %d args to kernel\n", argc);
 
   /* --- STEP 2: Unmap memory space of previous processes ---  */
 
+  struct process *self = current_process();
+  sync_mregions(self->mregions, NULL); // dirty mapped pages go back to their files first
+
   reset_active_mspace(); // (a) v mem of other processes are unmapped
 
+  free_mregions(self->mregions); // lazy ranges and mappings went with the old image
+  self->mregions = NULL;
+
   kprintf("process_exec: reset memory space, loading ELF...\n");
 
   /* --- STEP 3: Load ELF ---  */
@@ -151,7 +184,7 @@ int process_exec(struct uio *exefile, int argc, char **argv) {
 
   /* --- STEP 4: Build stack using helper function ---  */
 
-  stack_page = alloc_phys_page();
+  stack_page = alloc_zeroed_page();
   if (!stack_page) {
     kprintf("process_exec: stack alloc failed\n");
     for (i = 0; i < argc; i++) 
@@ -181,6 +214,18 @@ int process_exec(struct uio *exefile, int argc, char **argv) {
     return -ENOMEM;
   }
 
+  /* Rest of the stack, below the argument page, is faulted in as it grows */
+  rc = add_lazy_range(USTACK_LOW_VMA, stack_vaddr - USTACK_LOW_VMA,
+                      PTE_R | PTE_W | PTE_U);
+  if (rc != 0) {
+    for (i = 0; i < argc; i++)
+      kfree(kargv[i]);
+    kfree(kargv);
+    return rc;
+  }
+
+  self->brk = UHEAP_START_VMA; // empty heap, grown by sbrk
+
   /* --- STEP 6: Free kernel copies ---  */
   for (i = 0; i < argc; i++)
     kfree(kargv[i]);
@@ -253,6 +298,9 @@ int process_fork(const struct trap_frame *parent_tfr) {
 
   memset(child, 0, sizeof(*child));
 
+  // Write dirty mapped pages back so the clone can share them clean, without COW
+  sync_mregions(running_thread_process()->mregions, NULL);
+
   // Clone parent's memory space 
   mtag_t newtag = clone_active_mspace();
   if (!newtag) {
@@ -260,6 +308,16 @@ int process_fork(const struct trap_frame *parent_tfr) {
     return -ENOMEM;
   }
   child->mtag = newtag;
+  child->brk = running_thread_process()->brk;
+
+  // Child sees the same lazy ranges; pages already touched were shared by the clone
+  if (clone_mregions(running_thread_process()->mregions, &child->mregions) != 0) {
+    mtag_t saved = switch_mspace(newtag);
+    discard_active_mspace();
+    switch_mspace(saved);
+    kfree(child);
+    return -ENOMEM;
+  }
 
   // Create a condition variable so parent waits until child copies trap frame
   struct condition done;
@@ -268,6 +326,7 @@ int process_fork(const struct trap_frame *parent_tfr) {
   // Allocate memory to store a copy of trap frame for child to use
   struct trap_frame *kid_tfr = kmalloc(sizeof(struct trap_frame));
   if (!kid_tfr) {
+    free_mregions(child->mregions);
     mtag_t saved = switch_mspace(newtag);
     discard_active_mspace();
     switch_mspace(saved);
@@ -287,6 +346,7 @@ int process_fork(const struct trap_frame *parent_tfr) {
 
   if (child->tid < 0) {
     kfree(kid_tfr);
+    free_mregions(child->mregions);
     mtag_t saved = switch_mspace(newtag);
     discard_active_mspace();
     switch_mspace(saved);
@@ -358,8 +418,11 @@ void process_exit(void) {
     }
   }
 
-  // Step 2: discard memory space
+  // Step 2: write back dirty mapped pages, then discard memory space and the lazy ranges that described it
+  sync_mregions(proc->mregions, NULL);
   discard_active_mspace();
+  free_mregions(proc->mregions);
+  proc->mregions = NULL;
 
   // Step 3: remove from proctab and free struct (but not main_proc)
   if (proc != &main_proc) {
@@ -32,6 +32,8 @@
 struct process {
     int tid;                             // thread id of our thread
     mtag_t mtag;                         // memory space
+    struct mregion* mregions;            // demand-paged ranges of the memory space
+    uintptr_t brk;                       // end of the sbrk heap
     struct uio* uiotab[PROCESS_UIOMAX];  // IO objects associated with current process
 };
 
@@ -60,7 +62,8 @@ extern void procmgr_init(void);
  * the process image from the given ELF, sets up the trap frame and jumps to user
  * space. On success, this function does not return. On failure, it terminates
  * the thread.
- * @param exeio Pointer to I/O struct of executable to execute
+ * @param exeio Pointer to I/O struct of executable to execute. process_exec takes over the
+ * caller's reference and closes it, also when it fails.
  * @param argc Number of arguments in argv
  * @param argv Array of arguments
  * @return None
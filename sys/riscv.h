@@ -251,6 +251,35 @@ static inline unsigned long csrrw_satp(unsigned long new_val) {
  */
 static inline void sfence_vma(void) { asm inline("sfence.vma" ::: "memory"); }
 
+/**
+ * @brief This function flushes the non-global translations of one address space
+ * @param asid Address space identifier to flush
+ * @return None
+ */
+static inline void sfence_vma_asid(unsigned long asid) {
+    asm inline("sfence.vma zero, %0" ::"r"(asid) : "memory");
+}
+
+/**
+ * @brief This function flushes the translations of one page in every address space,
+ * global ones included
+ * @param vma Virtual address in the page to flush
+ * @return None
+ */
+static inline void sfence_vma_addr(unsigned long vma) {
+    asm inline("sfence.vma %0, zero" ::"r"(vma) : "memory");
+}
+
+/**
+ * @brief This function flushes the non-global translation of one page in one address space
+ * @param vma Virtual address in the page to flush
+ * @param asid Address space identifier to flush
+ * @return None
+ */
+static inline void sfence_vma_addr_asid(unsigned long vma, unsigned long asid) {
+    asm inline("sfence.vma %0, %1" ::"r"(vma), "r"(asid) : "memory");
+}
+
 /**
  * @brief This function gets the value in the mtime register
  * @return value in the mtime register
@@ -14,6 +14,7 @@
 #define SYSCALL_WAIT 3    // wait for a child to exit
 #define SYSCALL_PRINT 4   // print a message to the console
 #define SYSCALL_USLEEP 5  // sleep for some number of microseconds
+#define SYSCALL_SBRK 6    // grow the heap
 
 #define SYSCALL_FSCREATE 10  // create a file
 #define SYSCALL_FSDELETE 11  // delete a file
@@ -44,6 +44,7 @@ static int sysfork(const struct trap_frame *tfr);
 static int syswait(int tid);
 static int sysprint(const char *msg);
 static int sysusleep(unsigned long us);
+static long syssbrk(long incr);
 
 static int sysfsdelete(const char *path);
 static int sysfscreate(const char *path);
@@ -106,6 +107,9 @@ int64_t syscall(const struct trap_frame *tfr) {
     if(tfr->a7 == SYSCALL_USLEEP){
         return sysusleep((unsigned long)tfr->a0); // sleep for microseconds
     }
+    if(tfr->a7 == SYSCALL_SBRK){
+        return syssbrk((long)tfr->a0); // grow the heap
+    }
 
     if(tfr->a7 == SYSCALL_FSCREATE){
         return sysfscreate((const char *)tfr->a0); // create filesystem object
@@ -167,7 +171,6 @@ int sysexit(void) {
 int sysexec(int fd, int argc, char **argv) { 
     struct process *p; // current process
     struct uio *x; // executable handle
-    int ret; // temp for error codes
 
     if((unsigned)fd >= 16){
         return -EBADFD; // fd out of range
@@ -182,22 +185,9 @@ int sysexec(int fd, int argc, char **argv) {
         return -EBADFD; // fd not open
     }
 
-    if(argc > 0){
-        ret = validate_vptr(argv, (argc + 1) * sizeof(char *), PTE_U | PTE_R); // check argv array
-        if(ret < 0){
-            return ret;
-        }
-        for(int i = 0; i < argc; i++){
-            ret = validate_vstr(argv[i], PTE_U | PTE_R); // check each argument string
-            if(ret < 0){
-                return ret;
-            }
-        }
-    }
-
     uio_addref(x); // keep uio alive for new program
     sysclose(fd); // close caller's fd
-    return process_exec(x, argc, argv); 
+    return process_exec(x, argc, argv); // copies argv in with copyin/copyinstr
 }
 
 /**
@@ -225,21 +215,28 @@ int syswait(int tid) {
 
 /**
  * @brief Prints to console via kprintf
- * @details Validates that msg string is valid via validate_vstr and pages are mapped, calls kprintf
- * on current running process
+ * @details Copies msg in with copyinstr a buffer at a time and prints each piece with kprintf
  * @param msg string msg in userspace
- * @return 0 on sucess else error from validate_vstr
+ * @return 0 on sucess else error from copyinstr
  */
 
 int sysprint(const char *msg) {
-    int ret= validate_vstr(msg, PTE_U | PTE_R); // check that msg is a valid user string
-    if(ret < 0){
-        return ret; // return error if invalid
-    }
+    char buf[256];
+    long ret;
 
-    kprintf("%s", msg); // print the string to console
+    for(;;){
+        ret = copyinstr(buf, msg, sizeof(buf)); // next piece of the user string
+        if(ret < 0 && ret != -EINVAL){
+            return ret; // not readable
+        }
 
-    return 0;
+        kprintf("%s", buf); // print the piece to console
+
+        if(ret >= 0){
+            return 0; // that was the end of it
+        }
+        msg += sizeof(buf) - 1; // buffer was full, continue after it
+    }
 }
 
 /**
@@ -256,6 +253,39 @@ int sysusleep(unsigned long us) {
     return 0*0; // always return 0
 }
 
+/**
+ * @brief Grows the heap of the current process
+ * @details Only reserves address space: the new pages are a lazy range, so physical memory is
+ * committed page by page as the process touches it. The heap cannot shrink.
+ * @param incr number of bytes to add to the heap, 0 to query the current break
+ * @return previous break on success, -EINVAL if incr is negative, -ENOMEM if the heap would run
+ * into the stack guard
+ */
+
+long syssbrk(long incr) {
+    struct process *p = current_process(); // caller's process
+    uintptr_t old_brk = p->brk; // break to hand back
+    uintptr_t mapped = ROUND_UP(old_brk, PAGE_SIZE); // end of the pages already reserved
+    int ret;
+
+    if(incr < 0){
+        return -EINVAL; // no shrinking
+    }
+    if(incr > UHEAP_END_VMA - old_brk){
+        return -ENOMEM; // would reach the mapping window
+    }
+
+    if(ROUND_UP(old_brk + incr, PAGE_SIZE) > mapped){
+        ret = add_lazy_range(mapped, ROUND_UP(old_brk + incr, PAGE_SIZE) - mapped, PTE_R | PTE_W | PTE_U); // reserve only
+        if(ret < 0){
+            return ret;
+        }
+    }
+
+    p->brk = old_brk + incr; // move the break
+    return (long)old_brk;
+}
+
 /**
  * @brief Creates a new file in the filesystem specified by the path.
  * @details Validates and parses the user provided path for mountpoint name, file name and calls
@@ -270,14 +300,11 @@ int sysfscreate(const char *path) {
     char *mnt;
     char *fname;
 
-    ret = validate_vstr(path, PTE_U | PTE_R); // ensure path string is a valid user pointer
+    ret = copyinstr(buf, path, sizeof(buf)); // copy path into kernel buffer
     if(ret < 0){
         return ret;
     }
 
-    strncpy(buf, path, sizeof(buf)); // copy path into kernel buffer
-    buf[sizeof(buf)-1] = '\0'; // guarantee NUL termination
-
     ret = parse_path(buf, &mnt, &fname); // split into mount point and filename
     if(ret < 0){
         return ret;
@@ -300,16 +327,11 @@ int sysfsdelete(const char *path) {
     char *mount;
     char *l;
 
-    ret = validate_vstr(path, PTE_U | PTE_R); // check that path is a valid user string
+    ret = copyinstr(buf, path, sizeof(buf)); // copy path into kernel buffer
     if(ret < 0){
         return ret;
-
-
     }
 
-    strncpy(buf, path, sizeof(buf)); // copy path into kernel buffer
-    buf[sizeof(buf)-1] = '\0'; // ensure NUL termination
-
     ret = parse_path(buf, &mount, &l); // split into mount and leaf name
     if(ret < 0){
 
@@ -338,14 +360,11 @@ int sysopen(int fd, const char *path) {
     struct process *proc = 0;
     struct uio *handle = 0;
 
-    ret = validate_vstr(path, PTE_U | PTE_R); // verify user path string
+    ret = copyinstr(buf, path, sizeof(buf)); // copy path into kernel buffer
     if(ret < 0){
         return ret;
     }
 
-    strncpy(buf, path, sizeof(buf)); // copy path into kernel buffer
-    buf[sizeof(buf)-1] = 0; // ensure NUL termination
-
     ret = parse_path(buf, &mount, &name); // split into mount and name
     if(ret < 0){
         return ret;
@@ -413,7 +432,7 @@ int sysclose(int fd) {
 /**
  * @brief Calls read function of file io on given buffer
  * @details get current process, valid file descriptor checks, find io struct via file descriptor,
- * validate buffer, call ioread with given buffer
+ * fault in the buffer with probe_vptr, call ioread with given buffer
  * @param fd file descriptor number
  * @param buf pointer to buffer
  * @param bufsz number of bytes to be read
@@ -442,9 +461,9 @@ long sysread(int fd, void *buf, size_t bufsz) {
         return -EBADFD; // fd not open
     }
     
-    ret = validate_vptr(buf, bufsz, PTE_U | PTE_W); // verify user buffer is writable
+    ret = probe_vptr(buf, bufsz, PTE_W); // fault in the user buffer, writable
     if(ret < 0){
-        return ret; // return validation error
+        return ret; // not user memory or not writable
     }
 
     return uio_read(x, buf, (unsigned long)bufsz); // perform the actual read
@@ -453,7 +472,7 @@ long sysread(int fd, void *buf, size_t bufsz) {
 /**
  * @brief Calls write function of file io on given buffer
  * @details get current process, valid file descriptor checks, find io struct via file descriptor,
- * validate buffer, call iowrite with given buffer
+ * fault in the buffer with probe_vptr, call iowrite with given buffer
  * @param fd file descriptor number
  * @param buf pointer to buffer
  * @param len number of bytes to be written
@@ -472,7 +491,7 @@ long syswrite(int fd, const void *buf, size_t len) {
 
     if(ret >= 0){
         if(len > 0){
-            ret = validate_vptr(buf, len, PTE_U | PTE_R); // check user buffer is readable
+            ret = probe_vptr(buf, len, PTE_R); // fault in the user buffer
             if(ret >= 0){
                 ret = uio_write(x, buf, (unsigned long)len); // perform write to device/file
             }
@@ -488,7 +507,7 @@ long syswrite(int fd, const void *buf, size_t len) {
 /**
  * @brief Calls device input output commands for a given device instance
  * @details get current process, valid file descriptor checks, find io struct via file descriptor,
- * ensure that fcntl type exists, validate argument pointer, issue fcntl
+ * ensure that fcntl type exists, copy the argument in, issue fcntl on the copy and copy it back out
  * @param fd file descriptor number
  * @param cmd selection of fcntl
  * @param arg pointer to arguments
@@ -508,12 +527,24 @@ int sysfcntl(int fd, int cmd, void *arg) {
     }
 
 
+    unsigned long long karg = 0; // kernel copy of the argument
+
     if(ret >= 0 && arg != NULL){
-        ret = validate_vptr(arg, sizeof(unsigned long long), PTE_U | PTE_R | PTE_W); // check arg buffer
+        ret = copyin(&karg, arg, sizeof(karg)); // fetch the argument
+        if(ret >= 0){
+            ret = copyout(arg, &karg, sizeof(karg)); // and make sure the result can go back
+        }
     }
 
     if(ret >= 0){
-        ret = uio_cntl(x, cmd, arg); // issue device/filesys control
+        ret = uio_cntl(x, cmd, arg != NULL ? &karg : NULL); // issue device/filesys control
+    }
+
+    if(ret >= 0 && arg != NULL){
+        int cret = copyout(arg, &karg, sizeof(karg)); // hand back what the command wrote
+        if(cret < 0){
+            ret = cret;
+        }
     }
 
     return ret; // return result or error
@@ -540,21 +571,18 @@ int syspipe(int *wfdptr, int *rfdptr) {
     int rfd = -1;
     int i;
 
-    ret = validate_vptr(wfdptr, sizeof(int), PTE_U | PTE_R | PTE_W); // validate write-fd pointer
+    ret = copyin(&wfd_req, wfdptr, sizeof(int)); // requested write fd
     if(ret < 0){
         return ret;
     }
 
-    ret = validate_vptr(rfdptr, sizeof(int), PTE_U | PTE_R | PTE_W); // validate read-fd pointer
+    ret = copyin(&rfd_req, rfdptr, sizeof(int)); // requested read fd
     if(ret < 0){
         return ret;
     }
 
     p = current_process(); // get current process
 
-    wfd_req = *wfdptr; // requested write fd
-    rfd_req = *rfdptr; // requested read fd
-
     if(wfd_req >= 0){
         if(wfd_req >= 16 || p->uiotab[wfd_req] != NULL){
             ret = -EBADFD; // invalid or in-use write fd
@@ -613,12 +641,19 @@ int syspipe(int *wfdptr, int *rfdptr) {
         return ret;
     }
 
+    ret = copyout(wfdptr, &wfd, sizeof(int)); // return write fd to user
+    if(ret >= 0){
+        ret = copyout(rfdptr, &rfd, sizeof(int)); // return read fd to user
+    }
+    if(ret < 0){
+        uio_close(wio); // user never learns the fds, drop the pipe
+        uio_close(rio);
+        return ret;
+    }
+
     p->uiotab[wfd] = wio; // install write end
     p->uiotab[rfd] = rio; // install read end
 
-    *wfdptr = wfd; // return write fd to user
-    *rfdptr = rfd; // return read fd to user
-
     return 0; // success
 }
 
@@ -789,6 +789,12 @@ void idle_thread_func(void) {
 
         while (!tlempty(&ready_list))
             running_thread_yield();
+
+        // Use the idle time to prepare memory (zeroed pages) for
+        // later, one page at a time so a newly ready thread waits little.
+
+        if (memory_idle())
+            continue;
         
         // No runnable threads. Sleep using the wfi instruction. Note that we
         // need to disable interrupts and check the runnable thread list one
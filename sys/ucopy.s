@@ -0,0 +1,149 @@
+# ucopy.s - user memory access with fault recovery
+#
+# Copyright (c) 2024-2025 University of Illinois
+# SPDX-License-identifier: NCSA
+#
+
+# The routines below touch user memory without looking at the page table
+# first. Every instruction that accesses memory is listed in the exception
+# fixup table (section .extab) together with a fixup address. When one of them
+# faults and the fault cannot be resolved like a U mode fault would be (lazy
+# page, copy-on-write page), handle_smode_exception resumes execution at the
+# fixup address, which returns -EACCESS to the caller.
+#
+# The callers in memory.c check that the range lies in user space. User pages
+# are accessible because sstatus.SUM is always set in S mode.
+#
+# Each table entry is a pair of doublewords:
+#
+#   struct extab_entry {
+#       uintptr_t insn;
+#       uintptr_t fixup;
+#   };
+
+        .equ    EINVAL, 1
+        .equ    EACCESS, 7
+
+        .macro  EXTAB insn, fixup
+        .pushsection .extab, "a"
+        .balign 8
+        .dword  \insn, \fixup
+        .popsection
+        .endm
+
+        .text
+
+# long _ucopy(void * dst, const void * src, size_t n)
+#
+# Copies _n_ bytes from _src_ to _dst_, a doubleword at a time while both are
+# aligned. Returns 0, or -EACCESS if an access faulted.
+
+        .global _ucopy
+        .type   _ucopy, @function
+_ucopy:
+        or      t0, a0, a1
+        andi    t0, t0, 7
+        bnez    t0, ucopy_bytes
+        li      t1, 8
+
+ucopy_dwords:
+        bltu    a2, t1, ucopy_bytes
+ucopy_ld:
+        ld      t2, 0(a1)
+ucopy_sd:
+        sd      t2, 0(a0)
+        addi    a0, a0, 8
+        addi    a1, a1, 8
+        addi    a2, a2, -8
+        j       ucopy_dwords
+
+ucopy_bytes:
+        beqz    a2, ucopy_done
+ucopy_lb:
+        lbu     t2, 0(a1)
+ucopy_sb:
+        sb      t2, 0(a0)
+        addi    a0, a0, 1
+        addi    a1, a1, 1
+        addi    a2, a2, -1
+        j       ucopy_bytes
+
+ucopy_done:
+        li      a0, 0
+        ret
+
+        EXTAB   ucopy_ld, ucopy_fault
+        EXTAB   ucopy_sd, ucopy_fault
+        EXTAB   ucopy_lb, ucopy_fault
+        EXTAB   ucopy_sb, ucopy_fault
+
+# long _ucopystr(char * dst, const char * src, size_t n)
+#
+# Copies the string at _src_ to _dst_, writing at most _n_ bytes (n > 0). The
+# copy is always terminated. Returns the length of the string, -EINVAL if it
+# did not fit (a byte other than NUL landed in the last slot), or -EACCESS if
+# an access faulted.
+
+        .global _ucopystr
+        .type   _ucopystr, @function
+_ucopystr:
+        mv      t0, a0
+        add     t2, a0, a2
+        addi    t2, t2, -1              # last slot of dst
+
+ucopystr_loop:
+ucopystr_lb:
+        lbu     t1, 0(a1)
+ucopystr_sb:
+        sb      t1, 0(a0)
+        beqz    t1, ucopystr_done
+        beq     a0, t2, ucopystr_full
+        addi    a0, a0, 1
+        addi    a1, a1, 1
+        j       ucopystr_loop
+
+ucopystr_done:
+        sub     a0, a0, t0
+        ret
+
+ucopystr_full:
+ucopystr_sb0:
+        sb      zero, 0(a0)
+        li      a0, -EINVAL
+        ret
+
+        EXTAB   ucopystr_lb, ucopy_fault
+        EXTAB   ucopystr_sb, ucopy_fault
+        EXTAB   ucopystr_sb0, ucopy_fault
+
+# long _uprobe(const void * addr, int write)
+#
+# Touches the byte at _addr_ so that its page is mapped when the caller
+# accesses it directly. A write probe is an atomic OR of zero into the aligned
+# word holding the byte: it needs write access but leaves the contents alone.
+# Returns 0, or -EACCESS if the access faulted.
+
+        .global _uprobe
+        .type   _uprobe, @function
+_uprobe:
+        bnez    a1, uprobe_write
+uprobe_lb:
+        lbu     t0, 0(a0)
+        li      a0, 0
+        ret
+
+uprobe_write:
+        andi    a0, a0, -4
+uprobe_amo:
+        amoor.w zero, zero, (a0)
+        li      a0, 0
+        ret
+
+        EXTAB   uprobe_lb, ucopy_fault
+        EXTAB   uprobe_amo, ucopy_fault
+
+ucopy_fault:
+        li      a0, -EACCESS
+        ret
+
+        .end
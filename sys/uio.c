@@ -20,6 +20,7 @@
 #include "heap.h"
 #include "memory.h"
 #include "misc.h"
+#include "process.h"
 #include "string.h"
 #include "thread.h"
 #include "intr.h"
@@ -35,6 +36,9 @@ static void pipe_close_writer(struct uio *uio);
 static void pipe_close_reader(struct uio *uio);
 static long pipe_read_endpoint(struct uio *uio, void *buf, unsigned long bufsz);
 static long pipe_write_endpoint(struct uio *uio, const void *buf, unsigned long buflen);
+
+static int uio_mmap(struct uio* uio, void** vpp);
+static int uio_msync(struct uio* uio);
 // static void pipe_free_backing(struct pipe_chan *chan);
 
 
@@ -113,12 +117,84 @@ long uio_write(struct uio* uio, const void* buf, unsigned long buflen) {
 }
 
 int uio_cntl(struct uio* uio, int op, void* arg) {
+    // Memory mapping works the same way for every endpoint that can be read at a position
+
+    if (op == FCNTL_MMAP && uio->intf->fetch != NULL)
+        return uio_mmap(uio, arg);
+
+    if (op == FCNTL_MSYNC && uio->intf->fetch != NULL)
+        return uio_msync(uio);
+
     if (uio->intf->cntl != NULL)
         return uio->intf->cntl(uio, op, arg);
     else
         return -ENOTSUP;
 }
 
+long uio_fetch(struct uio* uio, unsigned long long pos, void* buf, unsigned long bufsz) {
+    if (uio->intf->fetch != NULL) {
+        if (0 <= (long)bufsz)
+            return uio->intf->fetch(uio, pos, buf, bufsz);
+        else
+            return -EINVAL;
+    } else
+        return -ENOTSUP;
+}
+
+long uio_store(struct uio* uio, unsigned long long pos, const void* buf, unsigned long buflen) {
+    if (uio->intf->store != NULL) {
+        if (0 <= (long)buflen)
+            return uio->intf->store(uio, pos, buf, buflen);
+        else
+            return -EINVAL;
+    } else
+        return -ENOTSUP;
+}
+
+int uio_getpage(struct uio* uio, unsigned long long pos, void** pagep) {
+    if (uio->intf->getpage != NULL)
+        return uio->intf->getpage(uio, pos, pagep);
+    else
+        return -ENOTSUP;
+}
+
+// Maps the whole endpoint into the current process (FCNTL_MMAP). The mapping is writable
+// if the endpoint can be written back, read-only otherwise.
+
+static int uio_mmap(struct uio* uio, void** vpp) {
+    unsigned long long end;
+    int flags = PTE_R | PTE_U;
+    int result;
+
+    if (vpp == NULL) return -EINVAL;
+
+    result = uio_cntl(uio, FCNTL_GETEND, &end);
+
+    if (result < 0) return result;
+
+    if (uio->intf->store != NULL) flags |= PTE_W;
+
+    return map_uio_range(uio, end, flags, vpp);
+}
+
+// Writes the current process's dirty pages of this endpoint back (FCNTL_MSYNC), then lets
+// the endpoint flush whatever it cached
+
+static int uio_msync(struct uio* uio) {
+    struct process* proc = current_process();
+    int result;
+
+    if (proc == NULL) return -EINVAL;
+
+    result = sync_mregions(proc->mregions, uio);
+
+    if (result < 0 || uio->intf->cntl == NULL) return result;
+
+    result = uio->intf->cntl(uio, FCNTL_MSYNC, NULL);
+
+    return (result == -ENOTSUP) ? 0 : result;
+}
+
 unsigned long uio_refcnt(const struct uio* uio) {
     assert(uio != NULL);
     return uio->refcnt;
@@ -62,6 +62,39 @@ extern long uio_write(struct uio *uio, const void *buf, unsigned long buflen);
  */
 extern int uio_cntl(struct uio *uio, int op, void *arg);
 
+/**
+ * @brief Calls backing endpoint's _fetch_, reading at a position without moving the endpoint's
+ * own position
+ * @param uio Pointer to uio struct of backing endpoint to read from
+ * @param pos Byte position to read from
+ * @param buf Buffer for backing endpoint to copy data into
+ * @param bufsz Size of passed buffer in bytes
+ * @return Number of bytes read, error if backing endpoint doesn't support _fetch_
+ */
+extern long uio_fetch(struct uio *uio, unsigned long long pos, void *buf, unsigned long bufsz);
+
+/**
+ * @brief Calls backing endpoint's _store_, writing at a position without moving the endpoint's
+ * own position
+ * @param uio Pointer to uio struct of backing endpoint to write to
+ * @param pos Byte position to write at
+ * @param buf Buffer for backing endpoint to copy data from
+ * @param buflen Number of bytes to write
+ * @return Number of bytes written, error if backing endpoint doesn't support _store_
+ */
+extern long uio_store(struct uio *uio, unsigned long long pos, const void *buf,
+                      unsigned long buflen);
+
+/**
+ * @brief Calls backing endpoint's _getpage_, getting the cached page that holds a page of the
+ * endpoint
+ * @param uio Pointer to uio struct of backing endpoint
+ * @param pos Byte position of the page, aligned to PAGE_SIZE
+ * @param pagep Set to the page, which carries a reference for the caller
+ * @return 0 on success, error if backing endpoint doesn't support _getpage_
+ */
+extern int uio_getpage(struct uio *uio, unsigned long long pos, void **pagep);
+
 /**
  * @brief Creates a unidirectional pipe
  * @details Allocates memory for the pipe struct and initializes all necessary parts for the pipe
@@ -95,7 +128,12 @@ extern void create_pipe(struct uio **wptr, struct uio **rptr);
 #define FCNTL_GETPOS 2  // arg is unsigned long long *
 #define FCNTL_SETPOS 3  // arg is unsigned long long *
 
-#define FCNTL_MMAP 4  // arg is void **
+#define FCNTL_MMAP 4   // arg is void ** (address of the mapping is returned through it)
+#define FCNTL_MSYNC 5  // arg is unused; writes the caller's dirty mapped pages back
+
+// FCNTL_MMAP maps the whole endpoint read-write into the calling process. It works on every
+// uio with a _fetch_ operation (KTFS files, storage devices). Pages are read in when first
+// touched. Dirty pages are written back by FCNTL_MSYNC and when the process exits or execs.
 
 // See also device.h for device-specific fcntl values
 
@@ -45,6 +45,36 @@ struct uio_intf {
      * @param arg Argument for operation
      */
     int (*cntl)(struct uio* uio, int op, void* arg);
+
+    /**
+     * @brief Reads from random access I/O endpoint without moving its position. Endpoints that
+     * provide it can be memory-mapped (FCNTL_MMAP); the page fault handler fills pages with it.
+     * @param uio A random access I/O endpoint
+     * @param pos Byte position to read from
+     * @param buf buffer read into
+     * @param bufsz buffer size in bytes
+     */
+    long (*fetch)(struct uio* uio, unsigned long long pos, void* buf, unsigned long bufsz);
+
+    /**
+     * @brief Writes to random access I/O endpoint without moving its position or extending it.
+     * Used to write dirty pages of a memory mapping back.
+     * @param uio A random access I/O endpoint
+     * @param pos Byte position to write at
+     * @param buf Buffer to read from
+     * @param buflen Number of bytes to write
+     */
+    long (*store)(struct uio* uio, unsigned long long pos, const void* buf, unsigned long buflen);
+
+    /**
+     * @brief Hands out the page of the endpoint's page cache that holds the data at a position,
+     * with a reference (page_get) the caller must drop. Lets a memory mapping use the cached page
+     * in place of a copy.
+     * @param uio A random access I/O endpoint
+     * @param pos Byte position of the page, aligned to PAGE_SIZE
+     * @param pagep Set to the cached page
+     */
+    int (*getpage)(struct uio* uio, unsigned long long pos, void** pagep);
 };
 
 /**
@@ -16,6 +16,16 @@
 
 #include <stddef.h>
 
+// COMPILE-TIME CONFIGURATION
+//
+
+/**
+ *  @brief Least number of bytes the heap is grown by when it runs out
+ */
+#ifndef HEAP_GROW_MIN
+#define HEAP_GROW_MIN (64 * 1024)
+#endif
+
 // INTERNAL GLOBAL VARIABLES
 //
 
@@ -55,8 +65,18 @@ void * malloc(size_t size) {
         return NULL;
 
     if (size > heap_end - heap_low) {
-        _print("Heap Overflow");
-        _exit();
+        // Grow the heap; the kernel only reserves the space, pages come on first touch
+        size_t grow = size - (heap_end - heap_low);
+
+        if (grow < HEAP_GROW_MIN)
+            grow = HEAP_GROW_MIN;
+
+        if ((long)_sbrk(grow) < 0) {
+            _print("Heap Overflow");
+            _exit();
+        }
+
+        heap_end += grow;
     }
 
     ptr = heap_low;
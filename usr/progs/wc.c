@@ -1,4 +1,10 @@
 #include "syscall.h"
+#include "uio.h"
+
+struct counts {
+  long lines, words, bytes;
+  int inword;
+};
 
 static void putnum(long v) {
   char buf[32];
@@ -15,6 +21,24 @@ static void putnum(long v) {
     _write(1, &buf[i], 1);
 }
 
+static void count(struct counts *c, const char *buf, long n) {
+  c->bytes += n;
+  for (long i = 0; i < n; i++) {
+    char ch = buf[i];
+    if (ch == '\n')
+      c->lines++;
+
+    if (ch == ' ' || ch == '\n' || ch == '\t') {
+      if (c->inword) {
+        c->words++;
+        c->inword = 0;
+      }
+    } else {
+      c->inword = 1;
+    }
+  }
+}
+
 void main(int argc, char *argv[]) {
   int fd = 0;
 
@@ -26,37 +50,29 @@ void main(int argc, char *argv[]) {
     }
   }
 
-  long lines = 0, words = 0, bytes = 0;
+  struct counts c = {0, 0, 0, 0};
   char buf[512];
+  unsigned long long len;
+  char *map;
   int n;
-  int inword = 0;
-
-  while ((n = _read(fd, buf, sizeof(buf))) > 0) {
-    bytes += n;
-    for (int i = 0; i < n; i++) {
-      char c = buf[i];
-      if (c == '\n')
-        lines++;
 
-      if (c == ' ' || c == '\n' || c == '\t') {
-        if (inword) {
-          words++;
-          inword = 0;
-        }
-      } else {
-        inword = 1;
-      }
-    }
+  // A file is counted straight from a mapping of it, without any reads
+  if (argc > 1 && _fcntl(fd, FCNTL_GETEND, &len) == 0 && len > 0 &&
+      _fcntl(fd, FCNTL_MMAP, &map) == 0) {
+    count(&c, map, (long)len);
+  } else {
+    while ((n = _read(fd, buf, sizeof(buf))) > 0)
+      count(&c, buf, n);
   }
 
-  if (inword)
-    words++;
+  if (c.inword)
+    c.words++;
 
-  putnum(lines);
+  putnum(c.lines);
   _write(1, "\t", 1);
-  putnum(words);
+  putnum(c.words);
   _write(1, "\t", 1);
-  putnum(bytes);
+  putnum(c.bytes);
   _write(1, "\n", 1);
 
   if (argc > 1)
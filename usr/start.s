@@ -9,16 +9,15 @@
         .global _start
         .type   _start, @function
 
-        .equ    USER_HEAP_START, 0xE0000000
-        .equ    USER_HEAP_END,   0xF0000000
-        
 _start:
         addi    sp, sp, -16
         sd      a0, 0(sp)
         sd      a1, 8(sp)     
 
-        li      a0, USER_HEAP_START
-        li      a1, USER_HEAP_END
+        # Heap starts out empty at the current break and grows with _sbrk
+        li      a0, 0
+        call    _sbrk
+        mv      a1, a0
         call    heap_init
 
         ld      a0, 0(sp)
@@ -57,6 +57,13 @@ extern void _print(const char * msg);
 */
 extern int _usleep(unsigned long us);
 
+/**
+* @brief Grows the heap by incr bytes. Only address space is reserved; pages are allocated on first touch.
+* @param incr Number of bytes to add, 0 to read the current break
+* @return Previous break, or a negative error code cast to a pointer (-ENOMEM when out of space)
+*/
+extern void * _sbrk(long incr);
+
 /**
 * @brief Deletes a file at a specified path
 * @param path string path to file
@@ -81,7 +81,8 @@ struct uioterm {
 #define FCNTL_GETPOS 2 // arg is unsigned long long *
 #define FCNTL_SETPOS 3 // arg is unsigned long long *
 
-#define FCNTL_MMAP   4 // arg is void **
+#define FCNTL_MMAP   4 // arg is void ** (address of the mapping is returned through it)
+#define FCNTL_MSYNC  5 // arg is unused; writes dirty mapped pages back
 
 // refcount functions
 /**